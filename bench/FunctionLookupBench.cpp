@@ -0,0 +1,125 @@
+#include <priv/FunctionIndex.h>
+#include <priv/FunctionLookup.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compares address to function lookups over a synthetic table of 1M functions
+//
+// "symbol pointers" mimics the original libbfd based lookup, a binary search
+// over individually allocated symbols that each point at their section.
+// "records" is a binary search over the packed function records and
+// "eytzinger" is FunctionLookupTable.
+
+namespace
+{
+    constexpr size_t k_functionCount = 1 << 20;
+    constexpr size_t k_lookupCount = 1 << 22;
+
+    struct Section
+    {
+        uint64_t filepos;
+    };
+
+    struct Symbol
+    {
+        uint64_t value;
+        Section* section;
+        char const* name;
+    };
+
+    template <typename Fn>
+    void Run(char const* name, std::vector<uint64_t> const& lookups, std::vector<size_t>& results, Fn const& fn)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups.size(); ++i)
+            results[i] = fn(lookups[i]);
+        auto end = std::chrono::steady_clock::now();
+
+        auto seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << name << ": " << static_cast<uint64_t>(lookups.size() / seconds) << " lookups/s" << std::endl;
+    }
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<uint64_t> gapDist(16, 512);
+
+    Section section{0x1000};
+    std::vector<eforce::FunctionRecord_t> records;
+    records.reserve(k_functionCount);
+    uint64_t offset = section.filepos;
+    for (size_t i = 0; i < k_functionCount; ++i)
+    {
+        auto size = gapDist(rng);
+        records.push_back(eforce::FunctionRecord_t{offset, offset + size, 0, 0});
+        offset += size;
+    }
+
+    // Allocate the symbols in a random order so they end up scattered on the
+    // heap like they would be after reading a real symbol table
+    std::vector<size_t> allocationOrder(k_functionCount);
+    for (size_t i = 0; i < allocationOrder.size(); ++i)
+        allocationOrder[i] = i;
+    std::shuffle(allocationOrder.begin(), allocationOrder.end(), rng);
+
+    std::vector<std::unique_ptr<Symbol>> symbolStorage(k_functionCount);
+    std::vector<Symbol*> symbols(k_functionCount);
+    for (auto i : allocationOrder)
+    {
+        symbolStorage[i].reset(new Symbol{records[i].start - section.filepos, &section, ""});
+        symbols[i] = symbolStorage[i].get();
+    }
+
+    eforce::FunctionLookupTable lookupTable;
+    if (!lookupTable.Build(records.data(), records.size()))
+    {
+        std::cerr << "Failed to build lookup table" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::uniform_int_distribution<uint64_t> lookupDist(records.front().start, records.back().end - 1);
+    std::vector<uint64_t> lookups(k_lookupCount);
+    for (auto& lookup : lookups)
+        lookup = lookupDist(rng);
+
+    std::vector<size_t> symbolResults(k_lookupCount);
+    std::vector<size_t> recordResults(k_lookupCount);
+    std::vector<size_t> eytzingerResults(k_lookupCount);
+
+    Run("symbol pointers", lookups, symbolResults, [&] (uint64_t lookup) {
+        auto nextFn = std::partition_point(symbols.cbegin(), symbols.cend(), [&] (Symbol const* symbol) {
+            return symbol->value + symbol->section->filepos <= lookup;
+        });
+        return static_cast<size_t>(nextFn - symbols.cbegin()) - 1;
+    });
+
+    Run("records", lookups, recordResults, [&] (uint64_t lookup) {
+        auto nextFn = std::upper_bound(records.cbegin(), records.cend(), lookup,
+            [] (uint64_t value, eforce::FunctionRecord_t const& function) {
+                return value < function.start;
+            });
+        return static_cast<size_t>(nextFn - records.cbegin()) - 1;
+    });
+
+    Run("eytzinger", lookups, eytzingerResults, [&] (uint64_t lookup) {
+        return lookupTable.Find(lookup);
+    });
+
+    if (symbolResults != recordResults || symbolResults != eytzingerResults)
+    {
+        std::cerr << "Lookup results differ" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+#include <eforce/Exception.h>
+#include <eforce/ExceptionForcer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Measures request latency on worker threads while another thread toggles a
+// forced exception as fast as it can
+//
+// With EFORCE_CODE_WRITER=mprotect every toggle changes page protections, and
+// every protection change has to be flushed from the TLB of every core running
+// one of our threads. This shows up as tail latency on threads that have
+// nothing to do with the function being patched. Compare against
+// EFORCE_CODE_WRITER=procmem, which never changes protections.
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr auto k_phaseDuration = std::chrono::seconds(1);
+    constexpr size_t k_requestBufferSize = 16 * 1024;
+
+    void ToggledFunction(int x)
+    {
+        if (x)
+            THROW_REGISTERED_EXCEPTION(std::runtime_error, "");
+    }
+
+    /**
+     * @brief Stands in for a request, touches a bit of memory and does a bit
+     *  of work
+     */
+    uint64_t Request(std::vector<uint8_t>& buffer, uint64_t seed)
+    {
+        uint64_t hash = seed;
+        for (size_t i = 0; i < buffer.size(); i += 64)
+        {
+            buffer[i] = static_cast<uint8_t>(hash);
+            hash = (hash ^ buffer[(i * 7) % buffer.size()]) * 0x100000001b3;
+        }
+
+        return hash;
+    }
+
+    struct Percentiles
+    {
+        double p50;
+        double p99;
+        double max;
+        size_t requests;
+    };
+
+    /**
+     * @brief Runs requests on workerCount threads for k_phaseDuration
+     * @return latency percentiles in microseconds across all workers
+     */
+    Percentiles RunWorkers(size_t workerCount)
+    {
+        std::vector<std::vector<double>> latencies(workerCount);
+        std::vector<std::thread> workers;
+        std::atomic<uint64_t> sink{0};
+        auto end = Clock::now() + k_phaseDuration;
+
+        for (size_t i = 0; i < workerCount; ++i)
+        {
+            workers.emplace_back([&, i] {
+                std::vector<uint8_t> buffer(k_requestBufferSize, static_cast<uint8_t>(i));
+                uint64_t hash = i;
+                while (true)
+                {
+                    auto start = Clock::now();
+                    if (start >= end)
+                        break;
+
+                    hash = Request(buffer, hash);
+                    auto elapsed = Clock::now() - start;
+                    latencies[i].push_back(std::chrono::duration<double, std::micro>(elapsed).count());
+                }
+
+                sink += hash;
+            });
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        std::vector<double> all;
+        for (auto const& workerLatencies : latencies)
+            all.insert(all.end(), workerLatencies.begin(), workerLatencies.end());
+
+        std::sort(all.begin(), all.end());
+        if (all.empty())
+            return Percentiles{0, 0, 0, 0};
+
+        return Percentiles{all[all.size() / 2], all[all.size() * 99 / 100], all.back(), all.size()};
+    }
+
+    void Print(char const* name, Percentiles const& percentiles, size_t toggles)
+    {
+        std::cout << name << ": "
+            << percentiles.requests << " requests, "
+            << "p50 " << percentiles.p50 << "us, "
+            << "p99 " << percentiles.p99 << "us, "
+            << "max " << percentiles.max << "us, "
+            << toggles << " toggles" << std::endl;
+    }
+} // namespace
+
+int main()
+{
+    eforce::ExceptionForcer exceptionForcer;
+
+    void* toggledSite = nullptr;
+    exceptionForcer.VisitExceptionsInFunction("(anonymous namespace)::ToggledFunction(int)", [&] (eforce::ExceptionInfo const& info) {
+        toggledSite = info.addr;
+    });
+
+    if (!toggledSite)
+    {
+        std::cerr << "Failed to find toggled site" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+    Print("idle", RunWorkers(workerCount), 0);
+
+    std::atomic<bool> running{true};
+    std::atomic<size_t> toggles{0};
+    std::thread toggler([&] {
+        while (running)
+        {
+            exceptionForcer.ForceException(toggledSite);
+            exceptionForcer.UnforceException(toggledSite);
+            toggles += 2;
+        }
+    });
+
+    auto toggling = RunWorkers(workerCount);
+    running = false;
+    toggler.join();
+
+    Print("toggling", toggling, toggles);
+
+    ToggledFunction(0);
+    return EXIT_SUCCESS;
+}
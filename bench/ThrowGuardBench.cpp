@@ -0,0 +1,67 @@
+#include <eforce/Exception.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+
+// Measures what an unforced throw site costs on the hot path
+//
+// "plain" is an unregistered `if (x) throw`, "registered" uses
+// THROW_REGISTERED_EXCEPTION, "nop guard" THROW_REGISTERED_EXCEPTION_IF_PATCHED
+// and "flag guard" THROW_REGISTERED_EXCEPTION_IF_FLAGGED. Each is a small
+// out of line function called in a tight loop, so the difference between them
+// is the cost of the guard itself.
+
+namespace
+{
+    constexpr size_t k_callCount = 1 << 28;
+
+    __attribute__((noinline)) uint64_t Plain(uint64_t x)
+    {
+        if (x == 0)
+            throw std::runtime_error("");
+        return x * 3;
+    }
+
+    __attribute__((noinline)) uint64_t Registered(uint64_t x)
+    {
+        if (x == 0)
+            THROW_REGISTERED_EXCEPTION(std::runtime_error, "");
+        return x * 3;
+    }
+
+    __attribute__((noinline)) uint64_t NopGuarded(uint64_t x)
+    {
+        THROW_REGISTERED_EXCEPTION_IF_PATCHED(x == 0, std::runtime_error, "");
+        return x * 3;
+    }
+
+    __attribute__((noinline)) uint64_t FlagGuarded(uint64_t x)
+    {
+        THROW_REGISTERED_EXCEPTION_IF_FLAGGED(x == 0, std::runtime_error, "");
+        return x * 3;
+    }
+
+    void Run(char const* name, uint64_t (*fn)(uint64_t))
+    {
+        uint64_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 1; i <= k_callCount; ++i)
+            sum += fn(i);
+        auto end = std::chrono::steady_clock::now();
+
+        auto seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << name << ": " << seconds * 1e9 / k_callCount << " ns/call"
+            << " (" << sum % 10 << ")" << std::endl;
+    }
+} // namespace
+
+int main()
+{
+    Run("plain", &Plain);
+    Run("registered", &Registered);
+    Run("nop guard", &NopGuarded);
+    Run("flag guard", &FlagGuarded);
+}
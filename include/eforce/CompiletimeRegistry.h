@@ -56,6 +56,11 @@ namespace eforce
             return mk_stop - mk_start;
         }
 
+        T& operator[](size_t idx) const
+        {
+            return *mk_start[idx];
+        }
+
     private:
         T** const mk_start;
         T** const mk_stop;
@@ -2,6 +2,9 @@
 
 #include <eforce/BuiltinConstant.h>
 #include <eforce/CompiletimeRegistry.h>
+#include <eforce/Patchable.h>
+
+#include <cstdint>
 
 namespace eforce
 {
@@ -41,6 +44,26 @@ namespace eforce
 	};
 
 
+	/// Record emitted for every THROW_REGISTERED_EXCEPTION_IF guard, in the
+	/// throw_guards section
+	struct ThrowGuard
+	{
+		/// The nop in front of the guarded condition
+		void* guard;
+		/// Start of the throw block, the same address as ThrowInfo::throwAddr
+		void* target;
+	};
+
+	/// Record emitted for every THROW_REGISTERED_EXCEPTION_IF_FLAGGED site, in
+	/// the throw_flag_guards section
+	struct ThrowFlagGuard
+	{
+		/// The site's arm flag, the site throws while it's non zero
+		uint8_t* flag;
+		/// Start of the throw block, the same address as ThrowInfo::throwAddr
+		void* target;
+	};
+
 	/**
 	 * @brief Helper union to cast a lambda to our GenExceptionPtrFnPtr_t. Given that we only
 	 *   use this in scenarios where we've guaranteed that the lambda in question takes no 
@@ -98,3 +121,122 @@ namespace eforce
  */
 #define THROW_REGISTERED_EXCEPTION(__etype, ...) \
 	THROW_REGISTERED_EXCEPTION_HELPER(__COUNTER__, __etype, ##__VA_ARGS__)
+
+/*
+ * A guard is a nop the size of a jump, recorded in the throw_guards section
+ * along with where the jump should go. The section is put in the same group
+ * as the function ("?") so the record is dropped along with any discarded
+ * COMDAT copy of the function.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+	#define THROW_GUARD_NOP ".byte 0x0f, 0x1f, 0x44, 0x00, 0x00\r\n" /* 5 byte nop */
+#elif defined(__GNUC__) && defined(__aarch64__)
+	#define THROW_GUARD_NOP "nop\r\n"
+#endif
+
+#if defined(THROW_GUARD_NOP)
+	#define THROW_GUARD(__label) \
+		__asm__ goto( \
+			"1: " THROW_GUARD_NOP \
+			".pushsection throw_guards,\"aw?\",%%progbits\r\n" \
+			".balign 8\r\n" \
+			".quad 1b, %l0\r\n" \
+			".popsection\r\n" \
+			:::: __label)
+#else
+	/// No guards on this platform, forcing falls back to patching the function
+	#define THROW_GUARD(__label) do {} while(0)
+#endif
+
+#define THROW_REGISTERED_EXCEPTION_IF_PATCHED_HELPER(__counter, __cond, __etype, ...) do { \
+		THROW_GUARD(UNIQUE_THROW_LABEL(__counter)); \
+		if (__cond) \
+			THROW_REGISTERED_EXCEPTION_HELPER(__counter, __etype, ##__VA_ARGS__); \
+	} while(0)
+
+/**
+ * @brief Throws an exception if __cond holds, registered for exception forcing
+ *   like THROW_REGISTERED_EXCEPTION. A nop guard is placed in front of the
+ *   condition, forcing the exception turns the guard into a jump straight to
+ *   the throw so the exception is constructed by the function itself, even
+ *   when its inputs are not constexpr. Costs a single nop while not forced
+ * @param[in] __cond Condition to throw on
+ * @param[in] __etype The type of exception to throw
+ * @param[in] vaargs Constructor arguments for __etype
+ */
+#define THROW_REGISTERED_EXCEPTION_IF_PATCHED(__cond, __etype, ...) \
+	THROW_REGISTERED_EXCEPTION_IF_PATCHED_HELPER(__COUNTER__, __cond, __etype, ##__VA_ARGS__)
+
+/*
+ * A flag guard is a byte in the throw_arm_flags section that the site tests
+ * in front of its condition, jumping to the throw while it's set. It's
+ * recorded in the throw_flag_guards section along with the throw it jumps to.
+ * The flag's address is resolved by the linker so the test is a single load
+ * and a branch that is never taken while unforced. Both sections are put in
+ * the same group as the function ("?") so a discarded COMDAT copy of the
+ * function takes its flag with it.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+	#define THROW_FLAG_TEST(__label) \
+		__asm__ goto( \
+			"cmpb $0, 1f(%%rip)\r\n" \
+			"jne %l0\r\n" \
+			THROW_FLAG_RECORD \
+			::: "cc" : __label)
+#elif defined(__GNUC__) && defined(__aarch64__)
+	#define THROW_FLAG_TEST(__label) \
+		__asm__ goto( \
+			"adrp x16, 1f\r\n" \
+			"ldrb w16, [x16, :lo12:1f]\r\n" \
+			"cbnz w16, %l0\r\n" \
+			THROW_FLAG_RECORD \
+			::: "x16" : __label)
+#endif
+
+#define THROW_FLAG_RECORD \
+	".pushsection throw_arm_flags,\"aw?\",%%nobits\r\n" \
+	"1: .skip 1\r\n" \
+	".popsection\r\n" \
+	".pushsection throw_flag_guards,\"aw?\",%%progbits\r\n" \
+	".balign 8\r\n" \
+	".quad 1b, %l0\r\n" \
+	".popsection\r\n"
+
+#if defined(THROW_FLAG_TEST)
+	#define THROW_REGISTERED_EXCEPTION_IF_FLAGGED_HELPER(__counter, __cond, __etype, ...) do { \
+			THROW_FLAG_TEST(UNIQUE_THROW_LABEL(__counter)); \
+			if (__cond) \
+				THROW_REGISTERED_EXCEPTION_HELPER(__counter, __etype, ##__VA_ARGS__); \
+		} while(0)
+#else
+	/// No flag guards on this platform, forcing falls back to patching the function
+	#define THROW_REGISTERED_EXCEPTION_IF_FLAGGED_HELPER(__counter, __cond, __etype, ...) do { \
+			if (__cond) \
+				THROW_REGISTERED_EXCEPTION_HELPER(__counter, __etype, ##__VA_ARGS__); \
+		} while(0)
+#endif
+
+/**
+ * @brief Throws an exception if __cond holds, registered for exception forcing
+ *   like THROW_REGISTERED_EXCEPTION. Before the condition the site checks its
+ *   own arm flag, forcing the exception sets the flag so no code is ever
+ *   modified. Costs a load and a predictable branch while not forced
+ * @param[in] __cond Condition to throw on
+ * @param[in] __etype The type of exception to throw
+ * @param[in] vaargs Constructor arguments for __etype
+ */
+#define THROW_REGISTERED_EXCEPTION_IF_FLAGGED(__cond, __etype, ...) \
+	THROW_REGISTERED_EXCEPTION_IF_FLAGGED_HELPER(__COUNTER__, __cond, __etype, ##__VA_ARGS__)
+
+/**
+ * @brief THROW_REGISTERED_EXCEPTION_IF_FLAGGED when EFORCE_FLAG_GUARDS is
+ *   defined, for environments that can't modify code, otherwise
+ *   THROW_REGISTERED_EXCEPTION_IF_PATCHED
+ */
+#if defined(EFORCE_FLAG_GUARDS)
+	#define THROW_REGISTERED_EXCEPTION_IF(__cond, __etype, ...) \
+		THROW_REGISTERED_EXCEPTION_IF_FLAGGED(__cond, __etype, ##__VA_ARGS__)
+#else
+	#define THROW_REGISTERED_EXCEPTION_IF(__cond, __etype, ...) \
+		THROW_REGISTERED_EXCEPTION_IF_PATCHED(__cond, __etype, ##__VA_ARGS__)
+#endif
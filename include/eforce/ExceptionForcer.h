@@ -1,9 +1,14 @@
 #pragma once
 
+#include <eforce/Latency.h>
+#include <eforce/ThrowCondition.h>
+
+#include <chrono>
 #include <exception>
 #include <map>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace eforce
@@ -18,8 +23,9 @@ namespace eforce
             void* start;
             /// End address of parent function
             void* end;
-            /// Demangled name of parent function
-            std::string name;
+            /// Demangled name of parent function. Owned by the ExceptionForcer
+            /// that produced this and valid for its lifetime
+            char const* name;
         };
 
         /// Approximate address of throw
@@ -34,6 +40,127 @@ namespace eforce
         ParentFunction parentFn;
     };
 
+    /**
+     * @brief Non owning reference to something callable with an ExceptionInfo.
+     *   Lets us pass lambdas through to the implementation without the
+     *   allocation std::function may need. Only valid for as long as the
+     *   callable it was constructed from.
+     */
+    class ExceptionVisitor
+    {
+    public:
+        template <typename Fn, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<Fn>::type, ExceptionVisitor>::value>::type>
+        ExceptionVisitor(Fn&& fn)
+            : m_pFn(const_cast<void*>(static_cast<void const*>(&fn)))
+            , m_call([] (void* pFn, ExceptionInfo const& info) {
+                (*static_cast<typename std::remove_reference<Fn>::type*>(pFn))(info);
+            })
+        {}
+
+        void operator()(ExceptionInfo const& info) const
+        {
+            m_call(m_pFn, info);
+        }
+
+    private:
+        void* m_pFn;
+        void (*m_call)(void* pFn, ExceptionInfo const& info);
+    };
+
+    /**
+     * @brief A set of force/unforce operations to apply all at once with
+     *  ExceptionForcer::Apply. If there are several operations for the same
+     *  location the last one wins.
+     */
+    class ForceBatch
+    {
+    public:
+        struct Operation
+        {
+            /// Location the exception is thrown from, retrieved from GetExceptions
+            void* loc;
+            /// Custom exception to throw, may be null
+            std::exception_ptr pError;
+            /// Whether to force or unforce loc
+            bool force;
+            /// Which calls throw, every call if empty
+            ThrowCondition condition;
+            /// False if calls are only held up by condition and never throw,
+            /// see InjectLatency
+            bool throws;
+        };
+
+        /**
+         * @brief Adds forcing the exception thrown from loc to the batch
+         */
+        void ForceException(void* loc)
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), true, ThrowCondition(), true});
+        }
+
+        /**
+         * @brief Adds forcing the exception thrown from loc with a custom exception to the batch
+         */
+        void ForceException(void* loc, std::exception_ptr pError)
+        {
+            m_operations.push_back(Operation{loc, std::move(pError), true, ThrowCondition(), true});
+        }
+
+        /**
+         * @brief Adds forcing the exception thrown from loc on a random fraction of calls to the batch
+         */
+        void ForceException(void* loc, double probability)
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), true, WithProbability(probability), true});
+        }
+
+        /**
+         * @brief Adds forcing the exception thrown from loc until deadline to the batch
+         */
+        void ForceException(void* loc, std::chrono::steady_clock::time_point deadline)
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), true, Until(deadline), true});
+        }
+
+        /**
+         * @brief Adds forcing the exception thrown from loc on the calls condition picks to the batch
+         */
+        void ForceExceptionIf(void* loc, ThrowCondition condition)
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), true, std::move(condition), true});
+        }
+
+        /**
+         * @brief Adds forcing a custom exception from loc on the calls condition picks to the batch
+         */
+        void ForceExceptionIf(void* loc, std::exception_ptr pError, ThrowCondition condition)
+        {
+            m_operations.push_back(Operation{loc, std::move(pError), true, std::move(condition), true});
+        }
+
+        /**
+         * @brief Adds holding up calls of the function loc is in to the batch
+         */
+        void InjectLatency(void* loc, Latency latency, ThrowCondition condition = ThrowCondition())
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), true, DelayCalls(std::move(latency), std::move(condition)), false});
+        }
+
+        /**
+         * @brief Adds unforcing the exception thrown from loc to the batch
+         */
+        void UnforceException(void* loc)
+        {
+            m_operations.push_back(Operation{loc, std::exception_ptr(), false, ThrowCondition(), false});
+        }
+
+        std::vector<Operation> const& Operations() const { return m_operations; }
+
+    private:
+        std::vector<Operation> m_operations;
+    };
+
     /**
      * @brief Forces exceptions to be thrown on next fn call.
      */
@@ -50,6 +177,37 @@ namespace eforce
          */
         std::vector<ExceptionInfo> GetExceptions();
 
+        /**
+         * @brief Calls visitor with every registered exception. Unlike
+         *  GetExceptions this does not allocate once our site index is built
+         */
+        void VisitExceptions(ExceptionVisitor visitor);
+
+        /**
+         * @brief Calls visitor with every registered exception thrown from file
+         * @param[in] file file name as given by __FILE__ at the throw
+         */
+        void VisitExceptionsInFile(char const* file, ExceptionVisitor visitor);
+
+        /**
+         * @brief Calls visitor with every registered exception thrown from file
+         *  between firstLine and lastLine inclusive
+         * @param[in] file file name as given by __FILE__ at the throw
+         */
+        void VisitExceptionsInFile(char const* file, int firstLine, int lastLine, ExceptionVisitor visitor);
+
+        /**
+         * @brief Calls visitor with every registered exception thrown from the
+         *  function with demangled name name, e.g. "ThrowIfNonZero(int)"
+         */
+        void VisitExceptionsInFunction(char const* name, ExceptionVisitor visitor);
+
+        /**
+         * @brief Calls visitor with every registered exception of type type,
+         *  e.g. "std::runtime_error"
+         */
+        void VisitExceptionsOfType(char const* type, ExceptionVisitor visitor);
+
         /**
          * @brief Forces an exception that is thrown from location loc
          * @param[in] loc location that the exception is thrown from, retrieved from GetExceptions
@@ -63,11 +221,99 @@ namespace eforce
          */
         void ForceException(void* loc, std::exception_ptr pError);
 
+        /**
+         * @brief Forces the exception thrown from location loc on a random
+         *  fraction of calls, the rest run the function as normal. See
+         *  ForceExceptionIf and WithProbability
+         * @param[in] loc location that the exception is thrown from, retrieved from GetExceptions
+         * @param[in] probability chance of each call throwing, between 0 and 1
+         */
+        void ForceException(void* loc, double probability);
+
+        /**
+         * @brief Forces the exception thrown from location loc until
+         *  deadline, after which the function runs as normal again without
+         *  anyone having to unforce it. See ForceExceptionIf and Until
+         * @param[in] loc location that the exception is thrown from, retrieved from GetExceptions
+         * @param[in] deadline when calls stop throwing
+         */
+        void ForceException(void* loc, std::chrono::steady_clock::time_point deadline);
+
+        /**
+         * @brief Forces the exception thrown from location loc on only the
+         *  calls condition picks, the rest run the function as normal. The
+         *  function's entry is detoured through a stub that asks condition
+         *  on every call, so a call let through costs the condition and a
+         *  few cycles more. Vector arguments wider than 128 bits may not
+         *  survive the detour on x86-64
+         * @param[in] loc location that the exception is thrown from, retrieved from GetExceptions
+         * @param[in] condition called on every call of the function, the
+         *  call throws if it returns true
+         * @throws std::runtime_error if the start of the function can't be
+         *  moved into the stub, e.g. something else in the function
+         *  branches into it
+         */
+        void ForceExceptionIf(void* loc, ThrowCondition condition);
+
+        /**
+         * @brief ForceExceptionIf with a custom exception
+         * @param[in] pError exception to throw
+         */
+        void ForceExceptionIf(void* loc, std::exception_ptr pError, ThrowCondition condition);
+
+        /**
+         * @brief Holds up calls of the function the exception at loc is
+         *  thrown from instead of throwing, then runs them as normal. The
+         *  function is detoured as for ForceExceptionIf, so any registered
+         *  exception's function can be slowed down, even one whose
+         *  exception isn't constant. UnforceException removes the delay
+         * @param[in] loc location of an exception in the function, retrieved from GetExceptions
+         * @param[in] latency how long to hold up each call
+         * @param[in] condition which calls are held up, every one if empty
+         */
+        void InjectLatency(void* loc, Latency latency, ThrowCondition condition = ThrowCondition());
+
         /**
          * @brief Disable a forced exception at loc
          * @param[in] loc location we've previously forced an exception at with ForceException
          */
         void UnforceException(void* loc);
+
+        /**
+         * @brief Disables every exception we've forced, in a single write
+         */
+        void UnforceAll();
+
+        /**
+         * @brief Disables every exception forced by every ExceptionForcer in
+         *  the process, in a single write. A way out when whatever forced
+         *  them can't be reached anymore. Waits for any Apply or UnforceAll
+         *  running on those ExceptionForcers to finish first
+         */
+        static void UnforceAllInProcess();
+
+        /**
+         * @brief Applies every operation in batch. Code is only made writable
+         *  once for the whole batch, and if any operation is invalid nothing
+         *  in the batch is applied. If the write fails part way, whatever
+         *  was written is put back before we throw
+         * @param[in] batch operations to apply
+         */
+        void Apply(ForceBatch const& batch);
+
+        /**
+         * @brief Gets a condition that only picks calls made from one of the
+         *  functions named, for forcing a site in shared code only when
+         *  it's reached from one caller. Only works with ForceExceptionIf
+         * @param[in] functionNames demangled names, e.g. "ThrowIfNonZero(int)"
+         * @param[in] depth how many callers up to look, 1 for just the
+         *  immediate caller. Callers past the first are found through frame
+         *  pointers, so code in between has to be built with them
+         * @param[in] condition which of those calls throw, every one if empty
+         * @throws std::runtime_error if no function has any of the names
+         */
+        ThrowCondition CalledFrom(std::vector<std::string> const& functionNames, unsigned depth = 1,
+            ThrowCondition condition = ThrowCondition());
     private:
         class Impl;
         std::unique_ptr<Impl> m_pImpl;
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <eforce/ThrowCondition.h>
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace eforce
+{
+    /**
+     * @brief Token naming one request, or any other unit of work, that
+     *  faults should be injected into. A thread has one current token at a
+     *  time, set with FaultContextScope, and a site forced with an
+     *  InFaultContext condition only throws on threads whose current token
+     *  matches. A default constructed token is no context at all and
+     *  matches nothing
+     */
+    class FaultContext
+    {
+    public:
+        FaultContext() = default;
+
+        /**
+         * @brief Makes a token no other call of New will return
+         */
+        static FaultContext New();
+
+        /**
+         * @brief Gets the calling thread's current token
+         */
+        static FaultContext Current();
+
+        explicit operator bool() const { return m_id != 0; }
+        bool operator==(FaultContext const& other) const { return m_id == other.m_id; }
+        bool operator!=(FaultContext const& other) const { return m_id != other.m_id; }
+
+    private:
+        friend class FaultContextScope;
+        friend ThrowCondition InFaultContext(FaultContext context, ThrowCondition condition);
+
+        explicit FaultContext(uint64_t id) : m_id(id) {}
+
+        uint64_t m_id = 0;
+    };
+
+    /**
+     * @brief Makes a token the calling thread's current one until the scope
+     *  ends, then puts back whatever was current before
+     */
+    class FaultContextScope
+    {
+    public:
+        explicit FaultContextScope(FaultContext context);
+        ~FaultContextScope();
+        FaultContextScope(FaultContextScope const& other) = delete;
+        FaultContextScope& operator=(FaultContextScope const& other) = delete;
+
+    private:
+        FaultContext m_previous;
+    };
+
+    /**
+     * @brief Callable that runs fn with the token it was made with as the
+     *  current one, see BindFaultContext
+     */
+    template <typename Fn>
+    class FaultContextBound
+    {
+    public:
+        FaultContextBound(FaultContext context, Fn fn)
+            : m_context(context)
+            , m_fn(std::move(fn))
+        {}
+
+        template <typename... Args>
+        auto operator()(Args&&... args) -> decltype(std::declval<Fn&>()(std::forward<Args>(args)...))
+        {
+            FaultContextScope scope(m_context);
+            return m_fn(std::forward<Args>(args)...);
+        }
+
+    private:
+        FaultContext m_context;
+        Fn m_fn;
+    };
+
+    /**
+     * @brief Wraps fn so it runs with the calling thread's current token,
+     *  wherever it's eventually called. Use it on tasks handed to another
+     *  thread so the request they're part of follows them
+     */
+    template <typename Fn>
+    FaultContextBound<typename std::decay<Fn>::type> BindFaultContext(Fn&& fn)
+    {
+        return FaultContextBound<typename std::decay<Fn>::type>(FaultContext::Current(), std::forward<Fn>(fn));
+    }
+
+    /**
+     * @brief A condition that only picks calls made while context is the
+     *  calling thread's current token. Checking it is a thread local load
+     *  and a compare
+     * @param[in] condition which of those calls throw, every one if empty
+     */
+    ThrowCondition InFaultContext(FaultContext context, ThrowCondition condition = ThrowCondition());
+} // namespace eforce
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <eforce/ThrowCondition.h>
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+namespace eforce
+{
+    /**
+     * @brief How long ExceptionForcer::InjectLatency holds up each call it
+     *  picks, and how it waits
+     */
+    class Latency
+    {
+    public:
+        enum class Wait
+        {
+            /// Busy wait on the cycle counter, good to well under a
+            /// microsecond
+            Spin,
+            /// Sleep, which frees the cpu but is only as precise as the
+            /// scheduler
+            Sleep,
+        };
+
+        /// Delays with their relative weights
+        using Histogram = std::vector<std::pair<std::chrono::microseconds, double>>;
+
+        /**
+         * @brief The same delay for every call
+         */
+        Latency(std::chrono::microseconds delay, Wait wait = Wait::Spin)
+            : m_histogram{{delay, 1.0}}
+            , m_wait(wait)
+        {}
+
+        /**
+         * @brief A delay drawn from histogram for every call
+         */
+        Latency(Histogram histogram, Wait wait = Wait::Spin)
+            : m_histogram(std::move(histogram))
+            , m_wait(wait)
+        {}
+
+        Histogram const& GetHistogram() const { return m_histogram; }
+        Wait GetWait() const { return m_wait; }
+
+    private:
+        Histogram m_histogram;
+        Wait m_wait;
+    };
+
+    /**
+     * @brief A condition that never picks a call to throw, but holds up the
+     *  calls condition picks by latency first. What
+     *  ExceptionForcer::InjectLatency forces a site with
+     * @param[in] condition which calls are held up, every one if empty
+     * @throws std::invalid_argument if latency's histogram is empty, or has
+     *  a negative delay or a weight that isn't positive
+     */
+    ThrowCondition DelayCalls(Latency latency, ThrowCondition condition = ThrowCondition());
+} // namespace eforce
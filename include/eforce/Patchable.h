@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Functions built with a patchable entry pad can be forced without rewriting
+ * their prologue. The compiler leaves room for two throw stubs right before
+ * the function and a single nop at its entry. Forcing an exception writes a
+ * stub into the pad, which nothing executes, and then swaps the entry nop for
+ * a jump to the stub with a single store. Unforcing swaps the nop back.
+ *
+ * Mark individual functions with EFORCE_PATCHABLE, or configure with
+ * -DEFORCE_PATCHABLE_ENTRY=ON to pad every function in targets linking eforce.
+ * Functions without a pad fall back to having their prologue rewritten.
+ */
+
+#if defined(__x86_64__)
+    /// Total nops in the pad
+    #define EFORCE_PATCHABLE_ENTRY_NOPS 34
+    /// Nops before the function entry, room for two 15 byte throw stubs
+    #define EFORCE_PATCHABLE_ENTRY_PREFIX_NOPS 32
+    #define EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES 32
+#elif defined(__aarch64__)
+    #define EFORCE_PATCHABLE_ENTRY_NOPS 11
+    /// Room for two 20 byte throw stubs
+    #define EFORCE_PATCHABLE_ENTRY_PREFIX_NOPS 10
+    #define EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES 40
+#endif
+
+#if defined(EFORCE_PATCHABLE_ENTRY_NOPS) && defined(__has_attribute)
+    #if __has_attribute(patchable_function_entry)
+        #define EFORCE_PATCHABLE \
+            __attribute__((patchable_function_entry(EFORCE_PATCHABLE_ENTRY_NOPS, EFORCE_PATCHABLE_ENTRY_PREFIX_NOPS)))
+    #endif
+#endif
+
+#if !defined(EFORCE_PATCHABLE)
+    /// Pads are not supported here, functions are forced by rewriting their prologue
+    #define EFORCE_PATCHABLE
+#endif
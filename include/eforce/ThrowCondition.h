@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace eforce
+{
+    /**
+     * @brief Decides, on each call of a function forced with
+     *  ForceExceptionIf, whether that call throws. Runs on the calling
+     *  thread before any of the function does, possibly on many threads at
+     *  once. It must not call the forced function, and anything it throws
+     *  is taken as not throwing
+     */
+    using ThrowCondition = std::function<bool()>;
+
+    /**
+     * @brief A condition that picks each call with the given probability.
+     *  Draws come from a xorshift generator kept per thread, so calls that
+     *  aren't picked touch no shared state
+     * @param[in] probability between 0 (no call throws) and 1 (every call
+     *  throws)
+     * @throws std::invalid_argument if probability is outside [0, 1]
+     */
+    ThrowCondition WithProbability(double probability);
+
+    // Call count schedules. Calls are counted separately on every thread,
+    // so a schedule picks the same calls however many threads run the
+    // function and no counter is shared between cores. Counting starts
+    // from the first call after the schedule is created
+
+    /**
+     * @brief A condition that picks only the nth call on each thread,
+     *  counting from 1
+     */
+    ThrowCondition OnNthCall(uint64_t n);
+
+    /**
+     * @brief A condition that picks every nth call on each thread, i.e.
+     *  calls n, 2n, 3n...
+     * @throws std::invalid_argument if n is 0
+     */
+    ThrowCondition EveryNthCall(uint64_t n);
+
+    /**
+     * @brief A condition that picks the first count calls on each thread
+     */
+    ThrowCondition FirstCalls(uint64_t count);
+
+    /**
+     * @brief Caps how often condition's picks actually throw, across every
+     *  thread. Throws are paid for from a token bucket that refills at
+     *  throwsPerSecond and holds burst tokens, a pick with no token left is
+     *  let through. The bucket is a single atomic refilled from
+     *  CLOCK_MONOTONIC_COARSE, and only calls condition picks touch it
+     * @param[in] throwsPerSecond refill rate of the bucket
+     * @param[in] condition which calls may throw, every call if empty
+     * @param[in] burst tokens the bucket holds, how many throws can happen
+     *  back to back. The bucket always holds at least a clock tick's worth
+     * @throws std::invalid_argument if throwsPerSecond isn't positive or
+     *  burst is 0
+     */
+    ThrowCondition RateLimited(double throwsPerSecond, ThrowCondition condition = ThrowCondition(), uint64_t burst = 1);
+
+    /**
+     * @brief Token naming the threads a site forced with OnEnabledThreads
+     *  picks, so tests running on several threads of one process each only
+     *  fault their own threads. A default constructed token is the one
+     *  shared by the whole process, every site forced without a token of
+     *  its own picks every thread enabled for it
+     */
+    class EnableToken
+    {
+    public:
+        EnableToken() = default;
+
+        /**
+         * @brief Makes a token no other call of New will return
+         */
+        static EnableToken New();
+
+        bool operator==(EnableToken const& other) const { return m_id == other.m_id; }
+        bool operator!=(EnableToken const& other) const { return m_id != other.m_id; }
+
+    private:
+        friend void EnableForThisThread(EnableToken token);
+        friend ThrowCondition OnEnabledThreads(EnableToken token, ThrowCondition condition);
+
+        explicit EnableToken(uint64_t id) : m_id(id) {}
+
+        /// 0 is kept for threads that aren't enabled at all
+        uint64_t m_id = 1;
+    };
+
+    /**
+     * @brief Opts the calling thread in to sites forced with
+     *  OnEnabledThreads and the same token. A thread is enabled for one
+     *  token at a time, enabling it for another replaces the first. Threads
+     *  start out disabled
+     */
+    void EnableForThisThread(EnableToken token = EnableToken());
+
+    /**
+     * @brief Undoes EnableForThisThread
+     */
+    void DisableForThisThread();
+
+    /**
+     * @brief A condition that only picks calls on threads enabled for
+     *  token. Checking it is a thread local load and a compare
+     * @param[in] condition which of those calls throw, every one if empty
+     */
+    ThrowCondition OnEnabledThreads(EnableToken token, ThrowCondition condition = ThrowCondition());
+
+    /**
+     * @brief OnEnabledThreads for the process wide token
+     */
+    ThrowCondition OnEnabledThreads(ThrowCondition condition = ThrowCondition());
+
+    /**
+     * @brief A condition that only picks calls running on one of cpus, for
+     *  confining faults to workers pinned there. The cpu is read from the
+     *  thread's rseq area when glibc registered one, and from sched_getcpu
+     *  otherwise
+     * @param[in] cpus cpu numbers as sched_getcpu gives them
+     * @param[in] condition which of those calls throw, every one if empty
+     */
+    ThrowCondition OnCpus(std::vector<unsigned> const& cpus, ThrowCondition condition = ThrowCondition());
+
+    /**
+     * @brief A condition that stops picking calls for good once deadline
+     *  passes, so a forced site disarms itself even if whoever forced it
+     *  goes away. Checked against CLOCK_MONOTONIC_COARSE, so it may run a
+     *  clock tick past deadline
+     * @param[in] condition which calls throw until then, every one if empty
+     */
+    ThrowCondition Until(std::chrono::steady_clock::time_point deadline, ThrowCondition condition = ThrowCondition());
+} // namespace eforce
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eforce
+{
+    /// A frame record as frame pointer chains lay them out on x86-64 and
+    /// aarch64. Detour stubs hand one to their decision function
+    struct FrameRecord_t
+    {
+        /// Caller's frame record, or null at the end of the chain
+        FrameRecord_t const* next;
+        /// Where the call this record is for returns to
+        void* returnAddr;
+    };
+
+    /**
+     * @brief Frame record of the call the calling thread's detour stub is
+     *  deciding on, null outside of a decision
+     */
+    inline FrameRecord_t const*& CurrentDetourFrame()
+    {
+        static thread_local FrameRecord_t const* s_pFrame = nullptr;
+        return s_pFrame;
+    }
+
+    // Matches the callers of a detoured call against a set of functions
+    //
+    // The functions are kept as a sorted table of address ranges, so each
+    // return address we check is a binary search. Frames past the immediate
+    // caller are found by following frame pointers, which only works
+    // through code built with them. A record that doesn't point further up
+    // this thread's stack ends the walk, so code that uses its frame pointer
+    // register for something else can't send us off into the weeds.
+    class CallerFilter
+    {
+    public:
+        struct Range_t
+        {
+            uintptr_t start;
+            uintptr_t end;
+        };
+
+        /**
+         * @param[in] ranges address ranges of the functions to look for, in
+         *  any order
+         * @param[in] depth how many frames up to look, 1 for only the
+         *  immediate caller
+         */
+        CallerFilter(std::vector<Range_t> ranges, unsigned depth);
+
+        /**
+         * @brief Whether any of the depth callers starting at pFrame is in one
+         *  of our functions
+         */
+        bool Matches(FrameRecord_t const* pFrame) const;
+
+    private:
+        bool Contains(uintptr_t addr) const;
+
+        std::vector<Range_t> m_ranges;
+        unsigned m_depth;
+    };
+} // namespace eforce
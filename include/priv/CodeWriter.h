@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace eforce
+{
+    /// Bytes to write over executable code
+    struct CodePatch
+    {
+        uint8_t* dest;
+        uint8_t const* data;
+        size_t size;
+        /// The patch has to land as one store, which means dest is naturally
+        /// aligned and size is 1, 2, 4 or 8
+        bool atomic;
+    };
+
+    class ICodeWriter
+    {
+    public:
+        virtual ~ICodeWriter() = default;
+
+        /**
+         * @brief Writes patches over executable code, in order. By the time
+         *  this returns every core will execute the new code
+         * @param[in] patches patches to write
+         */
+        virtual void Write(std::vector<CodePatch> const& patches) = 0;
+
+        /**
+         * @brief Whether atomic patches are written with a single store.
+         *  Writers that can't do that write them like any other patch
+         */
+        virtual bool StoresAtomically() const { return false; }
+    };
+
+    // Writes code by temporarily making the pages being patched writable
+    //
+    // Only the pages overlapping the patches are touched, and all patches in
+    // one Write share a single write window.
+    class MprotectCodeWriter
+        : public ICodeWriter
+    {
+    public:
+        void Write(std::vector<CodePatch> const& patches) override;
+        bool StoresAtomically() const override { return true; }
+    };
+
+    // Writes code through /proc/self/mem
+    //
+    // The kernel lets us write through /proc/self/mem regardless of the
+    // protection of the target mapping, so executable pages never have to be
+    // made writable. This keeps us working on hosts that enforce W^X and
+    // avoids the mprotect calls and TLB shootdowns that come with them.
+    class ProcMemCodeWriter
+        : public ICodeWriter
+    {
+    public:
+        /**
+         * @throws std::runtime_error if /proc/self/mem can't be opened for writing
+         */
+        ProcMemCodeWriter();
+        ~ProcMemCodeWriter();
+        ProcMemCodeWriter(ProcMemCodeWriter const& other) = delete;
+        ProcMemCodeWriter(ProcMemCodeWriter&& other) = delete;
+        ProcMemCodeWriter& operator=(ProcMemCodeWriter const& other) = delete;
+        ProcMemCodeWriter& operator=(ProcMemCodeWriter&& other) = delete;
+
+        void Write(std::vector<CodePatch> const& patches) override;
+
+    private:
+        int m_fd;
+    };
+
+#if defined(__x86_64__)
+    // Writes code that other threads may be running without stopping them
+    //
+    // Patches are written in stages the same way the kernel's text_poke_bp
+    // does it: an int3 goes over the first byte of every patch, then the rest
+    // of each patch is written, then the first bytes are swapped in, with
+    // every core resynchronized between stages. A thread entering a patch
+    // mid-write hits the int3, and our SIGTRAP handler holds it at the start
+    // of the patch until the write is finished, so it only ever runs the old
+    // or the new code and never a mix of both.
+    //
+    // Only a thread that reaches the first byte of a patch is held. A thread
+    // that was already past the first instruction a patch covers when the
+    // int3 went in, say one preempted right after a prologue's push rbp,
+    // resumes in the middle of the new bytes. So patches over a single
+    // instruction, like the entry nop of a padded function or a guard, are
+    // safe to write while the code runs, and patches over several
+    // instructions of a prologue are only safe if no thread is part way
+    // through them.
+    //
+    // Atomic patches are passed straight through when the underlying writer
+    // can store them in one go, otherwise they are staged too.
+    class BreakpointCodeWriter
+        : public ICodeWriter
+    {
+    public:
+        /**
+         * @param[in] pWriter Writer used for each stage
+         * @throws std::runtime_error if our SIGTRAP handler can't be installed
+         */
+        explicit BreakpointCodeWriter(std::unique_ptr<ICodeWriter> pWriter);
+
+        void Write(std::vector<CodePatch> const& patches) override;
+        bool StoresAtomically() const override { return m_pWriter->StoresAtomically(); }
+
+    private:
+        /**
+         * @brief Writes patches through int3s, caller holds the staging lock
+         */
+        void WriteStaged(std::vector<CodePatch> const& patches);
+
+        std::unique_ptr<ICodeWriter> m_pWriter;
+    };
+#endif
+
+    /**
+     * @brief Picks a code writer based on $EFORCE_CODE_WRITER, "procmem" or
+     *  "mprotect". If unset we use /proc/self/mem if the kernel lets us write
+     *  code through it and fall back to mprotect otherwise. On x86-64 writes
+     *  are staged through a BreakpointCodeWriter unless $EFORCE_LIVE_PATCH is
+     *  "0"
+     */
+    std::unique_ptr<ICodeWriter> GetCodeWriter();
+
+    /**
+     * @brief Makes GetCodeWriter return writers from factory instead, or
+     *  pick one itself again if factory is empty. Lets tests stand in a
+     *  writer that fails
+     */
+    void SetCodeWriterFactory(std::function<std::unique_ptr<ICodeWriter>()> factory);
+} // namespace eforce
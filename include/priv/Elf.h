@@ -1,36 +1,54 @@
 #pragma once
 
+#include <priv/FunctionIndex.h>
+#include <priv/FunctionLookup.h>
+#include <priv/NameArena.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
-struct bfd;
-struct bfd_symbol;
-
 namespace eforce
 {
     // Class to help resolve symbols in an elf file
-    // 
+    //
     // Elf files request to be loaded at a certain address. It seems that if
     // this field is non-null the rest of the binary works as if this has
     // happened. This means that if we read any *value* flags from our binary,
     // they will not be relative to the start of our elf (like offsets) but
     // relative to address 0.
-    // 
+    //
     // This gets a little more confusing if our binary is flagged as a dynamic
     // executable. I'm not sure why but this seems to happen occasionally. In
     // this scenario we have addresses relative to where we loaded (address 0),
     // but not the address we are actually at. In this scenario we must add our
     // runtime mapped address to the function.
-    // 
+    //
     // Since this class may not be used on /proc/self/exe the only sane thing to
     // do is to return in a way that the caller can re-map addresses themself
     // relative to what they see in /proc/self/maps if that's what they want to
     // do.
-    // 
+    //
     // For this reason we use offsets to the load address, and not addresses in
     // the api to this class. If users want to map this information to a running
     // binary they can manually map the offsets themselves with the help of
     // /proc/self/maps
+    //
+    // The file is mmapped read only and the symbol/string tables are walked in
+    // place. The only thing we allocate is a compact array of function records
+    // whose names point back into the mapped string table, so we only ever
+    // page in the parts of the binary we actually read.
+    //
+    // If the binary has a GNU build id the function table is additionally
+    // cached on disk, see FunctionIndexCache.
+    //
+    // Names are demangled at most once per function, the first time someone
+    // asks for them, and kept in an arena so we can hand out pointers instead
+    // of copies.
     class Elf
     {
     public:
@@ -40,8 +58,8 @@ namespace eforce
             void* startOffset;
             /// End of function relative to file start
             void* endOffset;
-            /// Demangled function name
-            std::string name;
+            /// Demangled function name, valid for the lifetime of the Elf
+            char const* name;
         };
 
         explicit Elf(const char* filename);
@@ -57,8 +75,95 @@ namespace eforce
          */
         Function_t GetContainingFunction(void* offset);
 
+        /**
+         * @brief Gets the functions containing a batch of offsets. The offsets
+         *  are sorted once and merged against our sorted function table, which
+         *  is much cheaper than looking each one up individually
+         * @param[in] offsets addresses, relative to the start of the file
+         * @param[in] threadCount number of threads to split the merge over
+         * @return The containing function of every offset, in the same order
+         *  as offsets
+         */
+        std::vector<Function_t> GetContainingFunctions(std::vector<void*> const& offsets, size_t threadCount = 1);
+
+        /**
+         * @brief Gets every function with demangled name name, e.g.
+         *  "ThrowIfNonZero(int)". Static functions in different translation
+         *  units can share a name
+         * @return The functions, sorted by start offset
+         */
+        std::vector<Function_t> GetFunctionsNamed(char const* name);
+
+        /**
+         * @brief Gets the hex encoded GNU build id of the file
+         * @return The build id, or an empty string if the file doesn't have one
+         */
+        std::string GetBuildId() const;
+
     private:
-        bfd* m_bfd;
-        std::vector<bfd_symbol*> m_sortedSymbols;
+        struct SortedOffset_t
+        {
+            uintptr_t offset;
+            /// Index of offset in the callers input
+            size_t idx;
+        };
+
+        /**
+         * @brief Fills m_functions, either from our on disk index or by
+         *  walking the symbol table
+         */
+        void LoadFunctions();
+
+        /**
+         * @brief Walks the symbol table of our mapped file and fills
+         *  m_ownedFunctions with every defined function, sorted by start offset
+         * @return The string table that the function records index into
+         */
+        char const* ReadFunctions();
+
+        /**
+         * @brief Finds the last function starting at or before offset
+         */
+        FunctionRecord_t const& FindFunction(uintptr_t offset) const;
+
+        /**
+         * @brief Converts a function record to the format we hand out
+         */
+        Function_t MakeFunction(FunctionRecord_t const& function) const;
+
+        /**
+         * @brief Gets the demangled name of function, demangling it if this
+         *  is the first time we've been asked. Safe to call from multiple threads
+         */
+        char const* GetName(FunctionRecord_t const& function) const;
+
+        /**
+         * @brief Resolves a sorted run of offsets with a single walk over
+         *  m_functions, writing results to out at each offset's idx
+         */
+        void ResolveSorted(SortedOffset_t const* begin, SortedOffset_t const* end, Function_t* out) const;
+
+        void* m_mapping = nullptr;
+        size_t m_mappingSize = 0;
+
+        bool m_functionsLoaded = false;
+        std::vector<FunctionRecord_t> m_ownedFunctions;
+        std::unique_ptr<FunctionIndexCache> m_pIndexCache;
+
+        /// Sorted functions, points into either m_ownedFunctions or our index cache
+        FunctionRecord_t const* m_functions = nullptr;
+        size_t m_functionCount = 0;
+        /// Name table m_functions index into
+        char const* m_names = nullptr;
+        /// Whether m_names has already been demangled
+        bool m_namesDemangled = false;
+        /// Lazily demangled name of every function, only used if !m_namesDemangled
+        std::unique_ptr<std::atomic<char const*>[]> m_demangledNames;
+        /// Storage for m_demangledNames, guarded by m_nameMutex
+        mutable NameArena m_nameArena;
+        mutable std::mutex m_nameMutex;
+        /// Fast lookup into m_functions, only used if m_lookupBuilt
+        FunctionLookupTable m_lookup;
+        bool m_lookupBuilt = false;
     };
 } // namespace eforce
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace eforce
+{
+    /// Compact record of a function symbol. These are stored sorted by start
+    /// both in memory and in the on disk index
+    struct FunctionRecord_t
+    {
+        /// Start of function relative to file start
+        uint64_t start;
+        /// End of function relative to file start
+        uint64_t end;
+        /// Offset of the function name in the accompanying name table
+        uint32_t name;
+        uint32_t reserved;
+    };
+
+    // On disk cache of the function table for a binary
+    //
+    // Building the function table means walking every symbol in the binary,
+    // sorting them, and demangling them when asked for. For large binaries
+    // this is slow, and every process running the same binary does the exact
+    // same work. Since the table only depends on the contents of the binary
+    // we key it on the GNU build id and write it out once in a form that can
+    // be mmapped and used as is by later processes.
+    //
+    // The index lives in $EFORCE_INDEX_CACHE_DIR, falling back to
+    // $XDG_CACHE_HOME/eforce and then $HOME/.cache/eforce. Setting
+    // EFORCE_INDEX_CACHE_DIR to an empty string disables the cache. Writing
+    // an index removes the least recently used ones once the directory
+    // holds more than 128MiB of them.
+    class FunctionIndexCache
+    {
+    public:
+        /**
+         * @param[in] buildId hex encoded build id of the binary we are indexing
+         */
+        explicit FunctionIndexCache(std::string const& buildId);
+        ~FunctionIndexCache();
+        FunctionIndexCache(FunctionIndexCache const& other) = delete;
+        FunctionIndexCache(FunctionIndexCache&& other) = delete;
+        FunctionIndexCache& operator=(FunctionIndexCache const& other) = delete;
+        FunctionIndexCache& operator=(FunctionIndexCache&& other) = delete;
+
+        /**
+         * @brief Maps a previously stored index for our build id
+         * @return false if there is no valid index to map
+         */
+        bool Load();
+
+        /**
+         * @brief Demangles and interns the names of functions, writes them out
+         *  as the index for our build id and maps the result
+         * @param[in] functions function records sorted by start
+         * @param[in] mangledNames string table the function names index into
+         * @return false if the index could not be written
+         */
+        bool Store(std::vector<FunctionRecord_t> const& functions, char const* mangledNames);
+
+        /// Sorted function records, only valid after a successful Load or Store
+        FunctionRecord_t const* Functions() const;
+        /// Number of records returned by Functions()
+        size_t FunctionCount() const;
+        /// Demangled names that function records index into
+        char const* Names() const;
+
+    private:
+        void Unmap();
+
+        std::string m_buildId;
+        std::string m_path;
+        void* m_mapping = nullptr;
+        size_t m_mappingSize = 0;
+    };
+} // namespace eforce
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <priv/FunctionIndex.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eforce
+{
+    // Address to function lookup table
+    //
+    // A plain binary search over the function records touches a new cache
+    // line on almost every probe, and none of them can be prefetched since
+    // we don't know where we're going until the previous probe completes.
+    //
+    // Instead we store function starts as 32 bit offsets from the lowest
+    // function start in blocks of 16 sorted keys. The first key of
+    // every block is copied into an array in Eytzinger (BFS) order, which
+    // keeps the top of the search tree packed in a handful of cache lines and
+    // lets us prefetch the next few levels while we compare. Once we know
+    // which block we're in we count the keys in that block that are <= our
+    // offset with SIMD compares.
+    class FunctionLookupTable
+    {
+    public:
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        /**
+         * @brief Builds the lookup table
+         * @param[in] functions function records sorted by start
+         * @param[in] count number of function records
+         * @return false if the functions span more than 4GB and can't be
+         *  represented with 32 bit offsets
+         */
+        bool Build(FunctionRecord_t const* functions, size_t count);
+
+        /**
+         * @brief Finds the last function that starts at or before offset
+         * @param[in] offset an address, relative to the start of the file
+         * @return index into the functions the table was built with, or npos
+         *  if offset is before every function
+         */
+        size_t Find(uint64_t offset) const;
+
+    private:
+        size_t FillEytzinger(size_t sortedIdx, size_t eytzingerIdx);
+
+        uint64_t m_base = 0;
+        size_t m_count = 0;
+        size_t m_blockCount = 0;
+        /// First key of every block in Eytzinger order, 1 indexed
+        std::vector<uint32_t> m_blockKeys;
+        /// Sorted block index of every entry in m_blockKeys
+        std::vector<uint32_t> m_blockRanks;
+        /// All keys, padded out to a whole number of blocks
+        std::vector<uint32_t> m_keys;
+        /// Counts keys in a block <= a key, picked based on cpu support
+        size_t (*m_countLessEqual)(uint32_t const* block, uint32_t key) = nullptr;
+    };
+} // namespace eforce
@@ -1,12 +1,36 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <stdexcept>
 #include <vector>
 
 namespace eforce
 {
+    /// Where a detour stub goes and what it calls, see
+    /// IOpcodeGenerator::GetDetourOpcode
+    struct DetourSpec_t
+    {
+        /// Where the stub will be placed
+        void* stub;
+        /// Where the function carries on once the stub lets the call
+        /// through
+        void* fnStart;
+        void* fnEnd;
+        /// Bytes at fnStart the branch to the stub goes over, which the stub
+        /// runs itself. 0 if the branch is somewhere else
+        size_t displace;
+        /// Of signature std::exception_ptr* DecideFn(void* decideArg,
+        /// FrameRecord_t const* pFrame), must not throw. pFrame's return
+        /// address is in the function's caller. Returns the exception this
+        /// call throws, or null to let the call through
+        void* decideFn;
+        void* decideArg;
+        /// As for GetThrowOpcode
+        void* throwFn;
+    };
+
     class IOpcodeGenerator
     {
     public:
@@ -14,7 +38,8 @@ namespace eforce
 
         /**
          * @brief Gets executable code that can be placed at fnStart to throw
-         *  pError.
+         *  pError. The code is longer when throwFn is out of reach of a
+         *  direct branch from fnStart
          * @param[in] fnStart The address we will be using this code at
          * @param[in] throwFn A function that throws pError, 
          *  of signature void ThrowFn(std::excption_ptr*)
@@ -24,6 +49,66 @@ namespace eforce
             void* fnStart,
             void* throwFn,
             std::exception_ptr* pError) = 0;
+
+        /**
+         * @brief Gets the instruction we keep at the entry of a function with
+         *  an EFORCE_PATCHABLE pad while it isn't forced. Empty if we don't
+         *  support pads on this platform
+         */
+        virtual std::vector<uint8_t> GetEntryNop() { return {}; }
+
+        /**
+         * @brief Checks whether the function at pEntry has an untouched
+         *  EFORCE_PATCHABLE pad, optionally with our entry nop already in it.
+         *  The EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES before pEntry must be
+         *  readable
+         */
+        virtual bool HasEntryPad(uint8_t const* /*pEntry*/) { return false; }
+
+        /**
+         * @brief Gets a jump from entry to target the same size as
+         *  GetEntryNop, so arming is a single store
+         * @param[in] entry The function entry the jump will be placed at
+         * @param[in] target Where to jump to, inside the pad before entry
+         */
+        virtual std::vector<uint8_t> GetEntryJump(void* /*entry*/, void* /*target*/) { return {}; }
+
+        /**
+         * @brief Gets the nop THROW_REGISTERED_EXCEPTION_IF places in front of
+         *  its condition. Empty if we don't support guards on this platform
+         */
+        virtual std::vector<uint8_t> GetGuardNop() { return {}; }
+
+        /**
+         * @brief Gets a jump from guard to target the same size as GetGuardNop
+         */
+        virtual std::vector<uint8_t> GetGuardJump(void* /*guard*/, void* /*target*/) { return {}; }
+
+        /**
+         * @brief How far a stub from the StubPool can be from the code that
+         *  branches to it. 0 if we don't support stubs on this platform
+         */
+        virtual size_t GetStubRange() { return 0; }
+
+        /**
+         * @brief Gets a single branch from fnStart to a stub, within
+         *  GetStubRange of it
+         */
+        virtual std::vector<uint8_t> GetStubJump(void* /*fnStart*/, void* /*stub*/) { return {}; }
+
+        /**
+         * @brief Gets a detour stub, which calls spec.decideFn on every call
+         *  of the function and either throws what it returns or runs the
+         *  relocated start of the function and jumps back into the rest of
+         *  it. Argument registers are preserved across the decision. Empty if
+         *  we don't support detours on this platform
+         * @param[in] code The function's code as it was before any patch,
+         *  from spec.fnStart to spec.fnEnd. Relocated from, in place of
+         *  what's in memory
+         * @throws std::runtime_error if the start of the function can't be
+         *  relocated
+         */
+        virtual std::vector<uint8_t> GetDetourOpcode(DetourSpec_t const& /*spec*/, uint8_t const* /*code*/) { return {}; }
     };
 
     class OpcodeGeneratorFallback
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace eforce
+{
+    // Bump allocated, interned string storage
+    //
+    // Strings are copied into large blocks that are never freed or moved
+    // until the arena itself goes away, so handing out pointers into the
+    // arena is safe for the lifetime of the arena. Identical strings are
+    // only stored once.
+    //
+    // Not thread safe.
+    class NameArena
+    {
+    public:
+        NameArena() = default;
+        NameArena(NameArena const& other) = delete;
+        NameArena(NameArena&& other) = delete;
+        NameArena& operator=(NameArena const& other) = delete;
+        NameArena& operator=(NameArena&& other) = delete;
+
+        /**
+         * @brief Gets a copy of name that lives as long as the arena
+         * @param[in] name null terminated string to intern
+         */
+        char const* Intern(char const* name);
+
+    private:
+        struct Hash
+        {
+            size_t operator()(char const* str) const;
+        };
+
+        struct Equal
+        {
+            bool operator()(char const* a, char const* b) const
+            {
+                return std::strcmp(a, b) == 0;
+            }
+        };
+
+        char* Allocate(size_t size);
+
+        std::vector<std::unique_ptr<char[]>> m_blocks;
+        char* m_current = nullptr;
+        size_t m_remaining = 0;
+        std::unordered_set<char const*, Hash, Equal> m_interned;
+    };
+} // namespace eforce
@@ -2,6 +2,7 @@
 
 #include <priv/IOpcodeGenerator.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <vector>
@@ -16,5 +17,13 @@ namespace eforce
             void* fnStart,
             void* throwFn,
             std::exception_ptr* error) override;
+        std::vector<uint8_t> GetEntryNop() override;
+        bool HasEntryPad(uint8_t const* pEntry) override;
+        std::vector<uint8_t> GetEntryJump(void* entry, void* target) override;
+        std::vector<uint8_t> GetGuardNop() override;
+        std::vector<uint8_t> GetGuardJump(void* guard, void* target) override;
+        size_t GetStubRange() override;
+        std::vector<uint8_t> GetStubJump(void* fnStart, void* stub) override;
+        std::vector<uint8_t> GetDetourOpcode(DetourSpec_t const& spec, uint8_t const* code) override;
     };
 } // namespace eforce
@@ -2,6 +2,7 @@
 
 #include <priv/IOpcodeGenerator.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <vector>
@@ -16,5 +17,8 @@ namespace eforce
             void* fnStart,
             void* throwFn,
             std::exception_ptr* pError) override;
+        size_t GetStubRange() override;
+        std::vector<uint8_t> GetStubJump(void* fnStart, void* stub) override;
+        std::vector<uint8_t> GetDetourOpcode(DetourSpec_t const& spec, uint8_t const* code) override;
     };
 } // namespace eforce
@@ -1,5 +1,10 @@
 #pragma once
+#include <limits.h>
+#include <unistd.h>
+
+#include <cstdint>
 #include <fstream>
+#include <string>
 
 namespace eforce
 {
@@ -8,8 +13,28 @@ namespace eforce
 	public:
 		ProgOffsetResolver()
 		{
+			// The executable isn't always the first mapping, our StubPool maps
+			// chunks below it when that's the closest gap. Find its lowest
+			// mapping by path, falling back to the first mapping
+			char exe[PATH_MAX];
+			auto exeSize = readlink("/proc/self/exe", exe, sizeof(exe));
+			std::string exePath = (exeSize > 0) ? std::string(exe, exeSize) : std::string();
+
 			std::ifstream f("/proc/self/maps");
-			f >> std::hex >> m_progStartAddr; 
+			std::string line;
+			bool first = true;
+			while (std::getline(f, line))
+			{
+				// start-end perms offset dev inode path
+				size_t pathStart = line.find('/');
+				bool isExe = !exePath.empty() && pathStart != std::string::npos && line.compare(pathStart, std::string::npos, exePath) == 0;
+				if (first || isExe)
+					m_progStartAddr = reinterpret_cast<void*>(static_cast<uintptr_t>(std::stoull(line, nullptr, 16)));
+
+				first = false;
+				if (isExe)
+					break;
+			}
 		}
 
 		void* ToOffset(void* addr) const
@@ -31,4 +56,4 @@ namespace eforce
 	private:
 		void* m_progStartAddr = nullptr;
 	};
-} // namespace eforce
\ No newline at end of file
+} // namespace eforce
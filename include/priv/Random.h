@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace eforce
+{
+    /**
+     * @brief Next draw from the calling thread's xorshift64* generator.
+     *  Every thread has its own state, so drawing touches no shared memory
+     */
+    uint64_t NextRandom();
+
+    /**
+     * @brief Converts a probability to a threshold a draw from NextRandom
+     *  is below with that probability
+     * @param[in] probability between 0 and 1, exclusive
+     */
+    uint64_t ProbabilityThreshold(double probability);
+} // namespace eforce
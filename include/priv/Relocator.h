@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eforce
+{
+    // Relocates the first instructions of a function so a detour stub can
+    // run them before jumping back into the rest of the function
+    //
+    // The instructions copied are the fewest whole instructions covering
+    // the bytes the branch to the stub goes over. Anything relative to where
+    // an instruction is, a RIP relative operand or a literal load for
+    // instance, is fixed up so it reads the same thing from its new address.
+    // Each function throws std::runtime_error when the instructions can't be
+    // relocated, or when something else in the function branches into the
+    // middle of them.
+    //
+    // Every architecture is built on every platform, like the opcode
+    // generators, since none of this needs to run what it decodes.
+
+    /**
+     * @brief Gets the length of the x86-64 instruction at pInsn
+     * @param[in] pEnd end of the code we may read, the instruction must end
+     *  before it
+     * @return the length, or 0 if the instruction can't be decoded
+     */
+    size_t GetInstructionLengthX64(uint8_t const* pInsn, uint8_t const* pEnd);
+
+    /**
+     * @brief Relocates the x86-64 instructions covering the first size bytes
+     *  of the function at fnStart so they can run at dest
+     * @param[in] code The function's code, which may be a copy of it
+     * @param[in] codeSize Size of the function, nothing past it is read
+     * @param[out] displaced how many bytes of the function the relocated
+     *  instructions cover, they continue at fnStart + displaced
+     */
+    std::vector<uint8_t> RelocatePrologueX64(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t dest, size_t& displaced);
+
+    /**
+     * @brief RelocatePrologueX64 for AArch64
+     */
+    std::vector<uint8_t> RelocatePrologueAarch64(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t dest, size_t& displaced);
+
+    /**
+     * @brief RelocatePrologueX64 for Thumb-2, fnStart and dest are the
+     *  addresses of the code itself without the Thumb bit
+     */
+    std::vector<uint8_t> RelocatePrologueThumb(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t dest, size_t& displaced);
+} // namespace eforce
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <eforce/ExceptionForcer.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eforce
+{
+    // Resolved throw sites with sorted indices for the queries we support
+    //
+    // Every index is a sorted array of positions into the site list so each
+    // query is a binary search to find the matching range followed by a walk
+    // over just the matches. Lookups by throw address go through a flat open
+    // addressing hash table instead, since those are on the force/unforce path.
+    class SiteIndex
+    {
+    public:
+        /**
+         * @param[in] sites fully resolved throw sites
+         */
+        explicit SiteIndex(std::vector<ExceptionInfo> sites);
+
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        /// All sites, in registry order
+        std::vector<ExceptionInfo> const& Sites() const;
+
+        /**
+         * @brief Finds the site thrown from addr
+         * @return position of the site in Sites(), or npos if there is none
+         */
+        size_t Find(void* addr) const;
+
+        /**
+         * @brief Visits every site in file between firstLine and lastLine inclusive
+         */
+        void VisitFile(char const* file, int firstLine, int lastLine, ExceptionVisitor const& visitor) const;
+
+        /**
+         * @brief Visits every site whose parent function is named name
+         */
+        void VisitFunction(char const* name, ExceptionVisitor const& visitor) const;
+
+        /**
+         * @brief Visits every site whose exception type is type
+         */
+        void VisitType(char const* type, ExceptionVisitor const& visitor) const;
+
+    private:
+        std::vector<ExceptionInfo> m_sites;
+        /// Sorted by file, then line
+        std::vector<uint32_t> m_byFile;
+        /// Sorted by parent function name
+        std::vector<uint32_t> m_byFunction;
+        /// Sorted by exception type
+        std::vector<uint32_t> m_byType;
+        /// Open addressing table of throw addresses, a power of two in size.
+        /// Empty slots are null
+        std::vector<void*> m_addrSlots;
+        /// Position in m_sites of each entry in m_addrSlots
+        std::vector<uint32_t> m_addrSiteIdx;
+    };
+} // namespace eforce
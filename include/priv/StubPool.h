@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace eforce
+{
+    // Executable slots for throw stubs, mapped close to the code they serve
+    //
+    // A forced function only needs a single short branch to a stub in one of
+    // our slots, rather than the whole stub written over its prologue. The
+    // branch can only reach so far, so slots are handed out from chunks mapped
+    // into gaps in the address space within that reach of the function.
+    //
+    // Chunks are mapped read and execute only and are never unmapped, slots
+    // are written through an ICodeWriter like any other code. A freed slot
+    // goes to the back of a queue and isn't reused until it has been free
+    // for k_quiescentPeriod, so a thread that was running the old stub has
+    // left it by then.
+    //
+    // Thread safe.
+    class StubPool
+    {
+    public:
+        /// Slots are a multiple of this, room for the largest throw stub any
+        /// generator makes
+        static constexpr size_t k_slotSize = 32;
+
+        /// Size of a slot for a detour stub
+        static constexpr size_t k_detourSlotSize = 8 * k_slotSize;
+
+        /// How long a freed slot waits before it's handed out again
+        static constexpr std::chrono::milliseconds k_quiescentPeriod{100};
+
+        /**
+         * @brief The process wide pool. Never destroyed, so ExceptionForcers
+         *  destroyed along with other statics can still free into it
+         */
+        static StubPool& Get();
+
+        StubPool() = default;
+        StubPool(StubPool const& other) = delete;
+        StubPool(StubPool&& other) = delete;
+        StubPool& operator=(StubPool const& other) = delete;
+        StubPool& operator=(StubPool&& other) = delete;
+
+        /**
+         * @brief Gets a slot whose every byte is within range bytes of near
+         * @param[in] size size of the slot, a multiple of k_slotSize
+         * @return the slot, or null if no memory could be mapped close enough
+         */
+        uint8_t* Allocate(void* near, size_t range, size_t size = k_slotSize);
+
+        /**
+         * @brief Returns a slot to the pool, the slot must no longer be
+         *  reachable from any code. Threads may still be running it for
+         *  k_quiescentPeriod
+         * @param[in] size size the slot was allocated with
+         */
+        void Free(uint8_t* pSlot, size_t size = k_slotSize);
+
+    private:
+        struct Chunk
+        {
+            uint8_t* start;
+            size_t used;
+        };
+
+        struct FreeSlot
+        {
+            uint8_t* pSlot;
+            size_t size;
+            std::chrono::steady_clock::time_point freedAt;
+        };
+
+        /**
+         * @brief Maps a new chunk in the gap closest to near
+         * @return the chunk, or null if no gap is close enough
+         */
+        uint8_t* MapChunkNear(uintptr_t near, size_t range);
+
+        std::mutex m_mutex;
+        std::vector<Chunk> m_chunks;
+        /// Freed slots, oldest first
+        std::deque<FreeSlot> m_freeSlots;
+    };
+} // namespace eforce
@@ -0,0 +1,100 @@
+#include <priv/CallerFilter.h>
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    struct StackBounds
+    {
+        uintptr_t low = 0;
+        uintptr_t high = 0;
+    };
+
+    /**
+     * @brief Bounds of the calling thread's stack, looked up once per thread
+     */
+    StackBounds const& GetStackBounds()
+    {
+        static thread_local StackBounds s_bounds;
+        static thread_local bool s_known = false;
+        if (s_known)
+            return s_bounds;
+
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0)
+        {
+            void* pStack = nullptr;
+            size_t size = 0;
+            if (pthread_attr_getstack(&attr, &pStack, &size) == 0)
+            {
+                s_bounds.low = reinterpret_cast<uintptr_t>(pStack);
+                s_bounds.high = s_bounds.low + size;
+            }
+
+            pthread_attr_destroy(&attr);
+        }
+
+        // Unknown bounds leave an empty range, so we never follow a frame
+        // pointer rather than follow one we can't check
+        s_known = true;
+        return s_bounds;
+    }
+} // namespace
+
+    CallerFilter::CallerFilter(std::vector<Range_t> ranges, unsigned depth)
+        : m_ranges(std::move(ranges))
+        , m_depth(depth)
+    {
+        std::sort(m_ranges.begin(), m_ranges.end(), [] (Range_t const& a, Range_t const& b) {
+            return a.start < b.start;
+        });
+    }
+
+    bool CallerFilter::Matches(FrameRecord_t const* pFrame) const
+    {
+        for (unsigned i = 0; i < m_depth && pFrame; ++i)
+        {
+            // A return address is just past its call, which may be the last
+            // instruction of the caller. Thumb return addresses also have
+            // their low bit set
+            auto returnAddr = reinterpret_cast<uintptr_t>(pFrame->returnAddr);
+            if (returnAddr && Contains(returnAddr - 1))
+                return true;
+
+            if (i + 1 == m_depth)
+                break;
+
+            // Callers' frames are further up the stack than their callees'
+            auto const& bounds = GetStackBounds();
+            auto next = reinterpret_cast<uintptr_t>(pFrame->next);
+            if (next <= reinterpret_cast<uintptr_t>(pFrame) || next % alignof(FrameRecord_t) != 0
+                || next < bounds.low || next + sizeof(FrameRecord_t) > bounds.high)
+                break;
+
+            pFrame = pFrame->next;
+        }
+
+        return false;
+    }
+
+    bool CallerFilter::Contains(uintptr_t addr) const
+    {
+        auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), addr, [] (uintptr_t a, Range_t const& range) {
+            return a < range.start;
+        });
+
+        if (it == m_ranges.begin())
+            return false;
+
+        --it;
+        return addr < it->end;
+    }
+} // namespace eforce
@@ -0,0 +1,720 @@
+#include <priv/CodeWriter.h>
+
+#include <fcntl.h>
+#include <linux/membarrier.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    /// A range of bytes we're about to write to
+    struct CodeRange
+    {
+        uint8_t* start;
+        size_t size;
+    };
+
+    /**
+    * @brief: Class that makes the pages we are about to patch writable, and
+    *   only those pages. Making all of .text writable would flush TLBs
+    *   process wide and break up any huge pages backing it
+    */
+    class ScopedMprotect
+    {
+    public:
+        /**
+         * @brief Disables write protection on the pages overlapping ranges.
+         *   Adjacent pages are coalesced into a single mprotect call
+         */
+        explicit ScopedMprotect(std::vector<CodeRange> const& ranges);
+
+        /**
+         * @brief Enables write protection on the pages we made writable
+         */
+        ~ScopedMprotect();
+
+        // Remove default copy/move constructors
+        ScopedMprotect(ScopedMprotect const& other) = delete;
+        ScopedMprotect(ScopedMprotect&& other) = delete;
+        ScopedMprotect& operator=(ScopedMprotect const& other) = delete;
+        ScopedMprotect& operator=(ScopedMprotect&& other) = delete;
+    private:
+        /// Page aligned runs of pages we made writable
+        std::vector<CodeRange> m_pageRuns;
+    };
+
+    ScopedMprotect::ScopedMprotect(std::vector<CodeRange> const& ranges)
+    {
+        static auto const s_pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+        std::vector<CodeRange> pages;
+        pages.reserve(ranges.size());
+        for (auto const& range : ranges)
+        {
+            if (range.size == 0)
+                continue;
+
+            auto first = reinterpret_cast<uintptr_t>(range.start) & ~(s_pageSize - 1);
+            auto last = (reinterpret_cast<uintptr_t>(range.start) + range.size - 1) & ~(s_pageSize - 1);
+            pages.push_back(CodeRange{reinterpret_cast<uint8_t*>(first), last - first + s_pageSize});
+        }
+
+        std::sort(pages.begin(), pages.end(), [] (CodeRange const& a, CodeRange const& b) {
+            return a.start < b.start;
+        });
+
+        for (auto const& page : pages)
+        {
+            if (!m_pageRuns.empty() && page.start <= m_pageRuns.back().start + m_pageRuns.back().size)
+            {
+                auto& run = m_pageRuns.back();
+                run.size = std::max(run.size, static_cast<size_t>(page.start + page.size - run.start));
+                continue;
+            }
+
+            m_pageRuns.push_back(page);
+        }
+
+        for (size_t i = 0; i < m_pageRuns.size(); ++i)
+        {
+            int err = mprotect(m_pageRuns[i].start, m_pageRuns[i].size, PROT_WRITE | PROT_READ | PROT_EXEC);
+            if (err < 0)
+            {
+                for (size_t j = 0; j < i; ++j)
+                    mprotect(m_pageRuns[j].start, m_pageRuns[j].size, PROT_READ | PROT_EXEC);
+
+                throw std::runtime_error("Failed to mprotect");
+            }
+        }
+    }
+
+    ScopedMprotect::~ScopedMprotect()
+    {
+        for (auto const& run : m_pageRuns)
+            mprotect(run.start, run.size, PROT_READ | PROT_EXEC);
+    }
+
+    /**
+     * @brief Writes an atomic patch with a single store, so a thread running
+     *  the code sees either all of the old bytes or all of the new ones
+     */
+    void StoreAtomically(CodePatch const& patch)
+    {
+        switch (patch.size)
+        {
+        case 1:
+            __atomic_store_n(patch.dest, patch.data[0], __ATOMIC_RELEASE);
+            break;
+        case 2:
+        {
+            uint16_t value;
+            std::memcpy(&value, patch.data, sizeof(value));
+            __atomic_store_n(reinterpret_cast<uint16_t*>(patch.dest), value, __ATOMIC_RELEASE);
+            break;
+        }
+        case 4:
+        {
+            uint32_t value;
+            std::memcpy(&value, patch.data, sizeof(value));
+            __atomic_store_n(reinterpret_cast<uint32_t*>(patch.dest), value, __ATOMIC_RELEASE);
+            break;
+        }
+        case 8:
+        {
+            uint64_t value;
+            std::memcpy(&value, patch.data, sizeof(value));
+            __atomic_store_n(reinterpret_cast<uint64_t*>(patch.dest), value, __ATOMIC_RELEASE);
+            break;
+        }
+        default:
+            throw std::logic_error("Atomic patch has an invalid size");
+        }
+    }
+
+    /**
+     * @brief Checks that we can actually write code through /proc/self/mem.
+     *  Some kernels are configured to refuse writes to read only mappings
+     *  through it
+     */
+    bool CanWriteCodeThroughProcMem(ICodeWriter& writer)
+    {
+        // Write a function's first byte back over itself, which changes nothing
+        auto pCode = reinterpret_cast<uint8_t*>(&CanWriteCodeThroughProcMem);
+        uint8_t original = *pCode;
+
+        try
+        {
+            writer.Write({CodePatch{pCode, &original, 1, false}});
+            return true;
+        }
+        catch (std::runtime_error const&)
+        {
+            return false;
+        }
+    }
+
+    /**
+     * @brief Makes every core running one of our threads resynchronize its
+     *  instruction stream, so code we just wrote is what it executes next.
+     *  Does nothing on kernels without membarrier sync core support
+     */
+    void SyncCores()
+    {
+    #if defined(__NR_membarrier)
+        static bool const s_registered = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0;
+        if (s_registered)
+            syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+    #endif
+    }
+
+    /**
+     * @brief Makes patches we just wrote visible to instruction fetch on
+     *  every core. On ARM that means cleaning the data cache and invalidating
+     *  the instruction cache for the patched ranges only, then making the
+     *  other cores drop anything they already fetched. Done once per Write so
+     *  a batch pays for it once
+     */
+    void PublishPatches(std::vector<CodePatch> const& patches)
+    {
+        if (patches.empty())
+            return;
+
+        // A no-op on x86, where instruction fetch is coherent with stores
+        for (auto const& patch : patches)
+        {
+            auto pStart = reinterpret_cast<char*>(patch.dest);
+            __builtin___clear_cache(pStart, pStart + patch.size);
+        }
+
+        SyncCores();
+    }
+
+#if defined(__x86_64__)
+    constexpr uint8_t k_int3 = 0xcc;
+
+    /// Sorted starts of the patches currently being staged
+    struct StagedPatches_t
+    {
+        uint8_t* const* pStarts;
+        size_t count;
+    };
+
+    std::atomic<StagedPatches_t const*> s_pStagedPatches{nullptr};
+    /// Number of threads currently in OnSigtrap
+    std::atomic<int> s_trapsInFlight{0};
+    struct sigaction s_previousSigtrap;
+
+    /**
+     * @brief Every patch start we've ever staged. A thread can trap on one
+     *  of our int3s and only reach OnSigtrap after the patch is unstaged,
+     *  this is how it knows the int3 was ours. Lock free to read from
+     *  OnSigtrap, only added to under s_stagingMutex
+     */
+    class StagedHistory
+    {
+    public:
+        bool Contains(uint8_t* pCode) const
+        {
+            auto pTable = m_pTable.load(std::memory_order_acquire);
+            if (!pTable)
+                return false;
+
+            auto key = reinterpret_cast<uintptr_t>(pCode);
+            for (size_t i = Hash(key) & pTable->mask; ; i = (i + 1) & pTable->mask)
+            {
+                auto entry = pTable->entries[i].load(std::memory_order_acquire);
+                if (entry == key)
+                    return true;
+                if (entry == 0)
+                    return false;
+            }
+        }
+
+        void Add(uint8_t* pCode)
+        {
+            auto key = reinterpret_cast<uintptr_t>(pCode);
+            if (Contains(pCode))
+                return;
+
+            // Keep the table at most half full. Readers may still be probing
+            // the old table, so it's leaked, which at most doubles our memory
+            auto pTable = m_pTable.load(std::memory_order_relaxed);
+            if (!pTable || (m_size + 1) * 2 > pTable->mask + 1)
+            {
+                auto pGrown = NewTable(pTable ? (pTable->mask + 1) * 2 : 64);
+                if (pTable)
+                {
+                    for (size_t i = 0; i <= pTable->mask; ++i)
+                    {
+                        auto entry = pTable->entries[i].load(std::memory_order_relaxed);
+                        if (entry)
+                            Insert(*pGrown, entry);
+                    }
+                }
+
+                m_pTable.store(pGrown, std::memory_order_release);
+                pTable = pGrown;
+            }
+
+            Insert(*pTable, key);
+            ++m_size;
+        }
+
+    private:
+        struct Table
+        {
+            size_t mask;
+            std::unique_ptr<std::atomic<uintptr_t>[]> entries;
+        };
+
+        static size_t Hash(uintptr_t key)
+        {
+            return static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> 16);
+        }
+
+        static Table* NewTable(size_t capacity)
+        {
+            auto pTable = new Table{capacity - 1, std::unique_ptr<std::atomic<uintptr_t>[]>(new std::atomic<uintptr_t>[capacity])};
+            for (size_t i = 0; i < capacity; ++i)
+                pTable->entries[i].store(0, std::memory_order_relaxed);
+            return pTable;
+        }
+
+        static void Insert(Table& table, uintptr_t key)
+        {
+            auto i = Hash(key) & table.mask;
+            while (table.entries[i].load(std::memory_order_relaxed))
+                i = (i + 1) & table.mask;
+
+            table.entries[i].store(key, std::memory_order_release);
+        }
+
+        std::atomic<Table*> m_pTable{nullptr};
+        size_t m_size = 0;
+    };
+
+    StagedHistory s_stagedHistory;
+
+    bool IsStaged(uint8_t* pCode)
+    {
+        // Sequentially consistent to pair with UnstagePatches, see there
+        auto pStaged = s_pStagedPatches.load();
+        if (!pStaged)
+            return false;
+
+        auto end = pStaged->pStarts + pStaged->count;
+        auto found = std::lower_bound(pStaged->pStarts, end, pCode);
+        return found != end && *found == pCode;
+    }
+
+    /**
+     * @brief Unstages the current patches and waits for every thread that
+     *  may still be looking at them to leave OnSigtrap
+     */
+    void UnstagePatches()
+    {
+        // A release store could be ordered after the load of the count, and
+        // miss a thread that has just come in and still sees the patches.
+        // With both sides sequentially consistent, a thread we don't count
+        // came in after the exchange and sees null
+        s_pStagedPatches.exchange(nullptr);
+        while (s_trapsInFlight.load() != 0)
+            sched_yield();
+    }
+
+    void ChainSigtrap(int sig, siginfo_t* pInfo, void* pContext)
+    {
+        if (s_previousSigtrap.sa_flags & SA_SIGINFO)
+        {
+            s_previousSigtrap.sa_sigaction(sig, pInfo, pContext);
+            return;
+        }
+
+        if (s_previousSigtrap.sa_handler == SIG_IGN)
+            return;
+
+        if (s_previousSigtrap.sa_handler != SIG_DFL)
+        {
+            s_previousSigtrap.sa_handler(sig);
+            return;
+        }
+
+        // Let the default action happen once we return, it's blocked until then
+        sigaction(SIGTRAP, &s_previousSigtrap, nullptr);
+        raise(SIGTRAP);
+    }
+
+    /**
+     * @brief Sends threads that hit one of our staging int3s back to the
+     *  start of the patch, they'll keep trapping until the patch is done and
+     *  then run the new code. Anything else goes to the previous handler
+     */
+    void OnSigtrap(int sig, siginfo_t* pInfo, void* pContext)
+    {
+        ++s_trapsInFlight;
+
+        auto& gregs = static_cast<ucontext_t*>(pContext)->uc_mcontext.gregs;
+        auto pTrap = reinterpret_cast<uint8_t*>(gregs[REG_RIP] - 1);
+
+        // Only a trap at the start of a patch can be one of ours, anything
+        // else, like the second byte of an int 3 (cd 03), isn't ours to
+        // rewind. Check whether the patch is staged before looking at the
+        // code. The patch is only unstaged after its int3 is gone, so if it
+        // was staged once and the int3 is gone by the time we look, the int3
+        // we hit was still ours
+        if (pInfo->si_code == SI_KERNEL)
+        {
+            bool staged = IsStaged(pTrap);
+            auto code = *reinterpret_cast<uint8_t volatile*>(pTrap);
+            if (staged || (code != k_int3 && s_stagedHistory.Contains(pTrap)))
+            {
+                if (code == k_int3)
+                    sched_yield();
+
+                gregs[REG_RIP] = reinterpret_cast<greg_t>(pTrap);
+                --s_trapsInFlight;
+                return;
+            }
+        }
+
+        --s_trapsInFlight;
+        ChainSigtrap(sig, pInfo, pContext);
+    }
+
+    void InstallSigtrapHandler()
+    {
+        static bool const s_installed = [] {
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_sigaction = &OnSigtrap;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            return sigaction(SIGTRAP, &action, &s_previousSigtrap) == 0;
+        }();
+
+        if (!s_installed)
+            throw std::runtime_error("Failed to install SIGTRAP handler");
+    }
+
+    /// Staging uses process wide state, only one write can be staged at a time
+    std::mutex s_stagingMutex;
+
+    /**
+     * @brief Merges overlapping patches into one, applying them in order.
+     *  Staging writes every first byte last, so overlapping patches would
+     *  otherwise land out of order
+     * @param[out] rStorage Holds the bytes of any merged patches
+     */
+    std::vector<CodePatch> CoalescePatches(std::vector<CodePatch> const& patches, std::vector<std::vector<uint8_t>>& rStorage)
+    {
+        std::vector<size_t> order(patches.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+
+        std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+            return patches[a].dest < patches[b].dest;
+        });
+
+        std::vector<CodePatch> ret;
+        for (size_t i = 0; i < order.size(); )
+        {
+            auto runStart = patches[order[i]].dest;
+            auto runEnd = runStart + patches[order[i]].size;
+            size_t runLength = 1;
+            while (i + runLength < order.size() && patches[order[i + runLength]].dest < runEnd)
+            {
+                auto const& next = patches[order[i + runLength]];
+                runEnd = std::max(runEnd, next.dest + next.size);
+                ++runLength;
+            }
+
+            if (runLength == 1)
+            {
+                ret.push_back(patches[order[i]]);
+                ++i;
+                continue;
+            }
+
+            std::vector<size_t> run(order.begin() + i, order.begin() + i + runLength);
+            std::sort(run.begin(), run.end());
+
+            std::vector<uint8_t> merged(runStart, runEnd);
+            for (auto idx : run)
+                std::copy(patches[idx].data, patches[idx].data + patches[idx].size, merged.begin() + (patches[idx].dest - runStart));
+
+            rStorage.push_back(std::move(merged));
+            ret.push_back(CodePatch{runStart, rStorage.back().data(), rStorage.back().size(), false});
+            i += runLength;
+        }
+
+        return ret;
+    }
+#endif
+
+    /**
+     * @brief Picks the writer that actually puts bytes in memory
+     */
+    std::unique_ptr<ICodeWriter> GetUnstagedCodeWriter()
+    {
+        std::string requested;
+        if (char const* env = getenv("EFORCE_CODE_WRITER"))
+            requested = env;
+
+        if (requested == "mprotect")
+            return std::unique_ptr<ICodeWriter>(new MprotectCodeWriter);
+
+        if (requested == "procmem")
+            return std::unique_ptr<ICodeWriter>(new ProcMemCodeWriter);
+
+        if (!requested.empty())
+            throw std::runtime_error("Unknown EFORCE_CODE_WRITER");
+
+        try
+        {
+            std::unique_ptr<ICodeWriter> pWriter(new ProcMemCodeWriter);
+            if (CanWriteCodeThroughProcMem(*pWriter))
+                return pWriter;
+        }
+        catch (std::runtime_error const&)
+        {
+        }
+
+        return std::unique_ptr<ICodeWriter>(new MprotectCodeWriter);
+    }
+
+    /// Set by SetCodeWriterFactory
+    struct CodeWriterFactory
+    {
+        std::mutex mutex;
+        std::function<std::unique_ptr<ICodeWriter>()> make;
+    };
+
+    CodeWriterFactory& GetCodeWriterFactory()
+    {
+        static CodeWriterFactory s_factory;
+        return s_factory;
+    }
+} // namespace
+
+    void MprotectCodeWriter::Write(std::vector<CodePatch> const& patches)
+    {
+        std::vector<CodeRange> ranges;
+        ranges.reserve(patches.size());
+        for (auto const& patch : patches)
+            ranges.push_back(CodeRange{patch.dest, patch.size});
+
+        {
+            ScopedMprotect scopedMprotect [[gnu::unused]] (ranges);
+            for (auto const& patch : patches)
+            {
+                if (patch.atomic)
+                    StoreAtomically(patch);
+                else
+                    std::copy(patch.data, patch.data + patch.size, patch.dest);
+            }
+        }
+
+        PublishPatches(patches);
+    }
+
+    ProcMemCodeWriter::ProcMemCodeWriter()
+        : m_fd(open("/proc/self/mem", O_RDWR | O_CLOEXEC))
+    {
+        if (m_fd < 0)
+            throw std::runtime_error("Failed to open /proc/self/mem");
+    }
+
+    ProcMemCodeWriter::~ProcMemCodeWriter()
+    {
+        close(m_fd);
+    }
+
+    void ProcMemCodeWriter::Write(std::vector<CodePatch> const& patches)
+    {
+        for (auto const& patch : patches)
+        {
+            size_t written = 0;
+            while (written < patch.size)
+            {
+                auto ret = pwrite(m_fd, patch.data + written, patch.size - written,
+                    static_cast<off_t>(reinterpret_cast<uintptr_t>(patch.dest + written)));
+
+                if (ret < 0 && errno == EINTR)
+                    continue;
+
+                if (ret <= 0)
+                    throw std::runtime_error("Failed to write to /proc/self/mem");
+
+                written += static_cast<size_t>(ret);
+            }
+        }
+
+        PublishPatches(patches);
+    }
+
+#if defined(__x86_64__)
+    BreakpointCodeWriter::BreakpointCodeWriter(std::unique_ptr<ICodeWriter> pWriter)
+        : m_pWriter(std::move(pWriter))
+    {
+        InstallSigtrapHandler();
+    }
+
+    void BreakpointCodeWriter::Write(std::vector<CodePatch> const& patches)
+    {
+        std::lock_guard<std::mutex> lock(s_stagingMutex);
+
+        // Atomic patches can't be seen half written, no need to stage them.
+        // Runs of each are written in turn so the batch stays in order
+        bool storesAtomically = m_pWriter->StoresAtomically();
+        std::vector<CodePatch> run;
+        bool runIsDirect = false;
+        auto flush = [&] {
+            if (run.empty())
+                return;
+
+            if (runIsDirect)
+            {
+                m_pWriter->Write(run);
+            }
+            else
+            {
+                std::vector<std::vector<uint8_t>> storage;
+                WriteStaged(CoalescePatches(run, storage));
+            }
+
+            run.clear();
+        };
+
+        for (auto const& patch : patches)
+        {
+            if (patch.size == 0)
+                continue;
+
+            bool isDirect = patch.atomic && storesAtomically;
+            if (isDirect != runIsDirect)
+                flush();
+
+            runIsDirect = isDirect;
+            run.push_back(patch);
+        }
+
+        flush();
+    }
+
+    void BreakpointCodeWriter::WriteStaged(std::vector<CodePatch> const& patches)
+    {
+        static uint8_t const s_int3 = k_int3;
+
+        std::vector<uint8_t*> starts;
+        std::vector<CodePatch> breakpoints;
+        std::vector<CodePatch> tails;
+        std::vector<CodePatch> heads;
+        std::vector<uint8_t> originals;
+        for (auto const& patch : patches)
+        {
+            starts.push_back(patch.dest);
+            breakpoints.push_back(CodePatch{patch.dest, &s_int3, 1, false});
+            heads.push_back(CodePatch{patch.dest, patch.data, 1, false});
+            if (patch.size > 1)
+                tails.push_back(CodePatch{patch.dest + 1, patch.data + 1, patch.size - 1, false});
+
+            originals.insert(originals.end(), patch.dest, patch.dest + patch.size);
+        }
+
+        std::sort(starts.begin(), starts.end());
+        for (auto pStart : starts)
+            s_stagedHistory.Add(pStart);
+
+        StagedPatches_t staged{starts.data(), starts.size()};
+        s_pStagedPatches.store(&staged);
+
+        try
+        {
+            // Each write leaves every core running what it wrote
+            m_pWriter->Write(breakpoints);
+            m_pWriter->Write(tails);
+            m_pWriter->Write(heads);
+        }
+        catch (std::runtime_error const&)
+        {
+            // Put back what was there so nobody is left trapping on an int3
+            std::vector<CodePatch> restore;
+            auto original = originals.data();
+            for (auto const& patch : patches)
+            {
+                if (patch.size > 1)
+                    restore.push_back(CodePatch{patch.dest + 1, original + 1, patch.size - 1, false});
+                original += patch.size;
+            }
+
+            original = originals.data();
+            for (auto const& patch : patches)
+            {
+                restore.push_back(CodePatch{patch.dest, original, 1, false});
+                original += patch.size;
+            }
+
+            try
+            {
+                m_pWriter->Write(restore);
+            }
+            catch (std::runtime_error const&)
+            {
+            }
+
+            UnstagePatches();
+            throw;
+        }
+
+        // Wait for any trapped thread to stop looking at staged before it
+        // goes out of scope
+        UnstagePatches();
+    }
+#endif
+
+    std::unique_ptr<ICodeWriter> GetCodeWriter()
+    {
+        {
+            auto& factory = GetCodeWriterFactory();
+            std::lock_guard<std::mutex> lock(factory.mutex);
+            if (factory.make)
+                return factory.make();
+        }
+
+        auto pWriter = GetUnstagedCodeWriter();
+
+    #if defined(__x86_64__)
+        char const* livePatch = getenv("EFORCE_LIVE_PATCH");
+        if (!livePatch || std::strcmp(livePatch, "0") != 0)
+            pWriter.reset(new BreakpointCodeWriter(std::move(pWriter)));
+    #endif
+
+        return pWriter;
+    }
+
+    void SetCodeWriterFactory(std::function<std::unique_ptr<ICodeWriter>()> factory)
+    {
+        auto& codeWriterFactory = GetCodeWriterFactory();
+        std::lock_guard<std::mutex> lock(codeWriterFactory.mutex);
+        codeWriterFactory.make = std::move(factory);
+    }
+} // namespace eforce
@@ -1,75 +1,433 @@
 #include <priv/Elf.h>
 #include <priv/Util.h>
 
-// Unfortunately the bfd header doesn't work if we don't define these
-#ifndef PACKAGE
-    #define PACKAGE
-#endif
-#ifndef PACKAGE_VERSION
-    #define PACKAGE_VERSION
-#endif
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <bfd.h>
 #include <cxxabi.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
-#include <iostream>
-
 namespace eforce
 {
+namespace
+{
+#if __ELF_NATIVE_CLASS == 64
+    constexpr unsigned char k_nativeClass = ELFCLASS64;
+#else
+    constexpr unsigned char k_nativeClass = ELFCLASS32;
+#endif
+
+    /**
+     * @brief Returns a pointer to a T at offset in our mapping, or nullptr if
+     *  count T's would not fit in the mapping
+     */
+    template <typename T>
+    T const* MappedAt(void const* mapping, size_t mappingSize, uint64_t offset, uint64_t count = 1)
+    {
+        if (offset > mappingSize || count > (mappingSize - offset) / sizeof(T))
+            return nullptr;
+
+        return reinterpret_cast<T const*>(static_cast<char const*>(mapping) + offset);
+    }
+
+    /**
+     * @brief Strips any architecture specific tagging from a function symbol value
+     */
+    uintptr_t SymbolAddress(ElfW(Sym) const& symbol)
+    {
+    #if defined(__arm__)
+        // Thumb functions have their low bit set to indicate the instruction
+        // set, the function itself still starts on the even address
+        return symbol.st_value & ~uintptr_t(1);
+    #else
+        return symbol.st_value;
+    #endif
+    }
+} // namespace
+
     Elf::Elf(char const* filename)
     {
-        bfd_init();
-        m_bfd = bfd_openr(filename, nullptr);
-        bfd_check_format(m_bfd, bfd_object);
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open elf file");
+
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(ElfW(Ehdr))))
+        {
+            close(fd);
+            throw std::runtime_error("Failed to stat elf file");
+        }
+
+        m_mappingSize = static_cast<size_t>(st.st_size);
+        m_mapping = mmap(nullptr, m_mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (m_mapping == MAP_FAILED)
+        {
+            m_mapping = nullptr;
+            throw std::runtime_error("Failed to mmap elf file");
+        }
+
+        auto header = static_cast<ElfW(Ehdr) const*>(m_mapping);
+        if (std::memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != k_nativeClass)
+        {
+            munmap(m_mapping, m_mappingSize);
+            throw std::runtime_error("Not a native elf file");
+        }
     }
 
     Elf::~Elf()
     {
-        bfd_close(m_bfd);
+        if (m_mapping)
+            munmap(m_mapping, m_mappingSize);
     }
 
-    Elf::Function_t Elf::GetContainingFunction(void *offset)
+    std::string Elf::GetBuildId() const
     {
-        if (m_sortedSymbols.empty())
+        auto header = static_cast<ElfW(Ehdr) const*>(m_mapping);
+        auto sections = MappedAt<ElfW(Shdr)>(m_mapping, m_mappingSize, header->e_shoff, header->e_shnum);
+        if (!sections)
+            return {};
+
+        for (size_t i = 0; i < header->e_shnum; ++i)
         {
-            auto storage_needed = bfd_get_symtab_upper_bound(m_bfd);
-            m_sortedSymbols.resize(storage_needed / sizeof(asymbol*), nullptr);
-            auto number_of_symbols = bfd_canonicalize_symtab(m_bfd, &m_sortedSymbols[0]);
-            m_sortedSymbols.resize(number_of_symbols);
+            if (sections[i].sh_type != SHT_NOTE)
+                continue;
 
-            auto endIt = std::remove_if(m_sortedSymbols.begin(), m_sortedSymbols.end(), [&] (asymbol* symbol) {
-                return !(symbol->flags & BSF_FUNCTION);
-            });
+            auto notes = MappedAt<char>(m_mapping, m_mappingSize, sections[i].sh_offset, sections[i].sh_size);
+            if (!notes)
+                continue;
 
-            m_sortedSymbols.erase(endIt, m_sortedSymbols.end());
+            // Notes are a name and a description, each padded to 4 bytes
+            size_t pos = 0;
+            while (pos + sizeof(ElfW(Nhdr)) <= sections[i].sh_size)
+            {
+                ElfW(Nhdr) note;
+                std::memcpy(&note, notes + pos, sizeof(note));
+                pos += sizeof(note);
 
-            std::sort(m_sortedSymbols.begin(), m_sortedSymbols.end(), [](asymbol* a, asymbol* b) {
-                return a->value < b->value;
-            });
+                auto nameStart = pos;
+                pos += (note.n_namesz + 3) & ~size_t(3);
+                auto descStart = pos;
+                pos += (note.n_descsz + 3) & ~size_t(3);
+
+                if (pos > sections[i].sh_size)
+                    break;
+
+                if (note.n_type != NT_GNU_BUILD_ID || note.n_namesz != sizeof(ELF_NOTE_GNU)
+                    || std::memcmp(notes + nameStart, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) != 0)
+                    continue;
+
+                static char const k_hex[] = "0123456789abcdef";
+                std::string buildId;
+                for (size_t j = 0; j < note.n_descsz; ++j)
+                {
+                    auto byte = static_cast<uint8_t>(notes[descStart + j]);
+                    buildId.push_back(k_hex[byte >> 4]);
+                    buildId.push_back(k_hex[byte & 0xf]);
+                }
+
+                return buildId;
+            }
+        }
+
+        return {};
+    }
+
+    void Elf::LoadFunctions()
+    {
+        m_functionsLoaded = true;
+
+        char const* mangledNames = nullptr;
+        bool functionsRead = false;
+
+        auto buildId = GetBuildId();
+        if (!buildId.empty())
+        {
+            m_pIndexCache.reset(new FunctionIndexCache(buildId));
+            if (!m_pIndexCache->Load())
+            {
+                mangledNames = ReadFunctions();
+                functionsRead = true;
+                if (!m_pIndexCache->Store(m_ownedFunctions, mangledNames))
+                    m_pIndexCache.reset();
+            }
+
+            if (m_pIndexCache)
+            {
+                // Everything we need lives in the index now
+                std::vector<FunctionRecord_t>().swap(m_ownedFunctions);
+                m_functions = m_pIndexCache->Functions();
+                m_functionCount = m_pIndexCache->FunctionCount();
+                m_names = m_pIndexCache->Names();
+                m_namesDemangled = true;
+                m_lookupBuilt = m_lookup.Build(m_functions, m_functionCount);
+                return;
+            }
+        }
+
+        if (!functionsRead)
+            mangledNames = ReadFunctions();
+
+        m_functions = m_ownedFunctions.data();
+        m_functionCount = m_ownedFunctions.size();
+        m_names = mangledNames;
+        m_namesDemangled = false;
+        m_demangledNames.reset(new std::atomic<char const*>[m_functionCount]());
+        m_lookupBuilt = m_lookup.Build(m_functions, m_functionCount);
+    }
+
+    char const* Elf::ReadFunctions()
+    {
+        auto header = static_cast<ElfW(Ehdr) const*>(m_mapping);
+        auto sections = MappedAt<ElfW(Shdr)>(m_mapping, m_mappingSize, header->e_shoff, header->e_shnum);
+        if (!sections)
+            return nullptr;
+
+        // Prefer the full symbol table, but fall back to the dynamic symbols
+        // if we've been stripped
+        ElfW(Shdr) const* symtab = nullptr;
+        for (size_t i = 0; i < header->e_shnum; ++i)
+        {
+            if (sections[i].sh_type == SHT_SYMTAB)
+            {
+                symtab = &sections[i];
+                break;
+            }
+
+            if (sections[i].sh_type == SHT_DYNSYM && !symtab)
+                symtab = &sections[i];
         }
 
-        auto nextFn = std::partition_point(m_sortedSymbols.cbegin(), m_sortedSymbols.cend(), [&] (asymbol* const symbol) {
-            // symbol->value is relative to the start of the section, we care
-            // about the value relative to the start of the file so we add it
-            // to symbol->section->filepos
-            return reinterpret_cast<void*>(symbol->value + symbol->section->filepos) < offset;
+        if (!symtab || symtab->sh_link >= header->e_shnum || symtab->sh_entsize != sizeof(ElfW(Sym)))
+            return nullptr;
+
+        auto const& strtab = sections[symtab->sh_link];
+        auto strings = MappedAt<char>(m_mapping, m_mappingSize, strtab.sh_offset, strtab.sh_size);
+        auto symbolCount = symtab->sh_size / sizeof(ElfW(Sym));
+        auto symbols = MappedAt<ElfW(Sym)>(m_mapping, m_mappingSize, symtab->sh_offset, symbolCount);
+        if (!strings || !symbols)
+            return nullptr;
+
+        m_ownedFunctions.reserve(symbolCount);
+        for (size_t i = 0; i < symbolCount; ++i)
+        {
+            auto const& symbol = symbols[i];
+            auto type = ELF64_ST_TYPE(symbol.st_info);
+            if (type != STT_FUNC && type != STT_GNU_IFUNC)
+                continue;
+
+            if (symbol.st_shndx == SHN_UNDEF || symbol.st_shndx >= header->e_shnum || symbol.st_name >= strtab.sh_size)
+                continue;
+
+            // Symbol values are virtual addresses, we care about the value
+            // relative to the start of the file so we rebase onto the file
+            // position of the containing section
+            auto const& section = sections[symbol.st_shndx];
+            uintptr_t start = SymbolAddress(symbol) - section.sh_addr + section.sh_offset;
+            m_ownedFunctions.push_back(FunctionRecord_t{start, start + symbol.st_size, symbol.st_name, 0});
+        }
+
+        std::sort(m_ownedFunctions.begin(), m_ownedFunctions.end(), [](FunctionRecord_t const& a, FunctionRecord_t const& b) {
+            return a.start < b.start;
         });
 
-        auto thisFn = std::prev(nextFn);
-        void* start = reinterpret_cast<void*>((*thisFn)->value + (*thisFn)->section->filepos);
-        char const* name = (*thisFn)->name;
-        void* end = reinterpret_cast<void*>((*nextFn)->value + (*thisFn)->section->filepos);
+        // Some hand written functions don't have a size, assume those run
+        // until the next function starts
+        for (size_t i = 0; i + 1 < m_ownedFunctions.size(); ++i)
+        {
+            if (m_ownedFunctions[i].end == m_ownedFunctions[i].start)
+                m_ownedFunctions[i].end = m_ownedFunctions[i + 1].start;
+        }
+
+        m_ownedFunctions.shrink_to_fit();
+        return strings;
+    }
+
+    FunctionRecord_t const& Elf::FindFunction(uintptr_t offset) const
+    {
+        FunctionRecord_t const* thisFn = nullptr;
+        if (m_lookupBuilt)
+        {
+            auto idx = m_lookup.Find(offset);
+            if (idx != FunctionLookupTable::npos)
+                thisFn = m_functions + idx;
+        }
+        else
+        {
+            auto nextFn = std::upper_bound(m_functions, m_functions + m_functionCount, offset,
+                [] (uintptr_t value, FunctionRecord_t const& function) {
+                    return value < function.start;
+                });
+
+            if (nextFn != m_functions)
+                thisFn = std::prev(nextFn);
+        }
 
-        std::unique_ptr<char, MallocDeleter<char>> demangledName(abi::__cxa_demangle(name, nullptr, nullptr, nullptr));
+        if (!thisFn)
+            throw std::runtime_error("No function contains offset");
 
+        return *thisFn;
+    }
+
+    Elf::Function_t Elf::MakeFunction(FunctionRecord_t const& function) const
+    {
         return Elf::Function_t {
-            start,
-            end,
-            demangledName.get()
+            reinterpret_cast<void*>(function.start),
+            reinterpret_cast<void*>(function.end),
+            GetName(function)
         };
     }
 
+    char const* Elf::GetName(FunctionRecord_t const& function) const
+    {
+        char const* name = m_names + function.name;
+        if (m_namesDemangled)
+            return name;
+
+        auto& demangledName = m_demangledNames[&function - m_functions];
+        if (auto cached = demangledName.load(std::memory_order_acquire))
+            return cached;
+
+        // __cxa_demangle reuses our buffer as long as it's big enough, so
+        // after warming up we don't allocate at all
+        static thread_local std::unique_ptr<char, MallocDeleter<char>> s_buffer;
+        static thread_local size_t s_bufferSize = 0;
+
+        int status = 0;
+        auto demangled = abi::__cxa_demangle(name, s_buffer.get(), &s_bufferSize, &status);
+        if (demangled)
+        {
+            s_buffer.release();
+            s_buffer.reset(demangled);
+        }
+
+        std::lock_guard<std::mutex> lock(m_nameMutex);
+        if (auto cached = demangledName.load(std::memory_order_relaxed))
+            return cached;
+
+        // Names that aren't mangled already live in our mapping
+        auto interned = (status == 0 && demangled) ? m_nameArena.Intern(demangled) : name;
+        demangledName.store(interned, std::memory_order_release);
+        return interned;
+    }
+
+    Elf::Function_t Elf::GetContainingFunction(void *offset)
+    {
+        if (!m_functionsLoaded)
+            LoadFunctions();
+
+        return MakeFunction(FindFunction(reinterpret_cast<uintptr_t>(offset)));
+    }
+
+    std::vector<Elf::Function_t> Elf::GetFunctionsNamed(char const* name)
+    {
+        if (!m_functionsLoaded)
+            LoadFunctions();
+
+        std::vector<Function_t> ret;
+        for (size_t i = 0; i < m_functionCount; ++i)
+        {
+            if (std::strcmp(GetName(m_functions[i]), name) == 0)
+                ret.push_back(MakeFunction(m_functions[i]));
+        }
+
+        return ret;
+    }
+
+    std::vector<Elf::Function_t> Elf::GetContainingFunctions(std::vector<void*> const& offsets, size_t threadCount)
+    {
+        if (!m_functionsLoaded)
+            LoadFunctions();
+
+        std::vector<SortedOffset_t> sortedOffsets;
+        sortedOffsets.reserve(offsets.size());
+        for (size_t i = 0; i < offsets.size(); ++i)
+            sortedOffsets.push_back(SortedOffset_t{reinterpret_cast<uintptr_t>(offsets[i]), i});
+
+        std::sort(sortedOffsets.begin(), sortedOffsets.end(), [] (SortedOffset_t const& a, SortedOffset_t const& b) {
+            return a.offset < b.offset;
+        });
+
+        std::vector<Function_t> ret(offsets.size());
+
+        threadCount = std::max<size_t>(1, std::min(threadCount, sortedOffsets.size()));
+        if (threadCount == 1)
+        {
+            ResolveSorted(sortedOffsets.data(), sortedOffsets.data() + sortedOffsets.size(), ret.data());
+            return ret;
+        }
+
+        // Each thread takes a contiguous range of the sorted offsets, so they
+        // still only need one lookup each to find where to start merging
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(threadCount);
+        auto chunkSize = (sortedOffsets.size() + threadCount - 1) / threadCount;
+        for (size_t i = 0; i < threadCount; ++i)
+        {
+            auto begin = sortedOffsets.data() + std::min(i * chunkSize, sortedOffsets.size());
+            auto end = sortedOffsets.data() + std::min((i + 1) * chunkSize, sortedOffsets.size());
+            threads.emplace_back([this, begin, end, &ret, &errors, i] {
+                try
+                {
+                    ResolveSorted(begin, end, ret.data());
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        for (auto& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        return ret;
+    }
+
+    void Elf::ResolveSorted(SortedOffset_t const* begin, SortedOffset_t const* end, Function_t* out) const
+    {
+        if (begin == end)
+            return;
+
+        auto functionsEnd = m_functions + m_functionCount;
+        auto thisFn = &FindFunction(begin->offset);
+        FunctionRecord_t const* resolvedFn = nullptr;
+        Function_t resolved;
+
+        for (auto it = begin; it != end; ++it)
+        {
+            while (thisFn + 1 != functionsEnd && (thisFn + 1)->start <= it->offset)
+                ++thisFn;
+
+            // Sites in the same function are next to each other, so we only
+            // need to build each function once
+            if (thisFn != resolvedFn)
+            {
+                resolved = MakeFunction(*thisFn);
+                resolvedFn = thisFn;
+            }
+
+            out[it->idx] = resolved;
+        }
+    }
+
 } // namespace eforce
@@ -1,31 +1,59 @@
 #include <eforce/CompiletimeRegistry.h>
 #include <eforce/Exception.h>
 #include <eforce/ExceptionForcer.h>
+#include <eforce/Patchable.h>
 
+#include <priv/CallerFilter.h>
+#include <priv/CodeWriter.h>
 #include <priv/OpcodeGeneratorAarch64.h>
 #include <priv/OpcodeGeneratorThumb.h>
 #include <priv/OpcodeGeneratorX64.h>
 #include <priv/Elf.h>
 #include <priv/IOpcodeGenerator.h>
 #include <priv/ProgOffsetResolver.h>
+#include <priv/SiteIndex.h>
+#include <priv/StubPool.h>
 
-#include <sys/mman.h>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
-#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 static auto s_throwInfos = COMPILETIME_REGISTRY(eforce::ThrowInfo, throw_locations);
 
+// Guards emitted by THROW_REGISTERED_EXCEPTION_IF. Weak so we still link when
+// nothing uses it
+extern eforce::ThrowGuard __start_throw_guards[] __attribute__((weak));
+extern eforce::ThrowGuard __stop_throw_guards[] __attribute__((weak));
+// Likewise for THROW_REGISTERED_EXCEPTION_IF_FLAGGED
+extern eforce::ThrowFlagGuard __start_throw_flag_guards[] __attribute__((weak));
+extern eforce::ThrowFlagGuard __stop_throw_flag_guards[] __attribute__((weak));
+
+// Start the arm flags on a fresh cache line so every site's check doesn't
+// share a line with whatever the linker puts before them
+__asm__(
+    ".pushsection throw_arm_flags,\"aw\",%nobits\r\n"
+    ".p2align 6\r\n"
+    ".popsection\r\n");
+
 namespace eforce
 {
     void Throw(std::exception_ptr* error)
@@ -35,89 +63,6 @@ namespace eforce
 
 namespace 
 {
-    /**
-    * @brief Parses /proc/self/maps to determine the executable area of
-    *   memory. This currently only considers the application, not any shared
-    *   libraries linked in
-    * @param[out] start: Start of executable area of process
-    * @param[out] end: End of executable area of process
-    */
-    void GetExecutableArea(void** start, void** end)
-    {
-        // FIXME: Impl here is pretty dumb, if the first line isn't our exe we break
-        std::ifstream iss("/proc/self/maps");
-        std::string input;
-        iss >> input;
-        std::string delimiter = "-";
-        auto delim_pos = input.find(delimiter);
-        std::string start_s = input.substr(0, delim_pos);
-        std::string end_s = input.substr(delim_pos + 1, input.length());
-        std::stringstream ss;
-        ss << std::hex << start_s;
-        ss >> *start;
-        ss.clear();
-        ss << std::hex << end_s;
-        ss >> *end;
-    }
-
-    struct ExecutableArea
-    {
-        void* start{};
-        void* end{};
-        ExecutableArea()
-        {
-            GetExecutableArea(&start, &end);
-        }
-    };
-
-    /**
-    * @brief: Class that allows writable executable segment of a program
-    */
-    class ScopedMprotect
-    {
-    public:
-        /**
-         * @brief Disables write protection on executable area
-         */
-        ScopedMprotect();
-
-        /**
-         * @brief Enables write protection on executable area
-         */
-        ~ScopedMprotect();
-
-        // Remove default copy/move constructors
-        ScopedMprotect(ScopedMprotect const& other) = delete;
-        ScopedMprotect(ScopedMprotect&& other) = delete;
-        ScopedMprotect& operator=(ScopedMprotect const& other) = delete;
-        ScopedMprotect& operator=(ScopedMprotect&& other) = delete;
-    private:
-        void* m_start;
-        void* m_end;
-    };
-
-    ScopedMprotect::ScopedMprotect()
-    {
-        // We use a static here because after one use the executable area in 
-        // /proc/self/maps moves an our parser is too dumb to notice
-        static ExecutableArea s_executableArea;
-        m_start = s_executableArea.start;
-        m_end = s_executableArea.end;
-
-        int err = mprotect(
-            m_start, 
-            static_cast<char*>(m_end) - static_cast<char*>(m_start),
-            PROT_WRITE | PROT_READ | PROT_EXEC);
-
-        if (err < 0)
-            throw std::runtime_error("Failed to mprotect");
-    }
-
-    ScopedMprotect::~ScopedMprotect()
-    {
-        mprotect(m_start, static_cast<char*>(m_end) - static_cast<char*>(m_start), PROT_READ | PROT_EXEC);
-    }
-
     /**
      * @brief Enum describing which architecture we are constructing for
      */
@@ -167,66 +112,745 @@ namespace
         }
     }
 
+    /**
+     * @brief Where one thread is in ForcedException's Decide. Only that
+     *  thread writes it, and it has a cache line to itself, so deciding a
+     *  call never writes anything another thread does. RetiredPatches reads
+     *  every thread's to tell when a grace period has passed
+     */
+    struct alignas(64) DecideState
+    {
+        /// Nested Decide calls the thread is in, a condition can call
+        /// detoured functions
+        std::atomic<unsigned> depth{0};
+        /// Times the thread has left its outermost Decide
+        std::atomic<uint64_t> exits{0};
+
+        /**
+         * @brief Only orders our own loads after the store,
+         *  DecideStates::Deciding makes the store visible to the reader
+         */
+        void Enter()
+        {
+            depth.store(depth.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+
+        void Leave()
+        {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            auto left = depth.load(std::memory_order_relaxed) - 1;
+            if (left == 0)
+                exits.store(exits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            depth.store(left, std::memory_order_release);
+        }
+    };
+
+    /**
+     * @brief Every live thread's DecideState. Leaked, threads can still
+     *  exit after static destructors have run
+     */
+    class DecideStates
+    {
+    public:
+        /// A thread that was in Decide, and how many times it had left it
+        struct Snapshot_t
+        {
+            DecideState const* pState;
+            uint64_t exits;
+        };
+
+        static DecideStates& Get()
+        {
+            static auto* s_pStates = new DecideStates;
+            return *s_pStates;
+        }
+
+        void Add(DecideState* pState)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_states.push_back(pState);
+        }
+
+        void Remove(DecideState* pState)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_states.erase(std::find(m_states.begin(), m_states.end(), pState));
+        }
+
+        /**
+         * @brief Gets the threads in Decide right now
+         */
+        std::vector<Snapshot_t> Deciding()
+        {
+            SyncDecidingThreads();
+
+            std::vector<Snapshot_t> deciding;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto pState : m_states)
+            {
+                if (pState->depth.load(std::memory_order_acquire) != 0)
+                    deciding.push_back(Snapshot_t{pState, pState->exits.load(std::memory_order_acquire)});
+            }
+
+            return deciding;
+        }
+
+        /**
+         * @brief Whether every thread in deciding has left Decide since, or
+         *  exited
+         */
+        bool HaveLeft(std::vector<Snapshot_t> const& deciding)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto const& snapshot : deciding)
+            {
+                if (std::find(m_states.begin(), m_states.end(), snapshot.pState) == m_states.end())
+                    continue;
+
+                if (snapshot.pState->depth.load(std::memory_order_acquire) != 0
+                    && snapshot.pState->exits.load(std::memory_order_acquire) == snapshot.exits)
+                    return false;
+            }
+
+            return true;
+        }
+
+    private:
+        /**
+         * @brief Makes the stores of every thread running right now visible
+         *  to us, so Enter only needs a compiler barrier. Without
+         *  membarrier we rely on StubPool's quiescent period, which is far
+         *  longer than any store takes to land
+         */
+        static void SyncDecidingThreads()
+        {
+        #if defined(__NR_membarrier)
+            static bool const s_registered = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+            if (s_registered)
+                syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        #endif
+        }
+
+        std::mutex m_mutex;
+        std::vector<DecideState*> m_states;
+    };
+
+    /**
+     * @brief Registers the calling thread's DecideState for as long as the
+     *  thread lives
+     */
+    struct ThreadDecideState
+    {
+        ThreadDecideState() { DecideStates::Get().Add(&state); }
+        ~ThreadDecideState() { DecideStates::Get().Remove(&state); }
+        ThreadDecideState(ThreadDecideState const& other) = delete;
+        ThreadDecideState& operator=(ThreadDecideState const& other) = delete;
+
+        DecideState state;
+    };
+
+    DecideState& CurrentDecideState()
+    {
+        thread_local ThreadDecideState t_state;
+        return t_state.state;
+    }
+
+    /**
+     * @brief A throw patch for a single function. Constructing one only
+     *  prepares the patch, callers write the arm or disarm patches with an
+     *  ICodeWriter and then tell us which state we're in. This lets many
+     *  patches share one write
+     *
+     *  Sites guarded by THROW_REGISTERED_EXCEPTION_IF_FLAGGED are forced by
+     *  setting their arm flags, with no code written at all.
+     *  Sites with a THROW_REGISTERED_EXCEPTION_IF guard have the guard turned
+     *  into a jump to their own throw. Otherwise functions with an
+     *  EFORCE_PATCHABLE pad get a throw stub in the pad and a jump to it at
+     *  their entry. Everything else gets a throw stub from the StubPool and a
+     *  single branch to it over the start of its prologue, or the whole stub
+     *  over its prologue if the pool has nothing in range.
+     *
+     *  Exceptions forced with a condition instead branch from the entry to
+     *  a detour stub from the StubPool, through the pad if there is one. The
+     *  stub asks the condition on every call and either throws, or runs the
+     *  instructions the branch went over and carries on into the function
+     */
     class ForcedException 
     {
     public:
-        ForcedException(Elf::Function_t const& containingFn, std::exception_ptr pException, ProgOffsetResolver const& rOffsetResolver);
+        /**
+         * @param[in] padded Whether the function has an EFORCE_PATCHABLE pad
+         * @param[in] condition Which calls throw, every call if empty
+         * @param[in] pCodeWriter Writer used to disarm the patch if it is
+         *  destroyed while armed
+         * @param[in] replacing Currently armed ForcedExceptions in the same
+         *  function that this one replaces, the function's entry patch and
+         *  any guard being disarmed alongside us
+         */
+        ForcedException(void* fnStart, void* fnEnd, bool padded, std::exception_ptr pException, ThrowCondition condition,
+            ICodeWriter* pCodeWriter, std::vector<ForcedException const*> const& replacing);
+
+        /**
+         * @brief Forces a site through its guard
+         * @param[in] guard The site's guard nop
+         * @param[in] target The site's throw block
+         */
+        ForcedException(void* guard, void* target, ICodeWriter* pCodeWriter);
+
+        /**
+         * @brief Forces a site through its arm flags
+         * @param[in] armFlags Every flag the site checks, there is one for
+         *  each copy of the site the compiler made
+         */
+        explicit ForcedException(std::vector<uint8_t*> armFlags);
+
+        /**
+         * @brief Disarms the patch if it is still armed, and returns our
+         *  stubs to the StubPool once nothing branches to them
+         */
         ~ForcedException();
         ForcedException(ForcedException const& other) = delete;
-        ForcedException(ForcedException&& other) noexcept;
+        ForcedException(ForcedException&& other) = delete;
         ForcedException& operator=(ForcedException const& other) = delete;
-        ForcedException& operator=(ForcedException&& other) noexcept;
+        ForcedException& operator=(ForcedException&& other) = delete;
+
+        /**
+         * @brief Adds the patches that make the function throw, in the order
+         *  they need to be written
+         */
+        void AppendArmPatches(std::vector<CodePatch>& patches) const;
+
+        /**
+         * @brief Adds the patches that make the function behave normally again
+         */
+        void AppendDisarmPatches(std::vector<CodePatch>& patches) const;
+
+        /**
+         * @brief Whether our arm patches cover everything other wrote when it
+         *  was armed, so we can replace it without disarming it first
+         */
+        bool Overwrites(ForcedException const& other) const;
+
+        bool IsArmed() const { return m_armed; }
+
+        /**
+         * @brief Records whether our patches are written. Flag guarded
+         *  sites have nothing written and are armed right here instead
+         */
+        void SetArmed(bool armed);
+
     private:
-        void* m_fnStart;
-        std::unique_ptr<std::exception_ptr> m_pException; 
+        /// Whether this patch overwrites the function's prologue
+        bool PatchesPrologue() const { return !m_padded && !m_pGuard && m_armFlags.empty(); }
+
+        /// Bytes we write at the function entry
+        size_t EntryPatchSize() const { return (m_pStub || m_pDetour) ? m_entryJump.size() : m_throwOpcode.size(); }
+
+        /**
+         * @brief Prepares the patches for the prologue constructor, which
+         *  frees our stubs if this throws
+         */
+        void PreparePrologue(IOpcodeGenerator& opcodeGenerator, void* fnEnd, bool padded, std::vector<ForcedException const*> const& replacing);
+
+        /**
+         * @brief Reads the function as it was before any patch. If it's
+         *  already patched the code in memory isn't the original anymore,
+         *  but the patches we're replacing know what was
+         */
+        std::vector<uint8_t> ReadOriginalCode(size_t fnSize, std::vector<ForcedException const*> const& replacing) const;
+
+        /**
+         * @brief Gets m_detourOpcode for our detour stub
+         * @param[in] resume where the function carries on after the stub
+         * @param[in] displace bytes at resume the branch to the stub goes over
+         * @param[in] code the function's code from resume to fnEnd
+         */
+        std::vector<uint8_t> GetDetourOpcode(IOpcodeGenerator& opcodeGenerator, uint8_t* resume, void* fnEnd, size_t displace, uint8_t const* code);
+
+        /**
+         * @brief Called by our detour stub on every call of the function
+         * @param[in] pFrame frame record of the call, see CurrentDetourFrame
+         * @return the exception to throw, or null to let the call through
+         */
+        static std::exception_ptr* Decide(void* pForced, FrameRecord_t const* pFrame) noexcept;
+
+        void FreeStubs();
+
+        uint8_t* m_fnStart;
+        std::exception_ptr m_exception;
+        std::vector<uint8_t> m_throwOpcode;
         std::vector<uint8_t> m_originalData;
-        ProgOffsetResolver const& m_rOffsetResolver;
+        /// Where m_throwOpcode goes, in the pad or a StubPool slot. Null if
+        /// it goes over the prologue
+        uint8_t* m_pStub = nullptr;
+        /// Whether m_pStub is in an EFORCE_PATCHABLE pad
+        bool m_padded = false;
+        /// Which of the pad's two stubs m_pStub is
+        size_t m_stubSlot = 0;
+        /// Jump from the function entry to m_pStub
+        std::vector<uint8_t> m_entryJump;
+        /// Guard we turn into a jump, null if the site isn't guarded
+        uint8_t* m_pGuard = nullptr;
+        /// Whether the entry, or guard, can be swapped with a single store.
+        /// Unoptimized builds don't align functions, so not every padded
+        /// entry can
+        bool m_entryAtomic = false;
+        /// Flags we set to arm the site, empty if the site isn't flag guarded
+        std::vector<uint8_t*> m_armFlags;
+        /// Which calls throw, empty if every call does
+        ThrowCondition m_condition;
+        /// Our detour stub in a StubPool slot, null unless we have a
+        /// condition
+        uint8_t* m_pDetour = nullptr;
+        std::vector<uint8_t> m_detourOpcode;
+        ICodeWriter* m_pCodeWriter = nullptr;
+        bool m_armed = false;
     };
 
-    ForcedException::ForcedException(Elf::Function_t const& containingFn, std::exception_ptr pException, ProgOffsetResolver const& rOffsetResolver)
-        : m_fnStart(rOffsetResolver.FromOffset(containingFn.startOffset))
-        , m_pException(new std::exception_ptr(std::move(pException)))
-        , m_rOffsetResolver(rOffsetResolver)
+    ForcedException::ForcedException(void* fnStart, void* fnEnd, bool padded, std::exception_ptr pException, ThrowCondition condition,
+        ICodeWriter* pCodeWriter, std::vector<ForcedException const*> const& replacing)
+        : m_fnStart(static_cast<uint8_t*>(fnStart))
+        , m_exception(std::move(pException))
+        , m_condition(std::move(condition))
+        , m_pCodeWriter(pCodeWriter)
     {
-        auto fnEnd = m_rOffsetResolver.FromOffset(containingFn.endOffset);
-
         auto opcodeGenerator = GetOpcodeGenerator();
-        auto doThrowOpcode = opcodeGenerator->GetThrowOpcode(m_fnStart, reinterpret_cast<void*>(&Throw),m_pException.get());
 
-        size_t fnSize = reinterpret_cast<char*>(fnEnd) - reinterpret_cast<char*>(m_fnStart);
+        // A detour stub is too big for a pad, so it always comes from the pool
+        if (m_condition)
+        {
+            auto stubRange = opcodeGenerator->GetStubRange();
+            if (stubRange)
+                m_pDetour = StubPool::Get().Allocate(m_fnStart, stubRange, StubPool::k_detourSlotSize);
+            if (!m_pDetour)
+                throw std::runtime_error("Cannot detour function");
+        }
+
+        try
+        {
+            PreparePrologue(*opcodeGenerator, fnEnd, padded, replacing);
+        }
+        catch (...)
+        {
+            FreeStubs();
+            throw;
+        }
+    }
+
+    void ForcedException::PreparePrologue(IOpcodeGenerator& opcodeGenerator, void* fnEnd, bool padded, std::vector<ForcedException const*> const& replacing)
+    {
+        size_t fnSize = static_cast<uint8_t*>(fnEnd) - m_fnStart;
+
+    #if defined(EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES)
+        if (padded)
+        {
+            // A thread may still be running the stub we're replacing, so
+            // alternate between the two stubs in the pad
+            constexpr size_t k_stubSize = EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES / 2;
+            m_stubSlot = 0;
+            for (auto pReplacing : replacing)
+            {
+                if (pReplacing->m_padded && pReplacing->m_stubSlot == 0)
+                    m_stubSlot = 1;
+            }
+
+            m_pStub = m_fnStart - EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES + m_stubSlot * k_stubSize;
+            m_padded = true;
+            m_originalData = opcodeGenerator.GetEntryNop();
+
+            if (m_pDetour)
+            {
+                // The pad's stub passes straight on to the detour, which
+                // only has our entry nop to step over
+                auto resume = m_fnStart + m_originalData.size();
+                auto original = ReadOriginalCode(fnSize, replacing);
+                m_detourOpcode = GetDetourOpcode(opcodeGenerator, resume, fnEnd, 0, original.data() + m_originalData.size());
+                m_throwOpcode = opcodeGenerator.GetStubJump(m_pStub, m_pDetour);
+            }
+            else
+            {
+                m_throwOpcode = opcodeGenerator.GetThrowOpcode(m_pStub, reinterpret_cast<void*>(&Throw), &m_exception);
+            }
+
+            if (m_throwOpcode.size() > k_stubSize)
+                throw std::logic_error("Generated opcode too large for pad");
+
+            m_entryJump = opcodeGenerator.GetEntryJump(m_fnStart, m_pStub);
+            m_entryAtomic = reinterpret_cast<uintptr_t>(m_fnStart) % m_entryJump.size() == 0;
+            return;
+        }
+    #else
+        (void)padded;
+    #endif
+
+        auto original = ReadOriginalCode(fnSize, replacing);
+
+        // A stub close by means only a single branch goes over the prologue,
+        // which small functions have room for and which can be written in
+        // one go
+        auto stubRange = opcodeGenerator.GetStubRange();
+        if (stubRange && !m_pDetour)
+            m_pStub = StubPool::Get().Allocate(m_fnStart, stubRange);
+
+        if (m_pDetour)
+        {
+            m_entryJump = opcodeGenerator.GetStubJump(m_fnStart, m_pDetour);
+            if (m_entryJump.size() > fnSize)
+                throw std::runtime_error("Generated opcode too large");
+
+            m_detourOpcode = GetDetourOpcode(opcodeGenerator, m_fnStart, fnEnd, m_entryJump.size(), original.data());
+        }
+        else if (m_pStub)
+        {
+            m_throwOpcode = opcodeGenerator.GetThrowOpcode(m_pStub, reinterpret_cast<void*>(&Throw), &m_exception);
+            m_entryJump = opcodeGenerator.GetStubJump(m_fnStart, m_pStub);
+            if (m_throwOpcode.size() > StubPool::k_slotSize || m_entryJump.size() > fnSize)
+                throw std::runtime_error("Generated opcode too large");
+        }
+        else
+        {
+            m_throwOpcode = opcodeGenerator.GetThrowOpcode(m_fnStart, reinterpret_cast<void*>(&Throw), &m_exception);
+            if (m_throwOpcode.size() > fnSize)
+                throw std::runtime_error("Generated opcode too large");
+        }
 
-        if (doThrowOpcode.size() > fnSize)
+        // Only a 4 byte branch is a single store, the 5 byte x86 jump is
+        // staged like any other patch
+        if (m_pStub || m_pDetour)
+            m_entryAtomic = m_entryJump.size() == 4 && reinterpret_cast<uintptr_t>(m_fnStart) % 4 == 0;
+
+        m_originalData.assign(original.begin(), original.begin() + EntryPatchSize());
+    }
+
+    std::vector<uint8_t> ForcedException::ReadOriginalCode(size_t fnSize, std::vector<ForcedException const*> const& replacing) const
+    {
+        std::vector<uint8_t> original(m_fnStart, m_fnStart + fnSize);
+        for (auto pReplacing : replacing)
+        {
+            if (pReplacing->PatchesPrologue())
+            {
+                auto size = std::min(original.size(), pReplacing->m_originalData.size());
+                std::copy(pReplacing->m_originalData.begin(), pReplacing->m_originalData.begin() + size, original.begin());
+            }
+
+            // Likewise an armed guard in the function isn't what was there
+            if (pReplacing->m_pGuard)
+            {
+                auto const& guardNop = pReplacing->m_originalData;
+                auto guardOffset = pReplacing->m_pGuard - m_fnStart;
+                for (size_t i = 0; i < guardNop.size(); ++i)
+                {
+                    auto offset = guardOffset + static_cast<std::ptrdiff_t>(i);
+                    if (offset >= 0 && static_cast<size_t>(offset) < original.size())
+                        original[offset] = guardNop[i];
+                }
+            }
+        }
+
+        return original;
+    }
+
+    std::vector<uint8_t> ForcedException::GetDetourOpcode(IOpcodeGenerator& opcodeGenerator, uint8_t* resume, void* fnEnd, size_t displace, uint8_t const* code)
+    {
+        DetourSpec_t spec{
+            m_pDetour,
+            resume,
+            fnEnd,
+            displace,
+            reinterpret_cast<void*>(&ForcedException::Decide),
+            this,
+            reinterpret_cast<void*>(&Throw),
+        };
+
+        auto detour = opcodeGenerator.GetDetourOpcode(spec, code);
+        if (detour.empty())
+            throw std::runtime_error("Cannot detour function");
+        if (detour.size() > StubPool::k_detourSlotSize)
             throw std::runtime_error("Generated opcode too large");
 
-        std::copy(reinterpret_cast<char const*>(m_fnStart), reinterpret_cast<char const*>(m_fnStart) + doThrowOpcode.size(), std::back_inserter(m_originalData));
+        return detour;
+    }
+
+    std::exception_ptr* ForcedException::Decide(void* pForced, FrameRecord_t const* pFrame) noexcept
+    {
+        auto pThis = static_cast<ForcedException*>(pForced);
+        auto& decideState = CurrentDecideState();
+        decideState.Enter();
+
+        // The condition may itself call detoured functions
+        auto& currentFrame = CurrentDetourFrame();
+        auto pOuterFrame = currentFrame;
+        currentFrame = pFrame;
 
-        ScopedMprotect scopedMprotect [[gnu::unused]];
-        std::copy(doThrowOpcode.begin(), doThrowOpcode.end(), static_cast<uint8_t*>(m_fnStart));
+        std::exception_ptr* pError = nullptr;
+        try
+        {
+            if (pThis->m_condition() && pThis->m_exception)
+                pError = &pThis->m_exception;
+        }
+        catch (...)
+        {
+        }
+
+        currentFrame = pOuterFrame;
+        decideState.Leave();
+        return pError;
     }
 
-    ForcedException::ForcedException(ForcedException&& other) noexcept
-        : m_fnStart(other.m_fnStart)
-        , m_pException(std::move(other.m_pException))
-        , m_originalData(std::move(other.m_originalData))
-        , m_rOffsetResolver(other.m_rOffsetResolver)
-    {}
+    void ForcedException::FreeStubs()
+    {
+        if (m_pStub && !m_padded)
+            StubPool::Get().Free(m_pStub);
+        if (m_pDetour)
+            StubPool::Get().Free(m_pDetour, StubPool::k_detourSlotSize);
 
-    ForcedException& ForcedException::operator=(ForcedException&& other) noexcept
+        m_pStub = nullptr;
+        m_pDetour = nullptr;
+    }
+
+    ForcedException::ForcedException(void* guard, void* target, ICodeWriter* pCodeWriter)
+        : m_fnStart(nullptr)
+        , m_pGuard(static_cast<uint8_t*>(guard))
+        , m_pCodeWriter(pCodeWriter)
     {
-        ForcedException tmp(std::move(other));
-        std::swap(*this, tmp);
-        return *this;
+        auto opcodeGenerator = GetOpcodeGenerator();
+        // The guard may be covered by a prologue patch we're replacing, so
+        // don't go by what's in memory. It's always a nop when unforced
+        m_throwOpcode = opcodeGenerator->GetGuardJump(guard, target);
+        m_originalData = opcodeGenerator->GetGuardNop();
+
+        // A 4 byte guard is a single instruction we can swap with one store.
+        // The 5 byte x86 guard can't be, and is staged like any other patch
+        m_entryAtomic = m_throwOpcode.size() == 4 && reinterpret_cast<uintptr_t>(m_pGuard) % 4 == 0;
     }
 
+    ForcedException::ForcedException(std::vector<uint8_t*> armFlags)
+        : m_fnStart(nullptr)
+        , m_armFlags(std::move(armFlags))
+    {}
+
     ForcedException::~ForcedException()
     {
-        if (m_originalData.empty())
+        if (m_armed && !m_armFlags.empty())
+            SetArmed(false);
+
+        if (m_armed)
+        {
+            try
+            {
+                std::vector<CodePatch> patches;
+                AppendDisarmPatches(patches);
+                m_pCodeWriter->Write(patches);
+                m_armed = false;
+            }
+            catch (std::exception const&)
+            {
+                // Nothing sensible left to do, and we can't throw from here
+            }
+        }
+
+        // A stub something may still branch to is leaked rather than reused
+        if (!m_armed)
+            FreeStubs();
+    }
+
+    bool ForcedException::Overwrites(ForcedException const& other) const
+    {
+        if (!m_armFlags.empty() || !other.m_armFlags.empty())
+            return m_armFlags == other.m_armFlags;
+
+        if (m_pGuard || other.m_pGuard)
+            return m_pGuard == other.m_pGuard;
+
+        // Replacing a longer patch at the entry with a shorter one would
+        // leave the end of the old one behind
+        return m_fnStart == other.m_fnStart && m_padded == other.m_padded
+            && EntryPatchSize() >= other.EntryPatchSize();
+    }
+
+    void ForcedException::SetArmed(bool armed)
+    {
+        for (auto pFlag : m_armFlags)
+            __atomic_store_n(pFlag, static_cast<uint8_t>(armed), __ATOMIC_RELAXED);
+
+        m_armed = armed;
+    }
+
+    void ForcedException::AppendArmPatches(std::vector<CodePatch>& patches) const
+    {
+        if (!m_armFlags.empty())
             return;
 
-        ScopedMprotect protector [[gnu::unused]];
+        if (m_pGuard)
+        {
+            patches.push_back(CodePatch{m_pGuard, m_throwOpcode.data(), m_throwOpcode.size(), m_entryAtomic});
+            return;
+        }
+
+        // Nothing runs the stubs until the entry jumps to them
+        if (m_pDetour)
+            patches.push_back(CodePatch{m_pDetour, m_detourOpcode.data(), m_detourOpcode.size(), false});
+
+        if (m_pStub)
+            patches.push_back(CodePatch{m_pStub, m_throwOpcode.data(), m_throwOpcode.size(), false});
+
+        if (m_pStub || m_pDetour)
+        {
+            patches.push_back(CodePatch{m_fnStart, m_entryJump.data(), m_entryJump.size(), m_entryAtomic});
+            return;
+        }
+
+        patches.push_back(CodePatch{m_fnStart, m_throwOpcode.data(), m_throwOpcode.size(), false});
+    }
+
+    void ForcedException::AppendDisarmPatches(std::vector<CodePatch>& patches) const
+    {
+        if (!m_armFlags.empty())
+            return;
+
+        auto pDest = m_pGuard ? m_pGuard : m_fnStart;
+        patches.push_back(CodePatch{pDest, m_originalData.data(), m_originalData.size(), m_entryAtomic});
+    }
+
+    /**
+     * @brief Keeps disarmed ForcedExceptions alive until no thread can still
+     *  be running their stubs or conditions. Once disarmed, nothing new
+     *  branches to a patch's stubs, but a thread may already be in one.
+     *  StubPool's quiescent period covers the few instructions either side
+     *  of a condition, and a condition can take as long as it likes,
+     *  injected latency sleeps in one. So once the period has passed we
+     *  note which threads are in Decide, and free the patch when each of
+     *  them has left it. Leaked, so patches retired by static
+     *  ExceptionForcers stay alive for threads still running at exit
+     */
+    class RetiredPatches
+    {
+    public:
+        static RetiredPatches& Get()
+        {
+            static auto* s_pRetired = new RetiredPatches;
+            return *s_pRetired;
+        }
+
+        /**
+         * @brief Takes pForced, which must not be armed, and frees any patch
+         *  that has been retired long enough
+         */
+        void Retire(std::unique_ptr<ForcedException> pForced)
+        {
+            auto now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (pForced)
+                m_retired.push_back(Retired{std::move(pForced), now, false, {}});
+
+            ReapLocked(now);
+        }
+
+        /**
+         * @brief Frees any patch that has been retired long enough
+         */
+        void Reap()
+        {
+            Retire(nullptr);
+        }
+
+    private:
+        struct Retired
+        {
+            std::unique_ptr<ForcedException> pForced;
+            std::chrono::steady_clock::time_point retiredAt;
+            /// Whether deciding is filled in yet
+            bool quiescent;
+            /// Threads in Decide once the quiescent period had passed
+            std::vector<DecideStates::Snapshot_t> deciding;
+        };
+
+        void ReapLocked(std::chrono::steady_clock::time_point now)
+        {
+            // Every patch past its quiescent period can share a snapshot
+            std::vector<DecideStates::Snapshot_t> deciding;
+            bool snapshotTaken = false;
+            auto idle = std::partition(m_retired.begin(), m_retired.end(), [&] (Retired& retired) {
+                if (now - retired.retiredAt < StubPool::k_quiescentPeriod)
+                    return true;
+
+                if (!retired.quiescent)
+                {
+                    if (!snapshotTaken)
+                        deciding = DecideStates::Get().Deciding();
+
+                    snapshotTaken = true;
+                    retired.quiescent = true;
+                    retired.deciding = deciding;
+                }
+
+                return !DecideStates::Get().HaveLeft(retired.deciding);
+            });
+
+            m_retired.erase(idle, m_retired.end());
+        }
+
+        std::mutex m_mutex;
+        std::vector<Retired> m_retired;
+    };
+
+    /**
+     * @brief A write failed part way and putting back what was there failed
+     *  too, so some of its patches may be live
+     */
+    class PartialWriteError
+        : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    /// Minimum number of throw sites each thread resolves in GetExceptions
+    constexpr size_t k_sitesPerThread = 8192;
+
+#if defined(EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES)
+    /**
+     * @brief Reads the readable runs of adjacent mappings in the process,
+     *  each run's start keyed by its end
+     */
+    std::map<uintptr_t, uintptr_t> ReadReadableRuns()
+    {
+        std::map<uintptr_t, uintptr_t> runs;
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        uintptr_t runStart = 0;
+        uintptr_t runEnd = 0;
+        while (std::getline(maps, line))
+        {
+            // start-end perms offset dev inode path
+            auto dash = line.find('-');
+            auto space = line.find(' ');
+            if (dash == std::string::npos || space == std::string::npos || line.size() <= space + 1)
+                continue;
+
+            if (line[space + 1] != 'r')
+                continue;
+
+            auto start = static_cast<uintptr_t>(std::stoull(line.substr(0, dash), nullptr, 16));
+            auto end = static_cast<uintptr_t>(std::stoull(line.substr(dash + 1), nullptr, 16));
+            if (start != runEnd)
+            {
+                if (runEnd != 0)
+                    runs[runEnd] = runStart;
+
+                runStart = start;
+            }
+
+            runEnd = end;
+        }
+
+        if (runEnd != 0)
+            runs[runEnd] = runStart;
 
-        std::copy(m_originalData.begin(), m_originalData.end(), static_cast<uint8_t*>(m_fnStart));
+        return runs;
     }
+#endif
 } // namespace
 
     // https://monoinfinito.wordpress.com/series/exception-handling-in-c/
@@ -234,65 +858,666 @@ namespace
     {
     public:
         std::vector<ExceptionInfo> GetExceptions();
+        void VisitExceptions(ExceptionVisitor const& visitor);
+        void VisitExceptionsInFile(char const* file, int firstLine, int lastLine, ExceptionVisitor const& visitor);
+        void VisitExceptionsInFunction(char const* name, ExceptionVisitor const& visitor);
+        void VisitExceptionsOfType(char const* type, ExceptionVisitor const& visitor);
         void ForceException(void* loc);
         void ForceException(void* loc, std::exception_ptr pError);
+        void ForceExceptionIf(void* loc, std::exception_ptr pError, ThrowCondition condition);
+        void InjectLatency(void* loc, Latency latency, ThrowCondition condition);
         void UnforceException(void* loc);
+        void UnforceAll();
+        static void UnforceAllInProcess();
+        void Apply(ForceBatch const& batch);
+        ThrowCondition CalledFrom(std::vector<std::string> const& functionNames, unsigned depth, ThrowCondition condition);
+        Impl();
+        ~Impl();
     private:
+        /// Every Impl alive in the process, for UnforceAllInProcess
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<Impl*> impls;
+        };
+
+        static Registry& GetRegistry();
+
+        /**
+         * @brief Adds disarming every armed site to patches, caller holds
+         *  m_mutex
+         */
+        void AppendUnforceAllPatches(std::vector<CodePatch>& patches) const;
+
+        /**
+         * @brief Forgets every site once the patches from
+         *  AppendUnforceAllPatches are written, caller holds m_mutex
+         */
+        void FinishUnforceAll();
+
+        /**
+         * @brief Resolves every registered throw site, only done once
+         */
+        SiteIndex const& GetSiteIndex();
+
+        /**
+         * @brief Finds the functions with throw sites that have an
+         *  EFORCE_PATCHABLE pad, and puts our entry nop in their pads
+         */
+        void PreparePaddedEntries();
+
+        /**
+         * @brief Writes patches if there are any, so batches of flag
+         *  guarded sites never touch code. If the write fails part way we
+         *  put back what was there and rethrow, so either every patch is
+         *  written or none are
+         * @throws PartialWriteError if putting the code back fails too
+         */
+        void Write(std::vector<CodePatch> const& patches);
+
+        /// Held while we change what's forced, UnforceAllInProcess takes it
+        /// after the registry's
+        std::mutex m_mutex;
         Elf m_elf{"/proc/self/exe"};
         ProgOffsetResolver m_offsetResolver;
-        std::map<void*, ForcedException> m_forcedExceptions;
+        std::unique_ptr<ICodeWriter> m_pCodeWriter{GetCodeWriter()};
+        std::unique_ptr<SiteIndex> m_pSiteIndex;
+        /// Guard or flag patch forcing each site, indexed by position in our
+        /// SiteIndex
+        std::vector<std::unique_ptr<ForcedException>> m_forcedExceptions;
+        /// Whether each site is forced through its function's entry
+        std::vector<bool> m_forcedAtEntry;
+
+        /// Patch at a function's entry, shared by every site in the function
+        /// forced through it
+        struct EntryPatch
+        {
+            std::unique_ptr<ForcedException> pForcedException;
+            /// Sites forced through the entry, the patch goes with the last
+            size_t sites;
+        };
+
+        /// Entry patches by function entry
+        std::unordered_map<uint8_t*, EntryPatch> m_entryPatches;
+        /// Sorted entries of functions we can force through their pad
+        std::vector<uint8_t*> m_paddedEntries;
+        /// THROW_REGISTERED_EXCEPTION_IF guard for each site, or null
+        std::vector<void*> m_siteGuards;
+        /// THROW_REGISTERED_EXCEPTION_IF_FLAGGED flags for each site, empty
+        /// if the site isn't flag guarded
+        std::vector<std::vector<uint8_t*>> m_siteArmFlags;
     };
 
-    std::vector<ExceptionInfo> ExceptionForcer::Impl::GetExceptions()
+    void ExceptionForcer::Impl::Write(std::vector<CodePatch> const& patches)
     {
+        if (patches.empty())
+            return;
+
+        std::vector<uint8_t> originals;
+        for (auto const& patch : patches)
+            originals.insert(originals.end(), patch.dest, patch.dest + patch.size);
+
+        try
+        {
+            m_pCodeWriter->Write(patches);
+        }
+        catch (std::runtime_error const&)
+        {
+            // A patch may go over an earlier one, so put them back last
+            // to first
+            std::vector<CodePatch> restore;
+            auto original = originals.data() + originals.size();
+            for (auto patch = patches.rbegin(); patch != patches.rend(); ++patch)
+            {
+                original -= patch->size;
+                restore.push_back(CodePatch{patch->dest, original, patch->size, patch->atomic});
+            }
+
+            try
+            {
+                m_pCodeWriter->Write(restore);
+            }
+            catch (std::runtime_error const& error)
+            {
+                throw PartialWriteError(error.what());
+            }
+
+            throw;
+        }
+    }
+
+    SiteIndex const& ExceptionForcer::Impl::GetSiteIndex()
+    {
+        if (m_pSiteIndex)
+            return *m_pSiteIndex;
+
+        std::vector<void*> offsets;
+        offsets.reserve(s_throwInfos.size());
+        for (auto& throwInfo : s_throwInfos)
+            offsets.push_back(m_offsetResolver.ToOffset(throwInfo.throwAddr));
+
+        // Most of the work here is demangling, which is worth spreading out
+        // once we have enough sites
+        size_t threadCount = std::min<size_t>(std::thread::hardware_concurrency(), offsets.size() / k_sitesPerThread);
+        auto funcs = m_elf.GetContainingFunctions(offsets, threadCount);
+
         std::vector<ExceptionInfo> ret;
         ret.reserve(s_throwInfos.size());
 
-        std::transform(s_throwInfos.begin(), s_throwInfos.end(), std::back_inserter(ret),
-            [&] (ThrowInfo& throwInfo) { 
-                auto func = m_elf.GetContainingFunction(m_offsetResolver.ToOffset(throwInfo.throwAddr));
-                return ExceptionInfo {
-                    throwInfo.throwAddr,
-                    throwInfo.file,
-                    throwInfo.line,
-                    throwInfo.exceptionStr,
-                    { 
-                        m_offsetResolver.FromOffset(func.startOffset),
-                        m_offsetResolver.FromOffset(func.endOffset),
-                        func.name,
-                    }
-            };});
-        
-        return ret;
+        auto func = funcs.begin();
+        for (auto& throwInfo : s_throwInfos)
+        {
+            ret.push_back(ExceptionInfo {
+                throwInfo.throwAddr,
+                throwInfo.file,
+                throwInfo.line,
+                throwInfo.exceptionStr,
+                {
+                    m_offsetResolver.FromOffset(func->startOffset),
+                    m_offsetResolver.FromOffset(func->endOffset),
+                    func->name,
+                }
+            });
+            ++func;
+        }
+
+        m_pSiteIndex.reset(new SiteIndex(std::move(ret)));
+        m_forcedExceptions.resize(m_pSiteIndex->Sites().size());
+        m_forcedAtEntry.resize(m_pSiteIndex->Sites().size());
+
+        // A guard jumps to the start of its throw block, which is exactly
+        // what the site registered as its address
+        m_siteGuards.resize(m_pSiteIndex->Sites().size());
+        if (__start_throw_guards)
+        {
+            for (auto pGuard = __start_throw_guards; pGuard != __stop_throw_guards; ++pGuard)
+            {
+                auto siteIdx = m_pSiteIndex->Find(pGuard->target);
+                if (siteIdx != SiteIndex::npos)
+                    m_siteGuards[siteIdx] = pGuard->guard;
+            }
+        }
+
+        // Flag guards are found the same way. The compiler may copy a guard,
+        // when it unrolls a loop for instance, and every copy tests its own
+        // flag
+        m_siteArmFlags.resize(m_pSiteIndex->Sites().size());
+        if (__start_throw_flag_guards)
+        {
+            for (auto pGuard = __start_throw_flag_guards; pGuard != __stop_throw_flag_guards; ++pGuard)
+            {
+                auto siteIdx = m_pSiteIndex->Find(pGuard->target);
+                if (siteIdx != SiteIndex::npos)
+                    m_siteArmFlags[siteIdx].push_back(pGuard->flag);
+            }
+        }
+
+        PreparePaddedEntries();
+        return *m_pSiteIndex;
+    }
+
+    void ExceptionForcer::Impl::PreparePaddedEntries()
+    {
+    #if defined(EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES)
+        // Once we've written stubs into a pad it no longer looks like one, so
+        // remember every pad we've found for later ExceptionForcers. We can't
+        // use the compiler's __patchable_function_entries table, the linker
+        // drops entries from it along with discarded COMDAT sections
+        static std::mutex s_paddedMutex;
+        static std::vector<uint8_t*> s_paddedEntries;
+        std::lock_guard<std::mutex> lock(s_paddedMutex);
+
+        // Only look for a pad where there is memory to read, the first
+        // function in .text may start right at its mapping
+        auto readableRuns = ReadReadableRuns();
+        auto hasPadRoom = [&] (uint8_t const* pEntry) {
+            auto entry = reinterpret_cast<uintptr_t>(pEntry);
+            auto run = readableRuns.upper_bound(entry);
+            return run != readableRuns.end() && run->second + EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES <= entry;
+        };
+
+        auto opcodeGenerator = GetOpcodeGenerator();
+        for (auto const& site : m_pSiteIndex->Sites())
+        {
+            auto pEntry = static_cast<uint8_t*>(site.parentFn.start);
+            if (std::binary_search(s_paddedEntries.begin(), s_paddedEntries.end(), pEntry)
+                || (hasPadRoom(pEntry) && opcodeGenerator->HasEntryPad(pEntry)))
+                m_paddedEntries.push_back(pEntry);
+        }
+
+        std::sort(m_paddedEntries.begin(), m_paddedEntries.end());
+        m_paddedEntries.erase(std::unique(m_paddedEntries.begin(), m_paddedEntries.end()), m_paddedEntries.end());
+
+        std::vector<uint8_t*> known;
+        std::set_union(s_paddedEntries.begin(), s_paddedEntries.end(),
+            m_paddedEntries.begin(), m_paddedEntries.end(), std::back_inserter(known));
+        s_paddedEntries.swap(known);
+
+        // The compiler's pad may be several nops, make it a single
+        // instruction now so no thread can be part way through it when we arm
+        auto entryNop = opcodeGenerator->GetEntryNop();
+        std::vector<CodePatch> patches;
+        for (auto pEntry : m_paddedEntries)
+        {
+            if (!std::equal(entryNop.begin(), entryNop.end(), pEntry))
+                patches.push_back(CodePatch{pEntry, entryNop.data(), entryNop.size(), false});
+        }
+
+        Write(patches);
+    #endif
+    }
+
+    std::vector<ExceptionInfo> ExceptionForcer::Impl::GetExceptions()
+    {
+        return GetSiteIndex().Sites();
+    }
+
+    void ExceptionForcer::Impl::VisitExceptions(ExceptionVisitor const& visitor)
+    {
+        for (auto const& site : GetSiteIndex().Sites())
+            visitor(site);
+    }
+
+    void ExceptionForcer::Impl::VisitExceptionsInFile(char const* file, int firstLine, int lastLine, ExceptionVisitor const& visitor)
+    {
+        GetSiteIndex().VisitFile(file, firstLine, lastLine, visitor);
+    }
+
+    void ExceptionForcer::Impl::VisitExceptionsInFunction(char const* name, ExceptionVisitor const& visitor)
+    {
+        GetSiteIndex().VisitFunction(name, visitor);
+    }
+
+    void ExceptionForcer::Impl::VisitExceptionsOfType(char const* type, ExceptionVisitor const& visitor)
+    {
+        GetSiteIndex().VisitType(type, visitor);
     }
 
     void ExceptionForcer::Impl::ForceException(void* loc)
     {
-        ForceException(loc, std::exception_ptr());
+        ForceBatch batch;
+        batch.ForceException(loc);
+        Apply(batch);
     }
 
     void ExceptionForcer::Impl::ForceException(void* loc, std::exception_ptr pError)
     {
-        auto throwInfo = std::find_if(s_throwInfos.begin(), s_throwInfos.end(), [&] (ThrowInfo& throwInfo) { return throwInfo.throwAddr == loc; });
-        
-        if (throwInfo == s_throwInfos.end())
-            throw std::runtime_error("Could not find addr");
+        ForceBatch batch;
+        batch.ForceException(loc, std::move(pError));
+        Apply(batch);
+    }
 
-        auto containingFn = m_elf.GetContainingFunction(m_offsetResolver.ToOffset(throwInfo->throwAddr));
+    void ExceptionForcer::Impl::ForceExceptionIf(void* loc, std::exception_ptr pError, ThrowCondition condition)
+    {
+        ForceBatch batch;
+        batch.ForceExceptionIf(loc, std::move(pError), std::move(condition));
+        Apply(batch);
+    }
+
+    void ExceptionForcer::Impl::InjectLatency(void* loc, Latency latency, ThrowCondition condition)
+    {
+        ForceBatch batch;
+        batch.InjectLatency(loc, std::move(latency), std::move(condition));
+        Apply(batch);
+    }
+
+    void ExceptionForcer::Impl::UnforceException(void* loc)
+    {
+        ForceBatch batch;
+        batch.UnforceException(loc);
+        Apply(batch);
+    }
+
+    void ExceptionForcer::Impl::Apply(ForceBatch const& batch)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        RetiredPatches::Get().Reap();
+
+        auto const& siteIndex = GetSiteIndex();
+        auto const& operations = batch.Operations();
 
-        if (!throwInfo->GetException && !pError)
-            throw std::runtime_error("Exception input is not constant");
+        // Only the last operation on each site matters. Sort a list of
+        // (site, operation) pairs by site so the last operation for each
+        // site ends up at the end of its run
+        std::vector<std::pair<size_t, size_t>> siteOperations;
+        siteOperations.reserve(operations.size());
+        for (size_t i = 0; i < operations.size(); ++i)
+        {
+            auto siteIdx = siteIndex.Find(operations[i].loc);
+            if (siteIdx == SiteIndex::npos)
+            {
+                if (!operations[i].force)
+                    continue;
+
+                throw std::runtime_error("Could not find addr");
+            }
+
+            siteOperations.emplace_back(siteIdx, i);
+        }
 
-        auto errorToThrow = (pError) ? pError : throwInfo->GetException();
+        std::stable_sort(siteOperations.begin(), siteOperations.end(),
+            [] (std::pair<size_t, size_t> const& a, std::pair<size_t, size_t> const& b) {
+                return a.first < b.first;
+            });
 
-        m_forcedExceptions.emplace(loc, ForcedException(containingFn, errorToThrow, m_offsetResolver));
+        // Prepare every patch before we touch any code, if anything in the
+        // batch is invalid we want to throw with nothing applied. Guard and
+        // flag patches belong to their site, but a function has only the one
+        // entry, so sites forced through it share its patch
+        struct PlannedPatch
+        {
+            /// Site whose patch this is, npos for the function's entry patch
+            size_t siteIdx;
+            uint8_t* pFnStart;
+            /// Armed patch this one replaces, or null
+            ForcedException* pCurrent;
+            /// Null to only disarm pCurrent
+            std::unique_ptr<ForcedException> pForcedException;
+        };
+
+        struct EntryChange
+        {
+            /// Change in the number of sites forced through the entry
+            std::ptrdiff_t sites;
+            /// Latest operation forcing a site through the entry, which
+            /// decides what the entry does for all of them, or npos
+            size_t operationIdx;
+            size_t siteIdx;
+            /// Patches in the function the new entry patch replaces
+            std::vector<ForcedException const*> replacing;
+        };
+
+        std::vector<PlannedPatch> plan;
+        std::unordered_map<uint8_t*, EntryChange> entryChanges;
+        std::vector<std::pair<size_t, bool>> sitesAtEntry;
+        for (size_t i = 0; i < siteOperations.size(); ++i)
+        {
+            if (i + 1 < siteOperations.size() && siteOperations[i + 1].first == siteOperations[i].first)
+                continue;
+
+            auto siteIdx = siteOperations[i].first;
+            auto const& operation = operations[siteOperations[i].second];
+            auto const& site = siteIndex.Sites()[siteIdx];
+            auto pFnStart = static_cast<uint8_t*>(site.parentFn.start);
+            auto const& current = m_forcedExceptions[siteIdx];
+
+            // A guarded site constructs its own exception, unless we were
+            // given a different one to throw. Conditions are only asked at
+            // the function entry
+            std::unique_ptr<ForcedException> pForced;
+            bool throwsEveryCall = !operation.condition;
+            bool atEntry = false;
+            if (operation.force)
+            {
+                if (!m_siteArmFlags[siteIdx].empty() && !operation.pError && throwsEveryCall)
+                    pForced.reset(new ForcedException(m_siteArmFlags[siteIdx]));
+                else if (m_siteGuards[siteIdx] && !operation.pError && throwsEveryCall)
+                    pForced.reset(new ForcedException(m_siteGuards[siteIdx], site.addr, m_pCodeWriter.get()));
+                else
+                    atEntry = true;
+            }
+
+            if (current || pForced)
+                plan.push_back(PlannedPatch{siteIdx, pFnStart, current.get(), std::move(pForced)});
+
+            if (!atEntry && !m_forcedAtEntry[siteIdx])
+                continue;
+
+            auto& change = entryChanges.emplace(pFnStart, EntryChange{0, SiteIndex::npos, SiteIndex::npos, {}}).first->second;
+            change.sites += static_cast<std::ptrdiff_t>(atEntry) - static_cast<std::ptrdiff_t>(m_forcedAtEntry[siteIdx]);
+            if (atEntry && (change.operationIdx == SiteIndex::npos || siteOperations[i].second > change.operationIdx))
+            {
+                change.operationIdx = siteOperations[i].second;
+                change.siteIdx = siteIdx;
+            }
+
+            sitesAtEntry.emplace_back(siteIdx, atEntry);
+        }
+
+        // A guard disarmed in the same batch isn't what the function had
+        // there either
+        for (auto const& planned : plan)
+        {
+            auto change = entryChanges.find(planned.pFnStart);
+            if (planned.pCurrent && change != entryChanges.end())
+                change->second.replacing.push_back(planned.pCurrent);
+        }
+
+        for (auto& entryChange : entryChanges)
+        {
+            auto pFnStart = entryChange.first;
+            auto& change = entryChange.second;
+            auto entry = m_entryPatches.find(pFnStart);
+            auto pCurrent = (entry != m_entryPatches.end()) ? entry->second.pForcedException.get() : nullptr;
+
+            // Other sites may still be forced through the entry
+            if (change.operationIdx == SiteIndex::npos)
+            {
+                auto sites = (entry != m_entryPatches.end()) ? entry->second.sites : 0;
+                if (pCurrent && sites + change.sites == 0)
+                    plan.push_back(PlannedPatch{SiteIndex::npos, pFnStart, pCurrent, nullptr});
+                continue;
+            }
+
+            // Sites are in registry order
+            auto const& operation = operations[change.operationIdx];
+            auto const& throwInfo = s_throwInfos[change.siteIdx];
+            auto const& site = siteIndex.Sites()[change.siteIdx];
+
+            // Calls that are only held up never need the exception
+            std::exception_ptr errorToThrow;
+            if (operation.throws)
+            {
+                if (!throwInfo.GetException && !operation.pError)
+                    throw std::runtime_error("Exception input is not constant");
+
+                errorToThrow = (operation.pError) ? operation.pError : throwInfo.GetException();
+            }
+
+            if (pCurrent)
+                change.replacing.push_back(pCurrent);
+
+            bool padded = std::binary_search(m_paddedEntries.begin(), m_paddedEntries.end(), pFnStart);
+
+            plan.push_back(PlannedPatch{SiteIndex::npos, pFnStart, pCurrent, std::unique_ptr<ForcedException>(
+                new ForcedException(site.parentFn.start, site.parentFn.end, padded, errorToThrow, operation.condition,
+                    m_pCodeWriter.get(), change.replacing))});
+        }
+
+        // Sites are sorted by registry position, write in address order
+        // instead. A site's own patch goes before its function's entry patch
+        std::stable_sort(plan.begin(), plan.end(), [] (PlannedPatch const& a, PlannedPatch const& b) {
+            return a.pFnStart < b.pFnStart;
+        });
+
+        // A replacement usually covers the same bytes as the patch it
+        // replaces and only needs arming, otherwise the old patch has to go
+        // first
+        std::vector<CodePatch> patches;
+        patches.reserve(plan.size());
+        for (auto const& planned : plan)
+        {
+            if (planned.pCurrent && (!planned.pForcedException || !planned.pForcedException->Overwrites(*planned.pCurrent)))
+                planned.pCurrent->AppendDisarmPatches(patches);
+
+            if (planned.pForcedException)
+                planned.pForcedException->AppendArmPatches(patches);
+        }
+
+        try
+        {
+            Write(patches);
+        }
+        catch (PartialWriteError const&)
+        {
+            // Something may already branch to the new patches' stubs, leak
+            // them rather than let the stubs be reused
+            for (auto& planned : plan)
+                planned.pForcedException.release();
+            throw;
+        }
+
+        for (auto& planned : plan)
+        {
+            if (planned.pCurrent)
+                planned.pCurrent->SetArmed(false);
+
+            if (planned.pForcedException)
+                planned.pForcedException->SetArmed(true);
+
+            auto& current = (planned.siteIdx != SiteIndex::npos)
+                ? m_forcedExceptions[planned.siteIdx]
+                : m_entryPatches[planned.pFnStart].pForcedException;
+            std::swap(current, planned.pForcedException);
+            RetiredPatches::Get().Retire(std::move(planned.pForcedException));
+        }
+
+        for (auto const& siteAtEntry : sitesAtEntry)
+            m_forcedAtEntry[siteAtEntry.first] = siteAtEntry.second;
+
+        for (auto const& entryChange : entryChanges)
+        {
+            auto& entry = m_entryPatches[entryChange.first];
+            entry.sites = static_cast<size_t>(static_cast<std::ptrdiff_t>(entry.sites) + entryChange.second.sites);
+            if (entry.sites == 0 && !entry.pForcedException)
+                m_entryPatches.erase(entryChange.first);
+        }
     }
 
-    void ExceptionForcer::Impl::UnforceException(void* loc)
+    ThrowCondition ExceptionForcer::Impl::CalledFrom(std::vector<std::string> const& functionNames, unsigned depth, ThrowCondition condition)
     {
-        auto forcedIt = m_forcedExceptions.find(loc);
-        if (forcedIt != m_forcedExceptions.end())
-            m_forcedExceptions.erase(loc);
+        if (depth == 0)
+            throw std::invalid_argument("Depth must be non zero");
+
+        std::vector<CallerFilter::Range_t> ranges;
+        for (auto const& name : functionNames)
+        {
+            for (auto const& function : m_elf.GetFunctionsNamed(name.c_str()))
+            {
+                ranges.push_back(CallerFilter::Range_t{
+                    reinterpret_cast<uintptr_t>(m_offsetResolver.FromOffset(function.startOffset)),
+                    reinterpret_cast<uintptr_t>(m_offsetResolver.FromOffset(function.endOffset)),
+                });
+            }
+        }
+
+        if (ranges.empty())
+            throw std::runtime_error("Could not find function");
+
+        auto pFilter = std::make_shared<CallerFilter>(std::move(ranges), depth);
+        return [pFilter, condition] {
+            if (!pFilter->Matches(CurrentDetourFrame()))
+                return false;
+
+            return !condition || condition();
+        };
+    }
+
+    ExceptionForcer::Impl::Impl()
+    {
+        auto& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.impls.push_back(this);
+    }
+
+    ExceptionForcer::Impl::~Impl()
+    {
+        {
+            auto& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.impls.erase(std::find(registry.impls.begin(), registry.impls.end(), this));
+        }
+
+        try
+        {
+            UnforceAll();
+        }
+        catch (std::exception const&)
+        {
+            // Leave anything still armed to its own destructor
+        }
+    }
+
+    ExceptionForcer::Impl::Registry& ExceptionForcer::Impl::GetRegistry()
+    {
+        static Registry s_registry;
+        return s_registry;
+    }
+
+    void ExceptionForcer::Impl::AppendUnforceAllPatches(std::vector<CodePatch>& patches) const
+    {
+        for (auto const& pForced : m_forcedExceptions)
+        {
+            if (pForced && pForced->IsArmed())
+                pForced->AppendDisarmPatches(patches);
+        }
+
+        for (auto const& entry : m_entryPatches)
+        {
+            auto const& pForced = entry.second.pForcedException;
+            if (pForced && pForced->IsArmed())
+                pForced->AppendDisarmPatches(patches);
+        }
+    }
+
+    void ExceptionForcer::Impl::FinishUnforceAll()
+    {
+        // A thread may still be in a detour we just disarmed
+        for (auto& pForced : m_forcedExceptions)
+        {
+            if (!pForced)
+                continue;
+
+            pForced->SetArmed(false);
+            RetiredPatches::Get().Retire(std::move(pForced));
+        }
+
+        for (auto& entry : m_entryPatches)
+        {
+            auto& pForced = entry.second.pForcedException;
+            if (!pForced)
+                continue;
+
+            pForced->SetArmed(false);
+            RetiredPatches::Get().Retire(std::move(pForced));
+        }
+
+        m_entryPatches.clear();
+        std::fill(m_forcedAtEntry.begin(), m_forcedAtEntry.end(), false);
+    }
+
+    void ExceptionForcer::Impl::UnforceAll()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Disarm everything in one write rather than one per site
+        std::vector<CodePatch> patches;
+        AppendUnforceAllPatches(patches);
+        Write(patches);
+        FinishUnforceAll();
+    }
+
+    void ExceptionForcer::Impl::UnforceAllInProcess()
+    {
+        auto& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (registry.impls.empty())
+            return;
+
+        std::vector<std::unique_lock<std::mutex>> implLocks;
+        for (auto pImpl : registry.impls)
+            implLocks.emplace_back(pImpl->m_mutex);
+
+        // Any of the writers can write every forcer's patches. A forcer's
+        // original code may be an older forcer's jump, so newest first
+        std::vector<CodePatch> patches;
+        for (auto it = registry.impls.rbegin(); it != registry.impls.rend(); ++it)
+            (*it)->AppendUnforceAllPatches(patches);
+
+        registry.impls.front()->Write(patches);
+
+        for (auto pImpl : registry.impls)
+            pImpl->FinishUnforceAll();
     }
 
     ExceptionForcer::ExceptionForcer()
@@ -306,6 +1531,31 @@ namespace
         return m_pImpl->GetExceptions();
     }
 
+    void ExceptionForcer::VisitExceptions(ExceptionVisitor visitor)
+    {
+        m_pImpl->VisitExceptions(visitor);
+    }
+
+    void ExceptionForcer::VisitExceptionsInFile(char const* file, ExceptionVisitor visitor)
+    {
+        m_pImpl->VisitExceptionsInFile(file, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), visitor);
+    }
+
+    void ExceptionForcer::VisitExceptionsInFile(char const* file, int firstLine, int lastLine, ExceptionVisitor visitor)
+    {
+        m_pImpl->VisitExceptionsInFile(file, firstLine, lastLine, visitor);
+    }
+
+    void ExceptionForcer::VisitExceptionsInFunction(char const* name, ExceptionVisitor visitor)
+    {
+        m_pImpl->VisitExceptionsInFunction(name, visitor);
+    }
+
+    void ExceptionForcer::VisitExceptionsOfType(char const* type, ExceptionVisitor visitor)
+    {
+        m_pImpl->VisitExceptionsOfType(type, visitor);
+    }
+
     void ExceptionForcer::ForceException(void* loc)
     {
         m_pImpl->ForceException(loc);
@@ -316,8 +1566,53 @@ namespace
         m_pImpl->ForceException(loc, pError);
     }
 
+    void ExceptionForcer::ForceException(void* loc, double probability)
+    {
+        m_pImpl->ForceExceptionIf(loc, std::exception_ptr(), WithProbability(probability));
+    }
+
+    void ExceptionForcer::ForceExceptionIf(void* loc, ThrowCondition condition)
+    {
+        m_pImpl->ForceExceptionIf(loc, std::exception_ptr(), std::move(condition));
+    }
+
+    void ExceptionForcer::ForceExceptionIf(void* loc, std::exception_ptr pError, ThrowCondition condition)
+    {
+        m_pImpl->ForceExceptionIf(loc, std::move(pError), std::move(condition));
+    }
+
+    void ExceptionForcer::InjectLatency(void* loc, Latency latency, ThrowCondition condition)
+    {
+        m_pImpl->InjectLatency(loc, std::move(latency), std::move(condition));
+    }
+
     void ExceptionForcer::UnforceException(void* loc)
     {
         m_pImpl->UnforceException(loc);
     }
+
+    void ExceptionForcer::ForceException(void* loc, std::chrono::steady_clock::time_point deadline)
+    {
+        m_pImpl->ForceExceptionIf(loc, std::exception_ptr(), Until(deadline));
+    }
+
+    void ExceptionForcer::UnforceAll()
+    {
+        m_pImpl->UnforceAll();
+    }
+
+    void ExceptionForcer::UnforceAllInProcess()
+    {
+        Impl::UnforceAllInProcess();
+    }
+
+    void ExceptionForcer::Apply(ForceBatch const& batch)
+    {
+        m_pImpl->Apply(batch);
+    }
+
+    ThrowCondition ExceptionForcer::CalledFrom(std::vector<std::string> const& functionNames, unsigned depth, ThrowCondition condition)
+    {
+        return m_pImpl->CalledFrom(functionNames, depth, std::move(condition));
+    }
 } // namespace eforce
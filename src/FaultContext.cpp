@@ -0,0 +1,51 @@
+#include <eforce/FaultContext.h>
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+namespace eforce
+{
+namespace
+{
+    /// Id of the calling thread's current FaultContext, 0 for none
+    thread_local uint64_t s_currentContext = 0;
+
+    std::atomic<uint64_t> s_nextContext{1};
+} // namespace
+
+    FaultContext FaultContext::New()
+    {
+        return FaultContext(s_nextContext.fetch_add(1, std::memory_order_relaxed));
+    }
+
+    FaultContext FaultContext::Current()
+    {
+        return FaultContext(s_currentContext);
+    }
+
+    FaultContextScope::FaultContextScope(FaultContext context)
+        : m_previous(FaultContext::Current())
+    {
+        s_currentContext = context.m_id;
+    }
+
+    FaultContextScope::~FaultContextScope()
+    {
+        s_currentContext = m_previous.m_id;
+    }
+
+    ThrowCondition InFaultContext(FaultContext context, ThrowCondition condition)
+    {
+        auto id = context.m_id;
+        if (!id)
+            return [] { return false; };
+
+        return [id, condition] {
+            if (s_currentContext != id)
+                return false;
+
+            return !condition || condition();
+        };
+    }
+} // namespace eforce
@@ -0,0 +1,318 @@
+#include <priv/FunctionIndex.h>
+#include <priv/Util.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cxxabi.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    constexpr char k_magic[8] = {'E', 'F', 'I', 'D', 'X', 0, 0, 0};
+    constexpr uint32_t k_version = 1;
+    constexpr size_t k_maxBuildIdSize = 64;
+    /// Total size of the indexes we keep in the cache directory. The least
+    /// recently used ones are removed past this, except the one just written
+    constexpr uint64_t k_maxCacheSize = uint64_t(128) << 20;
+
+    /// Layout of the start of an index file. Function records follow the
+    /// header directly, and the name table follows the records
+    struct IndexHeader_t
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t buildIdSize;
+        char buildId[k_maxBuildIdSize];
+        uint64_t functionCount;
+        uint64_t namesSize;
+    };
+
+    /**
+     * @brief Figures out where index files should live
+     * @return The cache directory, or an empty string if caching is disabled
+     */
+    std::string GetCacheDir()
+    {
+        if (char const* dir = getenv("EFORCE_INDEX_CACHE_DIR"))
+            return dir;
+
+        if (char const* dir = getenv("XDG_CACHE_HOME"))
+        {
+            if (*dir)
+                return std::string(dir) + "/eforce";
+        }
+
+        if (char const* dir = getenv("HOME"))
+        {
+            if (*dir)
+                return std::string(dir) + "/.cache/eforce";
+        }
+
+        return {};
+    }
+
+    /**
+     * @brief mkdir -p
+     */
+    bool MakeDirs(std::string const& path)
+    {
+        for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+        {
+            auto component = path.substr(0, pos);
+            if (mkdir(component.c_str(), 0755) < 0 && errno != EEXIST)
+                return false;
+
+            if (pos == std::string::npos)
+                return true;
+        }
+    }
+
+    /**
+     * @brief Writes all of data to fd
+     */
+    bool WriteAll(int fd, void const* data, size_t size)
+    {
+        auto pData = static_cast<char const*>(data);
+        while (size)
+        {
+            auto written = write(fd, pData, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return false;
+
+            pData += written;
+            size -= static_cast<size_t>(written);
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Removes the least recently used indexes in dir until the ones
+     *  left fit in k_maxCacheSize. Loading an index touches it, so its
+     *  mtime is when it was last used
+     * @param[in] keep path of an index to keep whatever its size
+     */
+    void PruneCacheDir(std::string const& dir, std::string const& keep)
+    {
+        struct CachedIndex
+        {
+            std::string path;
+            uint64_t size;
+            timespec mtime;
+        };
+
+        DIR* pDir = opendir(dir.c_str());
+        if (!pDir)
+            return;
+
+        std::vector<CachedIndex> indexes;
+        while (dirent* pEntry = readdir(pDir))
+        {
+            std::string name = pEntry->d_name;
+            if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".idx") != 0)
+                continue;
+
+            struct stat st{};
+            auto path = dir + "/" + name;
+            if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                indexes.push_back(CachedIndex{path, static_cast<uint64_t>(st.st_size), st.st_mtim});
+        }
+        closedir(pDir);
+
+        std::sort(indexes.begin(), indexes.end(), [] (CachedIndex const& a, CachedIndex const& b) {
+            if (a.mtime.tv_sec != b.mtime.tv_sec)
+                return a.mtime.tv_sec > b.mtime.tv_sec;
+            return a.mtime.tv_nsec > b.mtime.tv_nsec;
+        });
+
+        uint64_t total = 0;
+        for (auto const& index : indexes)
+        {
+            if (index.path == keep)
+                continue;
+
+            total += index.size;
+            if (total > k_maxCacheSize)
+                unlink(index.path.c_str());
+        }
+    }
+} // namespace
+
+    FunctionIndexCache::FunctionIndexCache(std::string const& buildId)
+        : m_buildId(buildId)
+    {
+        auto dir = GetCacheDir();
+        if (!dir.empty() && !m_buildId.empty() && m_buildId.size() <= k_maxBuildIdSize)
+            m_path = dir + "/" + m_buildId + ".idx";
+    }
+
+    FunctionIndexCache::~FunctionIndexCache()
+    {
+        Unmap();
+    }
+
+    void FunctionIndexCache::Unmap()
+    {
+        if (m_mapping)
+            munmap(m_mapping, m_mappingSize);
+
+        m_mapping = nullptr;
+        m_mappingSize = 0;
+    }
+
+    bool FunctionIndexCache::Load()
+    {
+        Unmap();
+
+        if (m_path.empty())
+            return false;
+
+        int fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(IndexHeader_t)))
+        {
+            close(fd);
+            return false;
+        }
+
+        auto mappingSize = static_cast<size_t>(st.st_size);
+        auto mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+
+        // Mark the index as used so pruning keeps it over unused ones.
+        // Indexes written by another user can't be touched, which is fine
+        futimens(fd, nullptr);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+            return false;
+
+        m_mapping = mapping;
+        m_mappingSize = mappingSize;
+
+        // Anything that doesn't look exactly like what we would have written
+        // is treated as a miss, it'll get rewritten by the caller
+        auto header = static_cast<IndexHeader_t const*>(m_mapping);
+        auto maxFunctions = (m_mappingSize - sizeof(IndexHeader_t)) / sizeof(FunctionRecord_t);
+        bool valid = std::memcmp(header->magic, k_magic, sizeof(k_magic)) == 0
+            && header->version == k_version
+            && header->buildIdSize == m_buildId.size()
+            && std::memcmp(header->buildId, m_buildId.data(), m_buildId.size()) == 0
+            && header->functionCount <= maxFunctions
+            && header->namesSize == m_mappingSize - sizeof(IndexHeader_t) - header->functionCount * sizeof(FunctionRecord_t)
+            && header->namesSize > 0
+            && Names()[header->namesSize - 1] == '\0';
+
+        if (!valid)
+        {
+            Unmap();
+            return false;
+        }
+
+        for (size_t i = 0; i < FunctionCount(); ++i)
+        {
+            if (Functions()[i].name >= header->namesSize)
+            {
+                Unmap();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool FunctionIndexCache::Store(std::vector<FunctionRecord_t> const& functions, char const* mangledNames)
+    {
+        if (m_path.empty())
+            return false;
+
+        auto slash = m_path.rfind('/');
+        if (slash != std::string::npos && slash != 0 && !MakeDirs(m_path.substr(0, slash)))
+            return false;
+
+        // Demangle every name once and intern them, overloads and template
+        // instantiations tend to share a lot of names
+        std::vector<FunctionRecord_t> records(functions);
+        std::string names(1, '\0');
+        std::unordered_map<std::string, uint32_t> internedNames;
+        for (auto& record : records)
+        {
+            char const* mangledName = mangledNames + record.name;
+            std::unique_ptr<char, MallocDeleter<char>> demangledName(abi::__cxa_demangle(mangledName, nullptr, nullptr, nullptr));
+            std::string name = demangledName ? demangledName.get() : mangledName;
+
+            auto inserted = internedNames.emplace(std::move(name), static_cast<uint32_t>(names.size()));
+            if (inserted.second)
+            {
+                names.append(inserted.first->first);
+                names.push_back('\0');
+            }
+
+            record.name = inserted.first->second;
+        }
+
+        IndexHeader_t header{};
+        std::memcpy(header.magic, k_magic, sizeof(k_magic));
+        header.version = k_version;
+        header.buildIdSize = static_cast<uint32_t>(m_buildId.size());
+        std::memcpy(header.buildId, m_buildId.data(), m_buildId.size());
+        header.functionCount = records.size();
+        header.namesSize = names.size();
+
+        // Write to a private file first and rename it into place so that
+        // concurrent readers only ever see complete indexes
+        auto tmpPath = m_path + "." + std::to_string(getpid()) + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        bool written = WriteAll(fd, &header, sizeof(header))
+            && WriteAll(fd, records.data(), records.size() * sizeof(FunctionRecord_t))
+            && WriteAll(fd, names.data(), names.size());
+        close(fd);
+
+        if (!written || rename(tmpPath.c_str(), m_path.c_str()) < 0)
+        {
+            unlink(tmpPath.c_str());
+            return false;
+        }
+
+        if (slash != std::string::npos)
+            PruneCacheDir(m_path.substr(0, slash), m_path);
+
+        return Load();
+    }
+
+    FunctionRecord_t const* FunctionIndexCache::Functions() const
+    {
+        return reinterpret_cast<FunctionRecord_t const*>(static_cast<char const*>(m_mapping) + sizeof(IndexHeader_t));
+    }
+
+    size_t FunctionIndexCache::FunctionCount() const
+    {
+        return m_mapping ? static_cast<IndexHeader_t const*>(m_mapping)->functionCount : 0;
+    }
+
+    char const* FunctionIndexCache::Names() const
+    {
+        return reinterpret_cast<char const*>(Functions() + static_cast<IndexHeader_t const*>(m_mapping)->functionCount);
+    }
+} // namespace eforce
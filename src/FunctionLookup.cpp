@@ -0,0 +1,157 @@
+#include <priv/FunctionLookup.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+namespace eforce
+{
+namespace
+{
+    constexpr size_t k_blockSize = 16;
+
+    using CountFn_t = size_t(*)(uint32_t const* block, uint32_t key);
+
+    /**
+     * @return Number of keys in block that are <= key
+     */
+    size_t CountLessEqualScalar(uint32_t const* block, uint32_t key)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < k_blockSize; ++i)
+            count += block[i] <= key;
+        return count;
+    }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    __attribute__((target("avx2")))
+    size_t CountLessEqualAvx2(uint32_t const* block, uint32_t key)
+    {
+        // There is no unsigned compare, but max(a, key) == key iff a <= key
+        auto keys = _mm256_set1_epi32(static_cast<int>(key));
+        auto low = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(block));
+        auto high = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(block + 8));
+        auto lowLe = _mm256_cmpeq_epi32(_mm256_max_epu32(low, keys), keys);
+        auto highLe = _mm256_cmpeq_epi32(_mm256_max_epu32(high, keys), keys);
+        auto mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(lowLe)))
+            | (static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(highLe))) << 8);
+        return static_cast<size_t>(__builtin_popcount(mask));
+    }
+
+    CountFn_t GetCountFn()
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &CountLessEqualAvx2 : &CountLessEqualScalar;
+    }
+#elif defined(__GNUC__) && defined(__aarch64__)
+    size_t CountLessEqualNeon(uint32_t const* block, uint32_t key)
+    {
+        // Each matching lane is all ones, so subtracting the masks counts them
+        auto keys = vdupq_n_u32(key);
+        auto count = vdupq_n_u32(0);
+        for (size_t i = 0; i < k_blockSize; i += 4)
+            count = vsubq_u32(count, vcleq_u32(vld1q_u32(block + i), keys));
+        return vaddvq_u32(count);
+    }
+
+    CountFn_t GetCountFn()
+    {
+        return &CountLessEqualNeon;
+    }
+#else
+    CountFn_t GetCountFn()
+    {
+        return &CountLessEqualScalar;
+    }
+#endif
+} // namespace
+
+    constexpr size_t FunctionLookupTable::npos;
+
+    bool FunctionLookupTable::Build(FunctionRecord_t const* functions, size_t count)
+    {
+        m_count = 0;
+        m_blockCount = 0;
+        m_blockKeys.clear();
+        m_blockRanks.clear();
+        m_keys.clear();
+
+        if (count == 0)
+            return true;
+
+        m_base = functions[0].start;
+        if (functions[count - 1].start - m_base > std::numeric_limits<uint32_t>::max()
+            || count > std::numeric_limits<uint32_t>::max())
+            return false;
+
+        m_count = count;
+        m_countLessEqual = GetCountFn();
+        m_blockCount = (count + k_blockSize - 1) / k_blockSize;
+
+        m_keys.resize(m_blockCount * k_blockSize, std::numeric_limits<uint32_t>::max());
+        for (size_t i = 0; i < count; ++i)
+            m_keys[i] = static_cast<uint32_t>(functions[i].start - m_base);
+
+        m_blockKeys.resize(m_blockCount + 1);
+        m_blockRanks.resize(m_blockCount + 1);
+        FillEytzinger(0, 1);
+
+        return true;
+    }
+
+    size_t FunctionLookupTable::FillEytzinger(size_t sortedIdx, size_t eytzingerIdx)
+    {
+        // In order traversal of the implicit tree hands out sorted blocks in order
+        if (eytzingerIdx <= m_blockCount)
+        {
+            sortedIdx = FillEytzinger(sortedIdx, 2 * eytzingerIdx);
+            m_blockKeys[eytzingerIdx] = m_keys[sortedIdx * k_blockSize];
+            m_blockRanks[eytzingerIdx] = static_cast<uint32_t>(sortedIdx);
+            sortedIdx = FillEytzinger(sortedIdx + 1, 2 * eytzingerIdx + 1);
+        }
+
+        return sortedIdx;
+    }
+
+    size_t FunctionLookupTable::Find(uint64_t offset) const
+    {
+        if (m_count == 0 || offset < m_base)
+            return npos;
+
+        auto relative = offset - m_base;
+        auto key = relative > std::numeric_limits<uint32_t>::max()
+            ? std::numeric_limits<uint32_t>::max()
+            : static_cast<uint32_t>(relative);
+
+        // Branchless descent, the grandchildren 4 levels down share a cache
+        // line so we prefetch them while we compare
+        auto blockKeys = m_blockKeys.data();
+        size_t k = 1;
+        while (k <= m_blockCount)
+        {
+            if (16 * k <= m_blockCount)
+                __builtin_prefetch(blockKeys + 16 * k);
+            k = 2 * k + (blockKeys[k] <= key);
+        }
+
+        // Undo the right turns we took after the last left turn, what's left
+        // is the first block starting after key, or 0 if there isn't one
+        k >>= __builtin_ffsll(static_cast<long long>(~k));
+        size_t upperBlock = k ? m_blockRanks[k] : m_blockCount;
+        if (upperBlock == 0)
+            return npos;
+
+        auto block = upperBlock - 1;
+        auto blockStart = block * k_blockSize;
+        auto matches = std::min(m_countLessEqual(&m_keys[blockStart], key), m_count - blockStart);
+
+        return blockStart + matches - 1;
+    }
+} // namespace eforce
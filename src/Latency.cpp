@@ -0,0 +1,160 @@
+#include <eforce/Latency.h>
+
+#include <priv/Random.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    /**
+     * @brief Reads the cpu's cycle counter, or the steady clock in ns where
+     *  there isn't one we can read from user space
+     */
+    uint64_t ReadTicks()
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+    #elif defined(__aarch64__)
+        // The isb keeps the read from being hoisted above earlier
+        // instructions
+        uint64_t ticks;
+        __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+        return ticks;
+    #else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    #endif
+    }
+
+    void CpuRelax()
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+    #elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+    #endif
+    }
+
+    /**
+     * @brief Gets how many ReadTicks ticks pass in a microsecond, worked out
+     *  once per process
+     */
+    double TicksPerMicrosecond()
+    {
+        static std::once_flag s_once;
+        static double s_ticksPerUs = 1000.0;
+        std::call_once(s_once, [] {
+        #if defined(__x86_64__) || defined(__i386__)
+            // The TSC runs at a constant rate on anything recent, but
+            // nothing tells us what it is. Time it against the steady clock
+            auto start = std::chrono::steady_clock::now();
+            auto startTicks = ReadTicks();
+            while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10))
+                CpuRelax();
+
+            auto ticks = ReadTicks() - startTicks;
+            auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            s_ticksPerUs = ticks / us;
+        #elif defined(__aarch64__)
+            uint64_t frequency;
+            __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+            s_ticksPerUs = frequency / 1e6;
+        #endif
+        });
+
+        return s_ticksPerUs;
+    }
+
+    /**
+     * @brief Draws delays from a Latency's histogram and waits them out
+     */
+    class DelaySampler
+    {
+    public:
+        explicit DelaySampler(Latency const& latency)
+            : m_wait(latency.GetWait())
+        {
+            auto const& histogram = latency.GetHistogram();
+            if (histogram.empty())
+                throw std::invalid_argument("Latency histogram is empty");
+
+            double total = 0;
+            for (auto const& bucket : histogram)
+            {
+                if (bucket.first.count() < 0 || !(bucket.second > 0))
+                    throw std::invalid_argument("Invalid latency histogram bucket");
+
+                total += bucket.second;
+            }
+
+            auto ticksPerUs = TicksPerMicrosecond();
+            double cumulative = 0;
+            for (auto const& bucket : histogram)
+            {
+                cumulative += bucket.second;
+                auto fraction = cumulative / total;
+                m_thresholds.push_back(fraction < 1.0 ? ProbabilityThreshold(fraction) : std::numeric_limits<uint64_t>::max());
+                m_delays.push_back(bucket.first);
+                m_ticks.push_back(static_cast<uint64_t>(bucket.first.count() * ticksPerUs));
+            }
+
+            // Every draw lands somewhere, whatever rounding did to the sum
+            m_thresholds.back() = std::numeric_limits<uint64_t>::max();
+        }
+
+        void Delay() const
+        {
+            size_t bucket = 0;
+            if (m_thresholds.size() > 1)
+            {
+                auto draw = NextRandom();
+                while (bucket + 1 < m_thresholds.size() && draw >= m_thresholds[bucket])
+                    ++bucket;
+            }
+
+            if (m_wait == Latency::Wait::Sleep)
+            {
+                std::this_thread::sleep_for(m_delays[bucket]);
+                return;
+            }
+
+            auto end = ReadTicks() + m_ticks[bucket];
+            while (ReadTicks() < end)
+                CpuRelax();
+        }
+
+    private:
+        Latency::Wait m_wait;
+        /// A draw below m_thresholds[i] and not below m_thresholds[i - 1]
+        /// picks bucket i
+        std::vector<uint64_t> m_thresholds;
+        std::vector<std::chrono::microseconds> m_delays;
+        /// m_delays in ReadTicks ticks
+        std::vector<uint64_t> m_ticks;
+    };
+} // namespace
+
+    ThrowCondition DelayCalls(Latency latency, ThrowCondition condition)
+    {
+        auto pSampler = std::make_shared<DelaySampler>(latency);
+        return [pSampler, condition] {
+            if (!condition || condition())
+                pSampler->Delay();
+
+            return false;
+        };
+    }
+} // namespace eforce
@@ -0,0 +1,57 @@
+#include <priv/NameArena.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace eforce
+{
+namespace
+{
+    constexpr size_t k_blockSize = 64 * 1024;
+} // namespace
+
+    size_t NameArena::Hash::operator()(char const* str) const
+    {
+        // FNV-1a
+        uint64_t hash = 0xcbf29ce484222325;
+        for (; *str; ++str)
+        {
+            hash ^= static_cast<uint8_t>(*str);
+            hash *= 0x100000001b3;
+        }
+
+        return static_cast<size_t>(hash);
+    }
+
+    char const* NameArena::Intern(char const* name)
+    {
+        auto existing = m_interned.find(name);
+        if (existing != m_interned.end())
+            return *existing;
+
+        auto size = std::strlen(name) + 1;
+        auto copy = Allocate(size);
+        std::memcpy(copy, name, size);
+        m_interned.insert(copy);
+        return copy;
+    }
+
+    char* NameArena::Allocate(size_t size)
+    {
+        if (size > m_remaining)
+        {
+            // Oversized names get a block of their own
+            auto blockSize = std::max(size, k_blockSize);
+            m_blocks.emplace_back(new char[blockSize]);
+            m_current = m_blocks.back().get();
+            m_remaining = blockSize;
+        }
+
+        auto ret = m_current;
+        m_current += size;
+        m_remaining -= size;
+        return ret;
+    }
+} // namespace eforce
@@ -1,9 +1,15 @@
 #include <priv/OpcodeGeneratorAarch64.h>
+#include <priv/Relocator.h>
 
+#include <eforce/Patchable.h>
+
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
+#include <utility>
 
 namespace eforce
 {
@@ -22,6 +28,66 @@ namespace
         0x00, 0x00, 0xe0, 0xf2, // Populate register 0 with high 16 bits (movn)
         0x00, 0x00, 0x00, 0x14, // Branch to address (b)
     }};
+
+    /// k_doThrow for when the throw function is out of range of B. Branches
+    /// through x16, which the calling convention leaves free for veneers
+    /// like this one
+    constexpr std::array<uint8_t, 32> k_doThrowFar{{
+        0x00, 0x00, 0x80, 0xd2, // movz x0
+        0x00, 0x00, 0xa0, 0xf2, // movk x0, lsl 16
+        0x00, 0x00, 0xc0, 0xf2, // movk x0, lsl 32
+        0x00, 0x00, 0xe0, 0xf2, // movk x0, lsl 48
+        0x50, 0x00, 0x00, 0x58, // ldr x16, #8
+        0x00, 0x02, 0x1f, 0xd6, // br x16
+        0x00, 0x00, 0x00, 0x00, // Address to branch to
+        0x00, 0x00, 0x00, 0x00,
+    }};
+
+    /// B reaches 128MB either way, leave room for the stub itself
+    constexpr std::ptrdiff_t k_branchRange = 128 * 1024 * 1024;
+    constexpr size_t k_stubRange = k_branchRange - 64 * 1024;
+
+    /// Detour stub frame, fp and lr then x0-x8 and q0-q7. Keeps sp 16 byte
+    /// aligned
+    constexpr size_t k_detourFrameSize = 224;
+    constexpr size_t k_detourXOffset = 16;
+    constexpr size_t k_detourX8Offset = 80;
+    constexpr size_t k_detourQOffset = 96;
+
+    constexpr uint32_t k_stpFrame = 0xa9b27bfd;     // stp x29, x30, [sp, #-224]!
+    constexpr uint32_t k_ldpFrame = 0xa8ce7bfd;     // ldp x29, x30, [sp], #224
+    constexpr uint32_t k_movFp = 0x910003fd;        // mov x29, sp
+    constexpr uint32_t k_movX1Fp = 0xaa1d03e1;      // mov x1, x29
+    constexpr uint32_t k_stpX = 0xa9000000;         // stp xt1, xt2, [sp, #imm]
+    constexpr uint32_t k_ldpX = 0xa9400000;         // ldp xt1, xt2, [sp, #imm]
+    constexpr uint32_t k_stpQ = 0xad000000;         // stp qt1, qt2, [sp, #imm]
+    constexpr uint32_t k_ldpQ = 0xad400000;         // ldp qt1, qt2, [sp, #imm]
+    constexpr uint32_t k_strX8 = 0xf9000000 | ((k_detourX8Offset / 8) << 10) | (31 << 5) | 8;
+    constexpr uint32_t k_ldrX8 = 0xf9400000 | ((k_detourX8Offset / 8) << 10) | (31 << 5) | 8;
+    constexpr uint32_t k_ldrLiteral = 0x58000000;   // ldr xt, #imm19
+    constexpr uint32_t k_blrX16 = 0xd63f0200;       // blr x16
+    constexpr uint32_t k_brX16 = 0xd61f0200;        // br x16
+    constexpr uint32_t k_cbnzX0 = 0xb5000000;       // cbnz x0, #imm19
+    constexpr uint32_t k_nop = 0xd503201f;
+
+    /**
+     * @brief Gets a pair load or store of rt and rt + 1 at sp + offset
+     * @param[in] scale size of each register
+     */
+    uint32_t PairAtSp(uint32_t insn, uint32_t rt, size_t offset, size_t scale)
+    {
+        return insn | ((static_cast<uint32_t>(offset / scale) & 0x7f) << 15) | ((rt + 1) << 10) | (31 << 5) | rt;
+    }
+
+    void Append(std::vector<uint8_t>& code, uint32_t insn)
+    {
+        uint8_t bytes[sizeof(insn)];
+        std::memcpy(bytes, &insn, sizeof(insn));
+        code.insert(code.end(), bytes, bytes + sizeof(bytes));
+    }
+
+    /// nop, which is also what the compiler pads patchable entries with
+    constexpr std::array<uint8_t, 4> k_entryNop{{ 0x1f, 0x20, 0x03, 0xd5 }};
     
     /**
      * @brief Populates a mov instruction with a 16 bit immediate value
@@ -42,9 +108,9 @@ namespace
      */
     void PopulateJumpAddr(std::ptrdiff_t relJumpAddr, uint8_t* pJmpInsn)
     {
-        if ((relJumpAddr >> 28) != 0)
+        if (relJumpAddr < -k_branchRange || relJumpAddr >= k_branchRange)
             throw std::runtime_error("Throw helper too far from target function");
-        
+
         relJumpAddr = relJumpAddr & ((1 << 28) - 1);
         pJmpInsn[0] = (relJumpAddr >> 2) & 0xff;
         pJmpInsn[1] = (relJumpAddr >> 10) & 0xff;
@@ -69,15 +135,153 @@ namespace
         auto midHighQuarter = static_cast<uint16_t>((uint64_t(error) >> 32) & 0xffff);
         auto highQuarter = static_cast<uint16_t>((uint64_t(error) >> 48) & 0xffff);
 
-        std::vector<uint8_t> doThrow(k_doThrow.begin(), k_doThrow.end());
+        auto throwOffset = static_cast<char*>(throwFn) - (static_cast<char*>(fnStart) + 16);
+        bool far = throwOffset < -k_branchRange || throwOffset >= k_branchRange;
+
+        std::vector<uint8_t> doThrow = far
+            ? std::vector<uint8_t>(k_doThrowFar.begin(), k_doThrowFar.end())
+            : std::vector<uint8_t>(k_doThrow.begin(), k_doThrow.end());
 
         PopulateQuarterWord(lowQuarter, &doThrow[0]);
         PopulateQuarterWord(midLowQuarter, &doThrow[4]);
         PopulateQuarterWord(midHighQuarter, &doThrow[8]);
         PopulateQuarterWord(highQuarter, &doThrow[12]);
 
-        PopulateJumpAddr(static_cast<char*>(throwFn) - (static_cast<char*>(fnStart) + 16), &doThrow[16]);
+        if (far)
+        {
+            auto throwFnAddr = reinterpret_cast<uint64_t>(throwFn);
+            std::memcpy(&doThrow[24], &throwFnAddr, sizeof(throwFnAddr));
+        }
+        else
+        {
+            PopulateJumpAddr(throwOffset, &doThrow[16]);
+        }
 
         return doThrow;    
     }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetEntryNop()
+    {
+        return std::vector<uint8_t>(k_entryNop.begin(), k_entryNop.end());
+    }
+
+    bool OpcodeGeneratorAarch64::HasEntryPad(uint8_t const* pEntry)
+    {
+        // Every instruction in the pad, including the one at the entry, is a nop
+        auto pPad = pEntry - EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES;
+        for (auto pInsn = pPad; pInsn <= pEntry; pInsn += k_entryNop.size())
+        {
+            if (!std::equal(k_entryNop.begin(), k_entryNop.end(), pInsn))
+                return false;
+        }
+
+        return true;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetEntryJump(void* entry, void* target)
+    {
+        std::vector<uint8_t> jump{0x00, 0x00, 0x00, 0x14};
+        PopulateJumpAddr(static_cast<char*>(target) - static_cast<char*>(entry), jump.data());
+        return jump;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetGuardNop()
+    {
+        // Guards and entries are both a single nop we swap for a branch
+        return GetEntryNop();
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetGuardJump(void* guard, void* target)
+    {
+        return GetEntryJump(guard, target);
+    }
+
+    size_t OpcodeGeneratorAarch64::GetStubRange()
+    {
+        return k_stubRange;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetStubJump(void* fnStart, void* stub)
+    {
+        return GetEntryJump(fnStart, stub);
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorAarch64::GetDetourOpcode(DetourSpec_t const& spec, uint8_t const* code)
+    {
+        std::vector<uint8_t> detour;
+
+        // Loads of each literal, filled in once the literals are placed
+        // after the code
+        std::vector<std::pair<size_t, uint64_t>> literalLoads;
+        auto appendLoad = [&] (uint32_t reg, void* value) {
+            literalLoads.emplace_back(detour.size(), reinterpret_cast<uint64_t>(value));
+            Append(detour, k_ldrLiteral | reg);
+        };
+
+        Append(detour, k_stpFrame);
+        Append(detour, k_movFp);
+        for (uint32_t reg = 0; reg < 8; reg += 2)
+            Append(detour, PairAtSp(k_stpX, reg, k_detourXOffset + reg * 8, 8));
+        Append(detour, k_strX8);
+        for (uint32_t reg = 0; reg < 8; reg += 2)
+            Append(detour, PairAtSp(k_stpQ, reg, k_detourQOffset + reg * 16, 16));
+
+        // x29 points at our frame record, whose return address is in the
+        // function's caller
+        appendLoad(0, spec.decideArg);
+        Append(detour, k_movX1Fp);
+        appendLoad(16, spec.decideFn);
+        Append(detour, k_blrX16);
+        auto throwBranch = detour.size();
+        Append(detour, k_cbnzX0);
+
+        for (uint32_t reg = 0; reg < 8; reg += 2)
+            Append(detour, PairAtSp(k_ldpQ, reg, k_detourQOffset + reg * 16, 16));
+        Append(detour, k_ldrX8);
+        for (uint32_t reg = 0; reg < 8; reg += 2)
+            Append(detour, PairAtSp(k_ldpX, reg, k_detourXOffset + reg * 8, 8));
+        Append(detour, k_ldpFrame);
+
+        auto stub = static_cast<char*>(spec.stub);
+        size_t displaced = 0;
+        if (spec.displace)
+        {
+            auto codeSize = static_cast<char*>(spec.fnEnd) - static_cast<char*>(spec.fnStart);
+            auto relocated = RelocatePrologueAarch64(code, codeSize, reinterpret_cast<uintptr_t>(spec.fnStart),
+                spec.displace, reinterpret_cast<uintptr_t>(stub + detour.size()), displaced);
+            detour.insert(detour.end(), relocated.begin(), relocated.end());
+        }
+
+        // Back into the function with a direct branch, a function body isn't
+        // a BTI landing pad
+        std::vector<uint8_t> resume{0x00, 0x00, 0x00, 0x14};
+        PopulateJumpAddr(static_cast<char*>(spec.fnStart) + displaced - (stub + detour.size()), resume.data());
+        detour.insert(detour.end(), resume.begin(), resume.end());
+
+        uint32_t cbnz;
+        std::memcpy(&cbnz, &detour[throwBranch], sizeof(cbnz));
+        cbnz |= static_cast<uint32_t>((detour.size() - throwBranch) / 4) << 5;
+        std::memcpy(&detour[throwBranch], &cbnz, sizeof(cbnz));
+
+        // x0 already holds the exception
+        Append(detour, k_ldpFrame);
+        appendLoad(16, spec.throwFn);
+        Append(detour, k_brX16);
+
+        if (detour.size() % 8)
+            Append(detour, k_nop);
+
+        for (auto const& load : literalLoads)
+        {
+            uint32_t ldr;
+            std::memcpy(&ldr, &detour[load.first], sizeof(ldr));
+            ldr |= static_cast<uint32_t>((detour.size() - load.first) / 4) << 5;
+            std::memcpy(&detour[load.first], &ldr, sizeof(ldr));
+
+            Append(detour, static_cast<uint32_t>(load.second));
+            Append(detour, static_cast<uint32_t>(load.second >> 32));
+        }
+
+        return detour;
+    }
 } // namespace eforce
@@ -1,8 +1,11 @@
 #include <priv/OpcodeGeneratorThumb.h>
+#include <priv/Relocator.h>
 
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <stdexcept>
+#include <utility>
 
 namespace eforce
 {
@@ -18,6 +21,61 @@ namespace
         0x00, 0xf0, 0x00, 0x90, // T4 branch immediate
     }};
 
+    /// k_doThrowThumb for when the throw function is out of range of the
+    /// branch, loads its address straight into pc. The address follows on the
+    /// next word boundary
+    constexpr std::array<uint8_t, 12> k_doThrowThumbFar{{
+        0x40, 0xf2, 0x00, 0x00, // T3 mov to bottom half of register 0
+        0xc0, 0xf2, 0x00, 0x00, // T2 mov to top half of register 0
+        0xdf, 0xf8, 0x00, 0xf0, // T2 ldr pc, [pc, #imm12]
+    }};
+
+    constexpr std::array<uint8_t, 4> k_branchThumb{{ 0x00, 0xf0, 0x00, 0x90 }};
+
+    /// T4 branches reach 16MB either way, leave room for the stub itself
+    constexpr std::ptrdiff_t k_branchRange = 16 * 1024 * 1024;
+    constexpr size_t k_stubRange = k_branchRange - 64 * 1024;
+
+    /// Detour stub instructions, as halfwords
+    constexpr uint16_t k_pushArgs[] = { 0xe92d, 0x500f };  // push.w {r0-r3, r12, lr}
+    constexpr uint16_t k_popArgs[] = { 0xe8bd, 0x500f };   // pop.w {r0-r3, r12, lr}
+    constexpr uint16_t k_vpushArgs[] = { 0xed2d, 0x0b10 }; // vpush {d0-d7}
+    constexpr uint16_t k_vpopArgs[] = { 0xecbd, 0x0b10 };  // vpop {d0-d7}
+    constexpr uint16_t k_ldrLiteral[] = { 0xf8df, 0x0000 }; // ldr.w rt, [pc, #imm12]
+    constexpr uint16_t k_movsR1Zero = 0x2100;               // movs r1, #0
+    constexpr uint16_t k_pushR1Lr = 0xb502;                 // push {r1, lr}
+    constexpr uint16_t k_movR1Sp = 0x4669;                  // mov r1, sp
+    constexpr uint16_t k_addSp8 = 0xb002;                   // add sp, #8
+    constexpr uint16_t k_blxR12 = 0x47e0;                   // blx r12
+    constexpr uint16_t k_cbzR0 = 0xb100;                    // cbz r0, #imm
+    constexpr uint16_t k_strR0Sp = 0x9000;                  // str r0, [sp, #imm8]
+    constexpr uint32_t k_r12 = 12;
+    constexpr uint32_t k_pc = 15;
+
+    /// Whether arguments are passed in VFP registers, which the detour
+    /// stub saves as well
+#if defined(__ARM_PCS_VFP)
+    constexpr bool k_vfpArgs = true;
+#else
+    constexpr bool k_vfpArgs = false;
+#endif
+
+    template <size_t N>
+    void Append(std::vector<uint8_t>& code, uint16_t const (&halfWords)[N])
+    {
+        for (auto halfWord : halfWords)
+        {
+            code.push_back(static_cast<uint8_t>(halfWord));
+            code.push_back(static_cast<uint8_t>(halfWord >> 8));
+        }
+    }
+
+    void Append(std::vector<uint8_t>& code, uint16_t halfWord)
+    {
+        uint16_t const halfWords[] = { halfWord };
+        Append(code, halfWords);
+    }
+
     void LoadHalfWord(uint16_t halfWord, uint8_t* instruction)
     {
         uint8_t imm8 = halfWord & 0xff;
@@ -70,9 +128,126 @@ namespace
         LoadHalfWord(highHalf, &doThrow[4]);
 
         auto throwOffset = static_cast<char*>(throwFn) - (static_cast<char*>(fnStart) + k_doThrowThumb.size());
+        if (throwOffset >= -k_branchRange && throwOffset < k_branchRange)
+        {
+            LoadBranchTarget(static_cast<int32_t>(throwOffset), &doThrow[8]);
+            return doThrow;
+        }
+
+        // ldr reads relative to its own address plus 4 rounded down to a
+        // word, and loading pc needs a word aligned address
+        auto ldrPc = (reinterpret_cast<uintptr_t>(fnStart) + 8 + 4) & ~uintptr_t(3);
+        auto literal = (reinterpret_cast<uintptr_t>(fnStart) + k_doThrowThumbFar.size() + 3) & ~uintptr_t(3);
+        auto literalOffset = static_cast<uint8_t>(literal - ldrPc);
+
+        doThrow.assign(k_doThrowThumbFar.begin(), k_doThrowThumbFar.end());
+        LoadHalfWord(lowHalf, &doThrow[0]);
+        LoadHalfWord(highHalf, &doThrow[4]);
+        doThrow[10] = literalOffset;
+        doThrow.resize(literal - reinterpret_cast<uintptr_t>(fnStart), 0x00);
 
-        LoadBranchTarget(static_cast<int32_t>(throwOffset), &doThrow[8]);
+        auto throwFnAddr = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(throwFn));
+        for (size_t i = 0; i < sizeof(throwFnAddr); ++i)
+            doThrow.push_back(static_cast<uint8_t>(throwFnAddr >> (8 * i)));
 
         return doThrow;
     }
+
+    size_t OpcodeGeneratorThumb::GetStubRange()
+    {
+        return k_stubRange;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorThumb::GetDetourOpcode(DetourSpec_t const& spec, uint8_t const* code)
+    {
+        auto stub = reinterpret_cast<uintptr_t>(spec.stub);
+        std::vector<uint8_t> detour;
+
+        // Loads of each literal, filled in once the literals are placed
+        // after the code
+        std::vector<std::pair<size_t, uint32_t>> literalLoads;
+        auto appendLoad = [&] (uint32_t reg, void* value) {
+            literalLoads.emplace_back(detour.size(), static_cast<uint32_t>(reinterpret_cast<uintptr_t>(value)));
+            uint16_t const ldr[] = { k_ldrLiteral[0], static_cast<uint16_t>(k_ldrLiteral[1] | (reg << 12)) };
+            Append(detour, ldr);
+        };
+
+        auto appendRestore = [&] {
+            if (k_vfpArgs)
+                Append(detour, k_vpopArgs);
+            Append(detour, k_popArgs);
+        };
+
+        Append(detour, k_pushArgs);
+        if (k_vfpArgs)
+            Append(detour, k_vpushArgs);
+
+        // Thumb code keeps no frame chain we could follow, so hand the
+        // decision a frame record of our own that ends the chain after the
+        // function's caller
+        Append(detour, k_movsR1Zero);
+        Append(detour, k_pushR1Lr);
+        Append(detour, k_movR1Sp);
+        appendLoad(0, spec.decideArg);
+        appendLoad(k_r12, spec.decideFn);
+        Append(detour, k_blxR12);
+        Append(detour, k_addSp8);
+        auto continueBranch = detour.size();
+        Append(detour, k_cbzR0);
+
+        // Throw with the exception in place of the saved r0, and leave as if
+        // the function had branched to the throw function itself
+        size_t savedR0 = k_vfpArgs ? 64 : 0;
+        Append(detour, static_cast<uint16_t>(k_strR0Sp | (savedR0 / 4)));
+        appendRestore();
+        appendLoad(k_pc, spec.throwFn);
+
+        auto continueOffset = detour.size() - (continueBranch + 4);
+        uint16_t cbz = k_cbzR0 | static_cast<uint16_t>(((continueOffset & 0x40) << 3) | (((continueOffset >> 1) & 0x1f) << 3));
+        detour[continueBranch] = static_cast<uint8_t>(cbz);
+        detour[continueBranch + 1] = static_cast<uint8_t>(cbz >> 8);
+
+        appendRestore();
+
+        size_t displaced = 0;
+        if (spec.displace)
+        {
+            auto codeSize = static_cast<char*>(spec.fnEnd) - static_cast<char*>(spec.fnStart);
+            auto relocated = RelocatePrologueThumb(code, codeSize, reinterpret_cast<uintptr_t>(spec.fnStart),
+                spec.displace, stub + detour.size(), displaced);
+            detour.insert(detour.end(), relocated.begin(), relocated.end());
+        }
+
+        auto resume = GetStubJump(reinterpret_cast<void*>(stub + detour.size()), static_cast<char*>(spec.fnStart) + displaced);
+        detour.insert(detour.end(), resume.begin(), resume.end());
+
+        if ((stub + detour.size()) % 4)
+            Append(detour, 0xbf00); // nop
+
+        for (auto const& load : literalLoads)
+        {
+            // ldr reads relative to its own address plus 4 rounded down to
+            // a word
+            auto base = (stub + load.first + 4) & ~uintptr_t(3);
+            auto imm = static_cast<uint16_t>(stub + detour.size() - base);
+            detour[load.first + 2] = static_cast<uint8_t>(imm);
+            detour[load.first + 3] |= static_cast<uint8_t>(imm >> 8);
+
+            for (size_t i = 0; i < sizeof(load.second); ++i)
+                detour.push_back(static_cast<uint8_t>(load.second >> (8 * i)));
+        }
+
+        return detour;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorThumb::GetStubJump(void* fnStart, void* stub)
+    {
+        auto offset = static_cast<char*>(stub) - (static_cast<char*>(fnStart) + k_branchThumb.size());
+        if (offset < -k_branchRange || offset >= k_branchRange)
+            throw std::runtime_error("Cannot generate opcode");
+
+        std::vector<uint8_t> jump(k_branchThumb.begin(), k_branchThumb.end());
+        LoadBranchTarget(static_cast<int32_t>(offset), jump.data());
+        return jump;
+    }
 } // namespace eforce
@@ -1,9 +1,14 @@
 #include <priv/OpcodeGeneratorX64.h>
+#include <priv/Relocator.h>
 #include <priv/Util.h>
 
+#include <eforce/Patchable.h>
+
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <stdexcept>
 
@@ -17,6 +22,110 @@ namespace eforce
         0xe9, 0x00, 0x00, 0x00, 0x00,                //jmp 0x00 offset
     }};
 
+    /// k_doThrow for when the throw function is more than 2GB away, jumps
+    /// through rax which is free to clobber on entry
+    static constexpr const std::array<uint8_t, 22> k_doThrowFar = {{
+        0x48, 0xbf, 0x00, 0x00, 0x00, 0x00, 0x00,    //movabs rdi,0x0000000000000000
+        0x00, 0x00, 0x00,
+        0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00,    //movabs rax,0x0000000000000000
+        0x00, 0x00, 0x00,
+        0xff, 0xe0,                                  //jmp rax
+    }};
+
+    /// How far we place stubs from the jump to them, short of the 2GB a
+    /// jmp rel32 can reach
+    static constexpr size_t k_stubRange = 0x7fff0000;
+
+    /**
+     * @brief Gets a jmp rel32 at from to target
+     */
+    static std::vector<uint8_t> GetJump32(void* from, void* target)
+    {
+        // Relative to the end of the jump
+        auto offset = static_cast<char*>(target) - (static_cast<char*>(from) + 5);
+        if (offset < std::numeric_limits<int32_t>::min() || offset > std::numeric_limits<int32_t>::max())
+            throw std::runtime_error("Cannot generate opcode");
+
+        auto rel = static_cast<uint32_t>(static_cast<int32_t>(offset));
+        return std::vector<uint8_t>{
+            0xe9,
+            static_cast<uint8_t>(rel),
+            static_cast<uint8_t>(rel >> 8),
+            static_cast<uint8_t>(rel >> 16),
+            static_cast<uint8_t>(rel >> 24),
+        };
+    }
+
+    /// Start of a detour stub, saves every register that can carry an
+    /// argument. rax carries the vector count for varargs and r10 the static
+    /// chain. rbp keeps the stack as the function was entered, so the throw
+    /// path can leave straight from it, and points at a frame record whose
+    /// return address is in the function's caller
+    static constexpr const std::array<uint8_t, 67> k_detourSave = {{
+        0x55,                                        //push rbp
+        0x48, 0x89, 0xe5,                            //mov rbp,rsp
+        0x57, 0x56, 0x52, 0x51,                      //push rdi; push rsi; push rdx; push rcx
+        0x41, 0x50, 0x41, 0x51,                      //push r8; push r9
+        0x50, 0x41, 0x52,                            //push rax; push r10
+        0x48, 0x83, 0xc4, 0x80,                      //add rsp,-128
+        0xf3, 0x0f, 0x7f, 0x44, 0x24, 0x00,          //movdqu [rsp],xmm0
+        0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10,          //movdqu [rsp+0x10],xmm1
+        0xf3, 0x0f, 0x7f, 0x54, 0x24, 0x20,          //movdqu [rsp+0x20],xmm2
+        0xf3, 0x0f, 0x7f, 0x5c, 0x24, 0x30,          //movdqu [rsp+0x30],xmm3
+        0xf3, 0x0f, 0x7f, 0x64, 0x24, 0x40,          //movdqu [rsp+0x40],xmm4
+        0xf3, 0x0f, 0x7f, 0x6c, 0x24, 0x50,          //movdqu [rsp+0x50],xmm5
+        0xf3, 0x0f, 0x7f, 0x74, 0x24, 0x60,          //movdqu [rsp+0x60],xmm6
+        0xf3, 0x0f, 0x7f, 0x7c, 0x24, 0x70,          //movdqu [rsp+0x70],xmm7
+    }};
+
+    /// Calls the decision function with our frame record, leaving the
+    /// exception to throw in rax
+    static constexpr const std::array<uint8_t, 34> k_detourDecide = {{
+        0x48, 0xbf, 0x00, 0x00, 0x00, 0x00, 0x00,    //movabs rdi,decideArg
+        0x00, 0x00, 0x00,
+        0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00,    //movabs rax,decideFn
+        0x00, 0x00, 0x00,
+        0x48, 0x89, 0xee,                            //mov rsi,rbp
+        0xff, 0xd0,                                  //call rax
+        0x48, 0x85, 0xc0,                            //test rax,rax
+        0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,          //jnz throw
+    }};
+
+    /// Undoes k_detourSave
+    static constexpr const std::array<uint8_t, 64> k_detourRestore = {{
+        0xf3, 0x0f, 0x6f, 0x44, 0x24, 0x00,          //movdqu xmm0,[rsp]
+        0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10,          //movdqu xmm1,[rsp+0x10]
+        0xf3, 0x0f, 0x6f, 0x54, 0x24, 0x20,          //movdqu xmm2,[rsp+0x20]
+        0xf3, 0x0f, 0x6f, 0x5c, 0x24, 0x30,          //movdqu xmm3,[rsp+0x30]
+        0xf3, 0x0f, 0x6f, 0x64, 0x24, 0x40,          //movdqu xmm4,[rsp+0x40]
+        0xf3, 0x0f, 0x6f, 0x6c, 0x24, 0x50,          //movdqu xmm5,[rsp+0x50]
+        0xf3, 0x0f, 0x6f, 0x74, 0x24, 0x60,          //movdqu xmm6,[rsp+0x60]
+        0xf3, 0x0f, 0x6f, 0x7c, 0x24, 0x70,          //movdqu xmm7,[rsp+0x70]
+        0x48, 0x83, 0xec, 0x80,                      //sub rsp,-128
+        0x41, 0x5a, 0x58,                            //pop r10; pop rax
+        0x41, 0x59, 0x41, 0x58,                      //pop r9; pop r8
+        0x59, 0x5a, 0x5e, 0x5f,                      //pop rcx; pop rdx; pop rsi; pop rdi
+        0x5d,                                        //pop rbp
+    }};
+
+    /// Leaves the stub for the throw function with the exception in rdi,
+    /// as if the function had jumped there itself
+    static constexpr const std::array<uint8_t, 19> k_detourThrow = {{
+        0x48, 0x89, 0xc7,                            //mov rdi,rax
+        0x48, 0x89, 0xec,                            //mov rsp,rbp
+        0x5d,                                        //pop rbp
+        0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00,    //movabs rax,throwFn
+        0x00, 0x00, 0x00,
+        0xff, 0xe0,                                  //jmp rax
+    }};
+
+    /// 2 byte nop (xchg ax, ax), a single instruction so threads can't be
+    /// stopped half way through it when we swap in a jump
+    static constexpr const std::array<uint8_t, 2> k_entryNop = {{ 0x66, 0x90 }};
+
+    /// 5 byte nop (nop DWORD PTR [rax+rax*1+0x0]), must match THROW_GUARD_NOP
+    static constexpr const std::array<uint8_t, 5> k_guardNop = {{ 0x0f, 0x1f, 0x44, 0x00, 0x00 }};
+
     std::vector<uint8_t> OpcodeGeneratorX64::GetThrowOpcode(
         void* fnStart, 
         void* throwFn,
@@ -28,15 +137,22 @@ namespace eforce
         // our calling convention (lucky us). Because of this we can just dump
         // a pointer in RBX and jump to Throw
         
-        std::vector<uint8_t> doThrow(k_doThrow.begin(), k_doThrow.end());
-
         auto throwFnChar = static_cast<char*>(throwFn);
         auto fnStartChar = static_cast<char*>(fnStart);
 
         uint64_t absThrowFnOffset = Difference(throwFnChar, fnStartChar + k_doThrow.size());
         if (absThrowFnOffset > static_cast<uint32_t>(std::abs(std::numeric_limits<int32_t>::min())))
-            throw std::runtime_error("Cannot generate opcode");
-        
+        {
+            std::vector<uint8_t> doThrowFar(k_doThrowFar.begin(), k_doThrowFar.end());
+            auto exceptionAddr = reinterpret_cast<uint64_t>(pError);
+            auto throwFnAddr = reinterpret_cast<uint64_t>(throwFn);
+            std::memcpy(&doThrowFar[2], &exceptionAddr, sizeof(exceptionAddr));
+            std::memcpy(&doThrowFar[12], &throwFnAddr, sizeof(throwFnAddr));
+            return doThrowFar;
+        }
+
+        std::vector<uint8_t> doThrow(k_doThrow.begin(), k_doThrow.end());
+
         int32_t throwFnOffset = (throwFnChar > fnStartChar + k_doThrow.size())
             ? static_cast<int32_t>(absThrowFnOffset)
             : -static_cast<int32_t>(absThrowFnOffset);
@@ -49,4 +165,90 @@ namespace eforce
 
         return doThrow;
     }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetEntryNop()
+    {
+        return std::vector<uint8_t>(k_entryNop.begin(), k_entryNop.end());
+    }
+
+    bool OpcodeGeneratorX64::HasEntryPad(uint8_t const* pEntry)
+    {
+        // GCC pads with single byte nops, we turn the ones at the entry into
+        // k_entryNop
+        auto pPad = pEntry - EFORCE_PATCHABLE_ENTRY_PREFIX_BYTES;
+        bool prefixIsPad = std::all_of(pPad, pEntry, [] (uint8_t byte) { return byte == 0x90; });
+        return prefixIsPad && (pEntry[0] == 0x90 || pEntry[0] == k_entryNop[0]) && pEntry[1] == 0x90;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetEntryJump(void* entry, void* target)
+    {
+        // jmp rel8, relative to the end of the jump
+        auto offset = static_cast<char*>(target) - (static_cast<char*>(entry) + k_entryNop.size());
+        if (offset < std::numeric_limits<int8_t>::min() || offset > std::numeric_limits<int8_t>::max())
+            throw std::runtime_error("Cannot generate opcode");
+
+        return std::vector<uint8_t>{0xeb, static_cast<uint8_t>(static_cast<int8_t>(offset))};
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetGuardNop()
+    {
+        return std::vector<uint8_t>(k_guardNop.begin(), k_guardNop.end());
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetGuardJump(void* guard, void* target)
+    {
+        // Guards always jump within their own function
+        return GetJump32(guard, target);
+    }
+
+    size_t OpcodeGeneratorX64::GetStubRange()
+    {
+        return k_stubRange;
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetStubJump(void* fnStart, void* stub)
+    {
+        return GetJump32(fnStart, stub);
+    }
+
+    std::vector<uint8_t> OpcodeGeneratorX64::GetDetourOpcode(DetourSpec_t const& spec, uint8_t const* code)
+    {
+        // The stack is 16 byte aligned again once rbp and the eight
+        // registers are pushed, so the call needs nothing more. Only the low
+        // 128 bits of vector arguments survive it
+        std::vector<uint8_t> detour(k_detourSave.begin(), k_detourSave.end());
+
+        auto decideOffset = detour.size();
+        detour.insert(detour.end(), k_detourDecide.begin(), k_detourDecide.end());
+        auto decideArg = reinterpret_cast<uint64_t>(spec.decideArg);
+        auto decideFn = reinterpret_cast<uint64_t>(spec.decideFn);
+        std::memcpy(&detour[decideOffset + 2], &decideArg, sizeof(decideArg));
+        std::memcpy(&detour[decideOffset + 12], &decideFn, sizeof(decideFn));
+        auto throwJumpEnd = detour.size();
+
+        detour.insert(detour.end(), k_detourRestore.begin(), k_detourRestore.end());
+
+        auto stub = reinterpret_cast<uintptr_t>(spec.stub);
+        auto fnStart = reinterpret_cast<uintptr_t>(spec.fnStart);
+        size_t displaced = 0;
+        if (spec.displace)
+        {
+            auto codeSize = static_cast<char*>(spec.fnEnd) - static_cast<char*>(spec.fnStart);
+            auto relocated = RelocatePrologueX64(code, codeSize, fnStart, spec.displace, stub + detour.size(), displaced);
+            detour.insert(detour.end(), relocated.begin(), relocated.end());
+        }
+
+        auto resume = GetJump32(static_cast<char*>(spec.stub) + detour.size(), static_cast<char*>(spec.fnStart) + displaced);
+        detour.insert(detour.end(), resume.begin(), resume.end());
+
+        auto throwOffset = static_cast<int32_t>(detour.size() - throwJumpEnd);
+        std::memcpy(&detour[throwJumpEnd - sizeof(throwOffset)], &throwOffset, sizeof(throwOffset));
+
+        auto throwStart = detour.size();
+        detour.insert(detour.end(), k_detourThrow.begin(), k_detourThrow.end());
+        auto throwFn = reinterpret_cast<uint64_t>(spec.throwFn);
+        std::memcpy(&detour[throwStart + 9], &throwFn, sizeof(throwFn));
+
+        return detour;
+    }
 } // namespace eforce
@@ -0,0 +1,49 @@
+#include <priv/Random.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+namespace eforce
+{
+namespace
+{
+    /**
+     * @brief splitmix64, spreads a seed over all 64 bits so threads started
+     *  close together don't get similar xorshift states
+     */
+    uint64_t SplitMix(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+} // namespace
+
+    uint64_t NextRandom()
+    {
+        // Zero is the one state xorshift never leaves, so it doubles as
+        // "not seeded yet"
+        static thread_local uint64_t s_state = 0;
+        if (!s_state)
+        {
+            auto seed = std::hash<std::thread::id>()(std::this_thread::get_id())
+                ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+            s_state = SplitMix(seed) | 1;
+        }
+
+        s_state ^= s_state >> 12;
+        s_state ^= s_state << 25;
+        s_state ^= s_state >> 27;
+        return s_state * 0x2545f4914f6cdd1dull;
+    }
+
+    uint64_t ProbabilityThreshold(double probability)
+    {
+        // 2^64 * probability is below 2^64 for any probability below 1
+        return static_cast<uint64_t>(std::ldexp(probability, 64));
+    }
+} // namespace eforce
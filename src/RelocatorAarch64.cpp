@@ -0,0 +1,176 @@
+#include <priv/Relocator.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    // Encodings from the Arm Architecture Reference Manual for A-profile.
+    // x17 is used as scratch, like x16 the calling convention leaves it free
+    // on entry to a function
+
+    constexpr uint32_t k_scratch = 17;
+
+    /// B reaches 128MB either way
+    constexpr std::ptrdiff_t k_branchRange = 128 * 1024 * 1024;
+
+    constexpr uint32_t k_ldrLiteralX17 = 0x58000000 | k_scratch;  // ldr x17, #imm19
+    constexpr uint32_t k_brX17 = 0xd61f0000 | (k_scratch << 5);    // br x17
+    constexpr uint32_t k_blrX17 = 0xd63f0000 | (k_scratch << 5);   // blr x17
+    constexpr uint32_t k_branch = 0x14000000;                       // b #imm26
+
+    /**
+     * @brief Sign extends the low bits of value
+     */
+    int64_t SignExtend(uint64_t value, unsigned bits)
+    {
+        auto shift = 64 - bits;
+        return static_cast<int64_t>(value << shift) >> shift;
+    }
+
+    void Append(std::vector<uint8_t>& code, uint32_t insn)
+    {
+        uint8_t bytes[sizeof(insn)];
+        std::memcpy(bytes, &insn, sizeof(insn));
+        code.insert(code.end(), bytes, bytes + sizeof(bytes));
+    }
+
+    void Append64(std::vector<uint8_t>& code, uint64_t value)
+    {
+        Append(code, static_cast<uint32_t>(value));
+        Append(code, static_cast<uint32_t>(value >> 32));
+    }
+
+    uint32_t LdrLiteral(uint32_t insn, std::ptrdiff_t offset)
+    {
+        return insn | ((static_cast<uint32_t>(offset / 4) & 0x7ffff) << 5);
+    }
+
+    /**
+     * @brief Appends a branch from the end of code to target, direct if it
+     *  reaches. Going through a register would need target to be a landing
+     *  pad under BTI, and a function body is not
+     */
+    void AppendBranch(std::vector<uint8_t>& code, uintptr_t dest, uint64_t target)
+    {
+        auto offset = static_cast<std::ptrdiff_t>(target - (dest + code.size()));
+        if (offset >= -k_branchRange && offset < k_branchRange)
+        {
+            Append(code, k_branch | (static_cast<uint32_t>(offset / 4) & 0x3ffffff));
+            return;
+        }
+
+        Append(code, LdrLiteral(k_ldrLiteralX17, 8));
+        Append(code, k_brX17);
+        Append64(code, target);
+    }
+
+    /**
+     * @brief Appends a load of address into reg, ldr from a literal
+     *  branched over
+     */
+    void AppendLoadAddress(std::vector<uint8_t>& code, uint32_t reg, uint64_t address)
+    {
+        Append(code, LdrLiteral(0x58000000 | reg, 8));
+        Append(code, k_branch | 3);
+        Append64(code, address);
+    }
+} // namespace
+
+    std::vector<uint8_t> RelocatePrologueAarch64(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t dest, size_t& displaced)
+    {
+        // Every branch we write is a single instruction, so there's only ever
+        // one to relocate and nothing can branch part way into it
+        if (size > sizeof(uint32_t) || codeSize < sizeof(uint32_t))
+            throw std::runtime_error("Cannot relocate function prologue");
+
+        uint32_t insn;
+        std::memcpy(&insn, code, sizeof(insn));
+        uint64_t pc = fnStart;
+        auto rt = insn & 0x1f;
+        std::vector<uint8_t> relocated;
+
+        if ((insn & 0x1f000000) == 0x10000000)
+        {
+            // adr and adrp, become a load of the address they'd compute
+            auto imm = SignExtend((((insn >> 5) & 0x7ffff) << 2) | ((insn >> 29) & 0x3), 21);
+            auto target = (insn & 0x80000000) ? (pc & ~uint64_t(0xfff)) + (imm << 12) : pc + imm;
+            AppendLoadAddress(relocated, rt, target);
+        }
+        else if ((insn & 0x3b000000) == 0x18000000)
+        {
+            // ldr (literal), load the literal's address then from it
+            auto target = pc + SignExtend((insn >> 5) & 0x7ffff, 19) * 4;
+            auto opc = insn >> 30;
+            bool simd = insn & 0x04000000;
+            if (!simd && opc == 3)
+            {
+                // prfm, just drop it
+                Append(relocated, 0xd503201f);
+            }
+            else
+            {
+                static constexpr uint32_t k_loads[] = {
+                    0xb9400000, 0xf9400000, 0xb9800000, 0,  // ldr w, ldr x, ldrsw x
+                };
+                static constexpr uint32_t k_simdLoads[] = {
+                    0xbd400000, 0xfd400000, 0x3dc00000, 0,  // ldr s, ldr d, ldr q
+                };
+
+                auto load = simd ? k_simdLoads[opc] : k_loads[opc];
+                if (!load)
+                    throw std::runtime_error("Cannot relocate function prologue");
+
+                AppendLoadAddress(relocated, k_scratch, target);
+                Append(relocated, load | (k_scratch << 5) | rt);
+            }
+        }
+        else if ((insn & 0x7c000000) == 0x14000000)
+        {
+            // b and bl
+            auto target = pc + SignExtend(insn & 0x3ffffff, 26) * 4;
+            if (insn & 0x80000000)
+            {
+                // Return to the instruction after the call, past the literal
+                Append(relocated, LdrLiteral(k_ldrLiteralX17, 12));
+                Append(relocated, k_blrX17);
+                Append(relocated, k_branch | 3);
+                Append64(relocated, target);
+            }
+            else
+            {
+                AppendBranch(relocated, dest, target);
+            }
+        }
+        else if ((insn & 0xff000010) == 0x54000000 || (insn & 0x7c000000) == 0x34000000)
+        {
+            // b.cond, cbz, cbnz, tbz and tbnz. Retarget the condition to a
+            // branch to the original target, and skip over it otherwise
+            bool testBit = (insn & 0x7e000000) == 0x36000000;
+            auto target = testBit
+                ? pc + SignExtend((insn >> 5) & 0x3fff, 14) * 4
+                : pc + SignExtend((insn >> 5) & 0x7ffff, 19) * 4;
+
+            auto immMask = testBit ? (0x3fffu << 5) : (0x7ffffu << 5);
+            Append(relocated, (insn & ~immMask) | (2u << 5));
+
+            std::vector<uint8_t> taken;
+            AppendBranch(taken, dest + relocated.size() + sizeof(uint32_t), target);
+            Append(relocated, k_branch | static_cast<uint32_t>(1 + taken.size() / 4));
+            relocated.insert(relocated.end(), taken.begin(), taken.end());
+        }
+        else
+        {
+            Append(relocated, insn);
+        }
+
+        displaced = sizeof(insn);
+        return relocated;
+    }
+} // namespace eforce
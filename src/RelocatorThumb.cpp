@@ -0,0 +1,203 @@
+#include <priv/Relocator.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    // Encodings from the Armv7-M and Armv7-A Architecture Reference Manuals.
+    // Instructions are one or two little endian halfwords
+
+    constexpr uint32_t k_pc = 15;
+
+    uint16_t ReadHalfWord(uint8_t const* p)
+    {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+
+    void Append(std::vector<uint8_t>& code, uint16_t halfWord)
+    {
+        code.push_back(static_cast<uint8_t>(halfWord));
+        code.push_back(static_cast<uint8_t>(halfWord >> 8));
+    }
+
+    int32_t SignExtend(int32_t value, unsigned bits)
+    {
+        auto shift = 32 - bits;
+        return static_cast<int32_t>(static_cast<uint32_t>(value) << shift) >> shift;
+    }
+
+    bool IsWide(uint16_t firstHalf)
+    {
+        return (firstHalf & 0xf800) >= 0xe800;
+    }
+
+    /**
+     * @brief What pc reads as in a literal load or adr at address
+     */
+    uint32_t LiteralBase(uintptr_t address)
+    {
+        return static_cast<uint32_t>((address + 4) & ~uintptr_t(3));
+    }
+
+    /**
+     * @brief Appends movw, or movt if top, of half of value into rd
+     */
+    void AppendMov(std::vector<uint8_t>& code, uint32_t rd, uint16_t value, bool top)
+    {
+        Append(code, static_cast<uint16_t>((top ? 0xf2c0 : 0xf240) | ((value >> 1) & 0x0400) | (value >> 12)));
+        Append(code, static_cast<uint16_t>(((value << 4) & 0x7000) | (rd << 8) | (value & 0xff)));
+    }
+
+    void AppendLoadAddress(std::vector<uint8_t>& code, uint32_t rd, uint32_t address)
+    {
+        AppendMov(code, rd, static_cast<uint16_t>(address), false);
+        AppendMov(code, rd, static_cast<uint16_t>(address >> 16), true);
+    }
+
+    /**
+     * @brief Gets where a direct branch at address goes
+     * @return false if it isn't a direct branch
+     */
+    bool BranchTarget(uintptr_t address, uint16_t first, uint16_t second, uintptr_t& target)
+    {
+        auto pc = address + 4;
+        if (!IsWide(first))
+        {
+            if ((first & 0xf000) == 0xd000 && (first & 0x0e00) != 0x0e00)
+                target = pc + static_cast<int8_t>(first & 0xff) * 2;
+            else if ((first & 0xf800) == 0xe000)
+                target = pc + SignExtend(first & 0x7ff, 11) * 2;
+            else if ((first & 0xf500) == 0xb100)
+                target = pc + (((first >> 3) & 0x1f) << 1) + ((first & 0x0200) ? 64 : 0);
+            else
+                return false;
+
+            return true;
+        }
+
+        if ((first & 0xf800) != 0xf000 || !(second & 0x8000))
+            return false;
+
+        int32_t s = (first >> 10) & 1;
+        int32_t j1 = (second >> 13) & 1;
+        int32_t j2 = (second >> 11) & 1;
+        if ((second & 0x5000) == 0)
+        {
+            // Conditional b.w, the other encodings with this condition field
+            // are hints and system instructions
+            if ((first & 0x0380) == 0x0380)
+                return false;
+
+            int32_t imm = (s << 20) | (j2 << 19) | (j1 << 18) | ((first & 0x3f) << 12) | ((second & 0x7ff) << 1);
+            target = pc + SignExtend(imm, 21);
+            return true;
+        }
+
+        int32_t i1 = !(j1 ^ s);
+        int32_t i2 = !(j2 ^ s);
+        int32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | ((first & 0x3ff) << 12) | ((second & 0x7ff) << 1);
+        target = pc + SignExtend(imm, 25);
+        return true;
+    }
+} // namespace
+
+    std::vector<uint8_t> RelocatePrologueThumb(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t /*dest*/, size_t& displaced)
+    {
+        // Everything we emit reads the same from anywhere, so where it goes
+        // doesn't matter
+        std::vector<uint8_t> relocated;
+        uintptr_t target;
+        size_t offset = 0;
+        while (offset < size)
+        {
+            if (codeSize - offset < 2)
+                throw std::runtime_error("Cannot decode function prologue");
+
+            auto address = fnStart + offset;
+            auto first = ReadHalfWord(code + offset);
+            if (!IsWide(first))
+            {
+                if ((first & 0xf800) == 0x4800)
+                {
+                    // ldr rt, [pc, #imm8]
+                    auto rt = (first >> 8) & 0x7;
+                    AppendLoadAddress(relocated, rt, LiteralBase(address) + (first & 0xff) * 4);
+                    Append(relocated, static_cast<uint16_t>(0x6800 | (rt << 3) | rt));
+                }
+                else if ((first & 0xf800) == 0xa000)
+                {
+                    // adr rd, #imm8
+                    AppendLoadAddress(relocated, (first >> 8) & 0x7, LiteralBase(address) + (first & 0xff) * 4);
+                }
+                else if (BranchTarget(address, first, 0, target)
+                    || ((first & 0xff00) == 0xbf00 && (first & 0x000f))
+                    || ((first & 0xfc00) == 0x4400 && (((first >> 3) & 0xf) == k_pc || (((first >> 4) & 0x8) | (first & 0x7)) == k_pc)))
+                {
+                    // Branches, it blocks and anything else that reads pc
+                    throw std::runtime_error("Cannot relocate function prologue");
+                }
+                else
+                {
+                    Append(relocated, first);
+                }
+
+                offset += 2;
+                continue;
+            }
+
+            if (codeSize - offset < 4)
+                throw std::runtime_error("Cannot decode function prologue");
+
+            auto second = ReadHalfWord(code + offset + 2);
+            if ((first & 0xff7f) == 0xf85f && (second >> 12) != k_pc)
+            {
+                // ldr.w rt, [pc, #+/-imm12]
+                auto rt = second >> 12;
+                auto imm = second & 0xfff;
+                auto literal = (first & 0x0080) ? LiteralBase(address) + imm : LiteralBase(address) - imm;
+                AppendLoadAddress(relocated, rt, literal);
+                Append(relocated, static_cast<uint16_t>(0xf8d0 | rt));
+                Append(relocated, static_cast<uint16_t>(rt << 12));
+            }
+            else if (BranchTarget(address, first, second, target)
+                || (first & 0xfbff) == 0xf20f || (first & 0xfbff) == 0xf2af
+                || ((first & 0xfe00) == 0xf800 && (first & 0x000f) == k_pc)
+                || (first & 0xfe5f) == 0xe85f || first == 0xe8df)
+            {
+                // Branches, adr.w, other literal loads and table branches
+                throw std::runtime_error("Cannot relocate function prologue");
+            }
+            else
+            {
+                Append(relocated, first);
+                Append(relocated, second);
+            }
+
+            offset += 4;
+        }
+
+        displaced = offset;
+
+        // When the branch to the stub covers two instructions nothing may
+        // land on the second. Literal pools decode as garbage here, which
+        // errs on the side of refusing
+        for (size_t check = 0; codeSize - check >= 2; )
+        {
+            auto first = ReadHalfWord(code + check);
+            bool wide = IsWide(first) && codeSize - check >= 4;
+            if (BranchTarget(fnStart + check, first, wide ? ReadHalfWord(code + check + 2) : 0, target)
+                && target > fnStart && target < fnStart + displaced)
+                throw std::runtime_error("Function branches into its own prologue");
+
+            check += wide ? 4 : 2;
+        }
+
+        return relocated;
+    }
+} // namespace eforce
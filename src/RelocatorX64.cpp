@@ -0,0 +1,384 @@
+#include <priv/Relocator.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    /// No x86 instruction is longer than this, prefixes included
+    constexpr size_t k_maxInsnLength = 15;
+
+    /// How an instruction changes where execution goes, for the ones that
+    /// do so relative to themselves
+    enum class Branch
+    {
+        None,
+        Jcc8,
+        Jmp8,
+        Jcc32,
+        Jmp32,
+        Call32,
+        /// loop, jrcxz and xbegin, which have no longer form to move to
+        Unrelocatable,
+    };
+
+    struct DecodedInsn
+    {
+        size_t length = 0;
+        /// Offset of the opcode byte, after any prefixes
+        size_t opcodeOffset = 0;
+        /// Offset of a RIP relative disp32, 0 if there isn't one
+        size_t ripDispOffset = 0;
+        Branch branch = Branch::None;
+    };
+
+    bool IsLegacyPrefix(uint8_t byte)
+    {
+        switch (byte)
+        {
+        case 0xf0: case 0xf2: case 0xf3:
+        case 0x2e: case 0x36: case 0x3e: case 0x26: case 0x64: case 0x65:
+        case 0x66: case 0x67:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * @brief Decodes the length of the instruction at pInsn, and anything
+     *  in it relative to where it is
+     * @return false if it isn't an instruction we know in 64 bit mode, or
+     *  it runs past pEnd
+     */
+    bool Decode(uint8_t const* pInsn, uint8_t const* pEnd, DecodedInsn& insn)
+    {
+        insn = DecodedInsn();
+        if (pEnd <= pInsn)
+            return false;
+
+        size_t avail = std::min<size_t>(pEnd - pInsn, k_maxInsnLength);
+        size_t i = 0;
+        bool opSize16 = false;
+        bool addrSize32 = false;
+        bool rexW = false;
+
+        for (; i < avail && IsLegacyPrefix(pInsn[i]); ++i)
+        {
+            opSize16 |= pInsn[i] == 0x66;
+            addrSize32 |= pInsn[i] == 0x67;
+        }
+
+        if (i < avail && (pInsn[i] & 0xf0) == 0x40)
+        {
+            rexW = pInsn[i] & 0x08;
+            ++i;
+        }
+
+        if (i >= avail)
+            return false;
+
+        // Opcode map, 0 for one byte opcodes then 0f, 0f38 and 0f3a. VEX
+        // and EVEX give theirs in their prefix. c4, c5 and 62 are always
+        // VEX and EVEX in 64 bit mode
+        unsigned map = 0;
+        bool vex = false;
+        auto lead = pInsn[i];
+        if (lead == 0xc4 || lead == 0xc5 || lead == 0x62)
+        {
+            size_t prefixSize = (lead == 0xc5) ? 2 : (lead == 0xc4) ? 3 : 4;
+            if (i + prefixSize >= avail)
+                return false;
+
+            map = (lead == 0xc5) ? 1 : pInsn[i + 1] & ((lead == 0xc4) ? 0x1f : 0x07);
+            if (lead == 0xc4)
+                rexW = pInsn[i + 2] & 0x80;
+
+            i += prefixSize;
+            vex = true;
+        }
+        else if (lead == 0x0f)
+        {
+            if (++i >= avail)
+                return false;
+
+            map = 1;
+            if (pInsn[i] == 0x38 || pInsn[i] == 0x3a)
+            {
+                map = (pInsn[i] == 0x38) ? 2 : 3;
+                ++i;
+            }
+        }
+
+        if (i >= avail)
+            return false;
+
+        insn.opcodeOffset = i;
+        auto op = pInsn[i++];
+
+        bool hasModrm = false;
+        size_t immSize = 0;
+        size_t fullImm = opSize16 ? 2 : 4;
+
+        if (map == 0)
+        {
+            if (op < 0x40)
+            {
+                // The ALU block, the rest of it is segment pushes, BCD and
+                // prefixes we've already taken
+                switch (op & 0x07)
+                {
+                case 0: case 1: case 2: case 3: hasModrm = true; break;
+                case 4: immSize = 1; break;
+                case 5: immSize = fullImm; break;
+                default: return false;
+                }
+            }
+            else if (op >= 0x50 && op <= 0x5f) {}
+            else if (op == 0x63) hasModrm = true;
+            else if (op == 0x68) immSize = fullImm;
+            else if (op == 0x69) { hasModrm = true; immSize = fullImm; }
+            else if (op == 0x6a) immSize = 1;
+            else if (op == 0x6b) { hasModrm = true; immSize = 1; }
+            else if (op >= 0x6c && op <= 0x6f) {}
+            else if (op >= 0x70 && op <= 0x7f) { immSize = 1; insn.branch = Branch::Jcc8; }
+            else if (op == 0x80 || op == 0x83 || op == 0xc0 || op == 0xc1 || op == 0xc6) { hasModrm = true; immSize = 1; }
+            else if (op == 0x81 || op == 0xc7) { hasModrm = true; immSize = fullImm; }
+            else if (op >= 0x84 && op <= 0x8f) hasModrm = true;
+            else if (op >= 0x90 && op <= 0x9f && op != 0x9a) {}
+            else if (op >= 0xa0 && op <= 0xa3) immSize = addrSize32 ? 4 : 8;
+            else if ((op >= 0xa4 && op <= 0xa7) || (op >= 0xaa && op <= 0xaf)) {}
+            else if (op == 0xa8) immSize = 1;
+            else if (op == 0xa9) immSize = fullImm;
+            else if (op >= 0xb0 && op <= 0xb7) immSize = 1;
+            else if (op >= 0xb8 && op <= 0xbf) immSize = rexW ? 8 : fullImm;
+            else if (op == 0xc2 || op == 0xca) immSize = 2;
+            else if (op == 0xc3 || op == 0xc9 || op == 0xcb || op == 0xcc || op == 0xcf) {}
+            else if (op == 0xc8) immSize = 3;
+            else if (op == 0xcd) immSize = 1;
+            else if ((op >= 0xd0 && op <= 0xd3) || (op >= 0xd8 && op <= 0xdf)) hasModrm = true;
+            else if (op == 0xd7) {}
+            else if (op >= 0xe0 && op <= 0xe3) { immSize = 1; insn.branch = Branch::Unrelocatable; }
+            else if (op >= 0xe4 && op <= 0xe7) immSize = 1;
+            else if (op == 0xe8) { immSize = 4; insn.branch = Branch::Call32; }
+            else if (op == 0xe9) { immSize = 4; insn.branch = Branch::Jmp32; }
+            else if (op == 0xeb) { immSize = 1; insn.branch = Branch::Jmp8; }
+            else if (op >= 0xec && op <= 0xef) {}
+            else if (op == 0xf4 || op == 0xf5 || (op >= 0xf8 && op <= 0xfd)) {}
+            else if (op == 0xf6 || op == 0xf7 || op == 0xfe || op == 0xff) hasModrm = true;
+            else return false;
+        }
+        else if (map == 1)
+        {
+            if (vex)
+                hasModrm = op != 0x77;
+            else if (op >= 0x80 && op <= 0x8f)
+            {
+                immSize = 4;
+                insn.branch = Branch::Jcc32;
+            }
+            else if (op == 0x0f)
+                return false;
+            else if (op == 0x05 || op == 0x06 || op == 0x07 || op == 0x08 || op == 0x09 || op == 0x0b
+                || (op >= 0x30 && op <= 0x37) || op == 0x77 || op == 0xa0 || op == 0xa1 || op == 0xa2
+                || op == 0xa8 || op == 0xa9 || op == 0xaa || (op >= 0xc8 && op <= 0xcf))
+                {}
+            else
+                hasModrm = true;
+
+            if ((op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac || op == 0xba
+                || op == 0xc2 || (op >= 0xc4 && op <= 0xc6))
+                immSize = 1;
+        }
+        else if (map == 2 || (vex && (map == 5 || map == 6)))
+            hasModrm = true;
+        else if (map == 3)
+        {
+            hasModrm = true;
+            immSize = 1;
+        }
+        else
+            return false;
+
+        if (hasModrm)
+        {
+            if (i >= avail)
+                return false;
+
+            auto modrm = pInsn[i++];
+            auto mod = modrm >> 6;
+            auto reg = (modrm >> 3) & 0x07;
+            auto rm = modrm & 0x07;
+            size_t dispSize = 0;
+            if (mod != 3)
+            {
+                if (rm == 4)
+                {
+                    if (i >= avail)
+                        return false;
+
+                    auto sib = pInsn[i++];
+                    if (mod == 0 && (sib & 0x07) == 5)
+                        dispSize = 4;
+                }
+                else if (mod == 0 && rm == 5)
+                {
+                    insn.ripDispOffset = i;
+                    dispSize = 4;
+                }
+
+                if (mod == 1)
+                    dispSize = 1;
+                else if (mod == 2)
+                    dispSize = 4;
+            }
+
+            i += dispSize;
+
+            // test takes an immediate, the rest of its group doesn't
+            if (map == 0 && (op == 0xf6 || op == 0xf7) && reg <= 1)
+                immSize = (op == 0xf6) ? 1 : fullImm;
+
+            // xbegin
+            if (map == 0 && op == 0xc7 && modrm == 0xf8)
+                insn.branch = Branch::Unrelocatable;
+        }
+
+        i += immSize;
+        if (i > avail)
+            return false;
+
+        insn.length = i;
+        return true;
+    }
+
+    /**
+     * @brief Where a relative branch at address goes to, its immediate is
+     *  always last
+     */
+    uintptr_t BranchTarget(uint8_t const* pInsn, uintptr_t address, DecodedInsn const& insn)
+    {
+        auto pEnd = pInsn + insn.length;
+        auto next = address + insn.length;
+        if (insn.branch == Branch::Jcc8 || insn.branch == Branch::Jmp8)
+            return next + static_cast<int8_t>(pEnd[-1]);
+
+        int32_t rel;
+        std::memcpy(&rel, pEnd - sizeof(rel), sizeof(rel));
+        return next + rel;
+    }
+
+    int32_t ToRel32(uintptr_t target, uintptr_t from)
+    {
+        auto offset = static_cast<std::ptrdiff_t>(target - from);
+        if (offset < std::numeric_limits<int32_t>::min() || offset > std::numeric_limits<int32_t>::max())
+            throw std::runtime_error("Relocated instruction out of range");
+
+        return static_cast<int32_t>(offset);
+    }
+
+    void AppendRel32(std::vector<uint8_t>& code, int32_t rel)
+    {
+        uint8_t bytes[sizeof(rel)];
+        std::memcpy(bytes, &rel, sizeof(rel));
+        code.insert(code.end(), bytes, bytes + sizeof(bytes));
+    }
+} // namespace
+
+    size_t GetInstructionLengthX64(uint8_t const* pInsn, uint8_t const* pEnd)
+    {
+        DecodedInsn insn;
+        return Decode(pInsn, pEnd, insn) ? insn.length : 0;
+    }
+
+    std::vector<uint8_t> RelocatePrologueX64(uint8_t const* code, size_t codeSize, uintptr_t fnStart,
+        size_t size, uintptr_t dest, size_t& displaced)
+    {
+        std::vector<uint8_t> relocated;
+        std::vector<uintptr_t> targets;
+        auto codeEnd = code + codeSize;
+        size_t offset = 0;
+        DecodedInsn insn;
+        while (offset < size)
+        {
+            auto pInsn = code + offset;
+            if (!Decode(pInsn, codeEnd, insn))
+                throw std::runtime_error("Cannot decode function prologue");
+
+            auto address = fnStart + offset;
+            auto newAddress = dest + relocated.size();
+            switch (insn.branch)
+            {
+            case Branch::None:
+                relocated.insert(relocated.end(), pInsn, pInsn + insn.length);
+                if (insn.ripDispOffset)
+                {
+                    // Relative to the end of the instruction, which is the
+                    // same length in its new place
+                    int32_t disp;
+                    std::memcpy(&disp, pInsn + insn.ripDispOffset, sizeof(disp));
+                    auto newDisp = ToRel32(address + insn.length + disp, newAddress + insn.length);
+                    std::memcpy(&relocated[relocated.size() - insn.length + insn.ripDispOffset], &newDisp, sizeof(newDisp));
+                }
+                break;
+            case Branch::Jmp8:
+            case Branch::Jmp32:
+            case Branch::Call32:
+            {
+                // Prefixes on a branch are only hints, drop them
+                auto target = BranchTarget(pInsn, address, insn);
+                targets.push_back(target);
+                relocated.push_back(insn.branch == Branch::Call32 ? 0xe8 : 0xe9);
+                AppendRel32(relocated, ToRel32(target, newAddress + 5));
+                break;
+            }
+            case Branch::Jcc8:
+            case Branch::Jcc32:
+            {
+                auto target = BranchTarget(pInsn, address, insn);
+                targets.push_back(target);
+                auto condition = pInsn[insn.opcodeOffset] & 0x0f;
+                relocated.push_back(0x0f);
+                relocated.push_back(static_cast<uint8_t>(0x80 | condition));
+                AppendRel32(relocated, ToRel32(target, newAddress + 6));
+                break;
+            }
+            case Branch::Unrelocatable:
+                throw std::runtime_error("Cannot relocate function prologue");
+            }
+
+            offset += insn.length;
+        }
+
+        displaced = offset;
+
+        // Once the branch to the stub is written nothing may land part way
+        // through the instructions it covers, whether from them or from the
+        // rest of the function. Only direct branches can be checked, and code
+        // the compiler split out of the function isn't seen at all
+        auto branchesIn = [&] (uintptr_t target) {
+            return target > fnStart && target < fnStart + displaced;
+        };
+
+        if (std::any_of(targets.begin(), targets.end(), branchesIn))
+            throw std::runtime_error("Function branches into its own prologue");
+
+        for (; offset < codeSize; offset += insn.length)
+        {
+            if (!Decode(code + offset, codeEnd, insn))
+                throw std::runtime_error("Cannot decode function");
+
+            if (insn.branch != Branch::None && branchesIn(BranchTarget(code + offset, fnStart + offset, insn)))
+                throw std::runtime_error("Function branches into its own prologue");
+        }
+
+        return relocated;
+    }
+} // namespace eforce
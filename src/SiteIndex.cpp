@@ -0,0 +1,189 @@
+#include <priv/SiteIndex.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    bool IsTypeEnd(char c)
+    {
+        return !c || c == '(';
+    }
+
+    /**
+     * @brief Compares the exception types at the start of two stringized
+     *  exception constructors, i.e. the part before the '('. Also works for
+     *  plain type names
+     */
+    int CompareType(char const* a, char const* b)
+    {
+        for (; !IsTypeEnd(*a) && !IsTypeEnd(*b); ++a, ++b)
+        {
+            if (*a != *b)
+                return static_cast<unsigned char>(*a) < static_cast<unsigned char>(*b) ? -1 : 1;
+        }
+
+        return IsTypeEnd(*b) - IsTypeEnd(*a);
+    }
+
+    /**
+     * @brief Adapts a three way compare of a site against a key into the
+     *  less than comparisons the std algorithms want, in both directions
+     */
+    template <typename Key, typename CompareFn>
+    struct SiteLess
+    {
+        std::vector<ExceptionInfo> const& sites;
+        CompareFn compare;
+
+        bool operator()(uint32_t idx, Key const& key) const { return compare(sites[idx], key) < 0; }
+        bool operator()(Key const& key, uint32_t idx) const { return compare(sites[idx], key) > 0; }
+    };
+
+    template <typename Key, typename CompareFn>
+    SiteLess<Key, CompareFn> MakeSiteLess(std::vector<ExceptionInfo> const& sites, CompareFn compare)
+    {
+        return SiteLess<Key, CompareFn>{sites, compare};
+    }
+
+    struct FileLine
+    {
+        char const* file;
+        int line;
+    };
+
+    int CompareFileLine(ExceptionInfo const& info, FileLine const& key)
+    {
+        auto fileCmp = std::strcmp(info.file, key.file);
+        if (fileCmp != 0)
+            return fileCmp;
+
+        return (info.line > key.line) - (info.line < key.line);
+    }
+
+    int CompareFunction(ExceptionInfo const& info, char const* name)
+    {
+        return std::strcmp(info.parentFn.name, name);
+    }
+
+    int CompareSiteType(ExceptionInfo const& info, char const* type)
+    {
+        return CompareType(info.exceptionStr, type);
+    }
+
+    size_t HashAddr(void* addr)
+    {
+        // Code addresses share their high bits and are often aligned, mix
+        // everything down so the low bits we mask with are useful
+        auto x = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(addr));
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccd;
+        x ^= x >> 33;
+        return static_cast<size_t>(x);
+    }
+
+    std::vector<uint32_t> MakeIndex(size_t count)
+    {
+        std::vector<uint32_t> index(count);
+        for (size_t i = 0; i < count; ++i)
+            index[i] = static_cast<uint32_t>(i);
+        return index;
+    }
+} // namespace
+
+    SiteIndex::SiteIndex(std::vector<ExceptionInfo> sites)
+        : m_sites(std::move(sites))
+        , m_byFile(MakeIndex(m_sites.size()))
+        , m_byFunction(m_byFile)
+        , m_byType(m_byFile)
+    {
+        auto const& s = m_sites;
+        std::sort(m_byFile.begin(), m_byFile.end(), [&] (uint32_t a, uint32_t b) {
+            return CompareFileLine(s[a], FileLine{s[b].file, s[b].line}) < 0;
+        });
+
+        std::sort(m_byFunction.begin(), m_byFunction.end(), [&] (uint32_t a, uint32_t b) {
+            return CompareFunction(s[a], s[b].parentFn.name) < 0;
+        });
+
+        std::sort(m_byType.begin(), m_byType.end(), [&] (uint32_t a, uint32_t b) {
+            return CompareType(s[a].exceptionStr, s[b].exceptionStr) < 0;
+        });
+
+        // Keep the load factor at or below 1/2 so probe sequences stay short
+        size_t slotCount = 2;
+        while (slotCount < 2 * m_sites.size())
+            slotCount *= 2;
+
+        m_addrSlots.resize(slotCount, nullptr);
+        m_addrSiteIdx.resize(slotCount, 0);
+        for (size_t i = 0; i < m_sites.size(); ++i)
+        {
+            auto addr = m_sites[i].addr;
+            auto slot = HashAddr(addr) & (slotCount - 1);
+            while (m_addrSlots[slot] && m_addrSlots[slot] != addr)
+                slot = (slot + 1) & (slotCount - 1);
+
+            if (m_addrSlots[slot])
+                continue;
+
+            m_addrSlots[slot] = addr;
+            m_addrSiteIdx[slot] = static_cast<uint32_t>(i);
+        }
+    }
+
+    constexpr size_t SiteIndex::npos;
+
+    std::vector<ExceptionInfo> const& SiteIndex::Sites() const
+    {
+        return m_sites;
+    }
+
+    size_t SiteIndex::Find(void* addr) const
+    {
+        if (!addr)
+            return npos;
+
+        auto mask = m_addrSlots.size() - 1;
+        for (auto slot = HashAddr(addr) & mask; m_addrSlots[slot]; slot = (slot + 1) & mask)
+        {
+            if (m_addrSlots[slot] == addr)
+                return m_addrSiteIdx[slot];
+        }
+
+        return npos;
+    }
+
+    void SiteIndex::VisitFile(char const* file, int firstLine, int lastLine, ExceptionVisitor const& visitor) const
+    {
+        auto less = MakeSiteLess<FileLine>(m_sites, &CompareFileLine);
+        auto begin = std::lower_bound(m_byFile.data(), m_byFile.data() + m_byFile.size(), FileLine{file, firstLine}, less);
+        auto end = std::upper_bound(begin, m_byFile.data() + m_byFile.size(), FileLine{file, lastLine}, less);
+
+        for (auto it = begin; it < end; ++it)
+            visitor(m_sites[*it]);
+    }
+
+    void SiteIndex::VisitFunction(char const* name, ExceptionVisitor const& visitor) const
+    {
+        auto range = std::equal_range(m_byFunction.data(), m_byFunction.data() + m_byFunction.size(), name,
+            MakeSiteLess<char const*>(m_sites, &CompareFunction));
+
+        for (auto it = range.first; it != range.second; ++it)
+            visitor(m_sites[*it]);
+    }
+
+    void SiteIndex::VisitType(char const* type, ExceptionVisitor const& visitor) const
+    {
+        auto range = std::equal_range(m_byType.data(), m_byType.data() + m_byType.size(), type,
+            MakeSiteLess<char const*>(m_sites, &CompareSiteType));
+
+        for (auto it = range.first; it != range.second; ++it)
+            visitor(m_sites[*it]);
+    }
+} // namespace eforce
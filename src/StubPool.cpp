@@ -0,0 +1,195 @@
+#include <priv/StubPool.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined(MAP_FIXED_NOREPLACE)
+    // Older headers, kernels before 4.17 ignore it and treat the address as a
+    // hint, which we check for anyway
+    #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace eforce
+{
+namespace
+{
+    constexpr size_t k_chunkSize = 64 * 1024;
+
+    /// Never map below here, the kernel refuses the first pages anyway
+    constexpr uintptr_t k_minAddress = 1024 * 1024;
+
+    /// End of the user address space, where the gap after the last mapping
+    /// ends. Kernels can be configured with more, we just don't use it
+#if defined(__x86_64__)
+    constexpr uintptr_t k_maxAddress = uintptr_t(1) << 47;
+#elif defined(__aarch64__)
+    constexpr uintptr_t k_maxAddress = uintptr_t(1) << 48;
+#else
+    constexpr uintptr_t k_maxAddress = 0xc0000000;
+#endif
+
+    /// Gaps we try before giving up, most fail only if something else maps
+    /// the gap between us reading the maps and mapping it
+    constexpr size_t k_maxMapAttempts = 16;
+
+    /// A range of the address space, [start, end)
+    struct AddressRange
+    {
+        uintptr_t start;
+        uintptr_t end;
+    };
+
+    /**
+     * @brief Whether every byte in [start, start + size) is within range of near
+     */
+    bool InRange(uintptr_t start, size_t size, uintptr_t near, size_t range)
+    {
+        auto end = start + size;
+        auto farthest = std::max(start > near ? start - near : near - start, end > near ? end - near : near - end);
+        return farthest <= range;
+    }
+
+    /**
+     * @brief Reads the ranges of every mapping in the process, in address order
+     */
+    std::vector<AddressRange> ReadMappings()
+    {
+        std::vector<AddressRange> mappings;
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        while (std::getline(maps, line))
+        {
+            auto dash = line.find('-');
+            if (dash == std::string::npos)
+                continue;
+
+            auto start = std::stoull(line.substr(0, dash), nullptr, 16);
+            auto end = std::stoull(line.substr(dash + 1), nullptr, 16);
+            mappings.push_back(AddressRange{static_cast<uintptr_t>(start), static_cast<uintptr_t>(end)});
+        }
+
+        return mappings;
+    }
+} // namespace
+
+    constexpr std::chrono::milliseconds StubPool::k_quiescentPeriod;
+
+    StubPool& StubPool::Get()
+    {
+        static auto* s_pPool = new StubPool;
+        return *s_pPool;
+    }
+
+    uint8_t* StubPool::Allocate(void* near, size_t range, size_t size)
+    {
+        if (size == 0 || size % k_slotSize != 0 || size > k_chunkSize)
+            throw std::logic_error("Invalid stub slot size");
+
+        auto nearAddr = reinterpret_cast<uintptr_t>(near);
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Slots are queued in the order they were freed, so once one is too
+        // recent so is every one after it
+        auto reusableBefore = std::chrono::steady_clock::now() - k_quiescentPeriod;
+        for (auto freed = m_freeSlots.begin(); freed != m_freeSlots.end() && freed->freedAt <= reusableBefore; ++freed)
+        {
+            if (freed->size == size && InRange(reinterpret_cast<uintptr_t>(freed->pSlot), size, nearAddr, range))
+            {
+                auto pSlot = freed->pSlot;
+                m_freeSlots.erase(freed);
+                return pSlot;
+            }
+        }
+
+        for (auto& chunk : m_chunks)
+        {
+            if (k_chunkSize - chunk.used < size)
+                continue;
+
+            auto pSlot = chunk.start + chunk.used;
+            if (InRange(reinterpret_cast<uintptr_t>(pSlot), size, nearAddr, range))
+            {
+                chunk.used += size;
+                return pSlot;
+            }
+        }
+
+        auto pChunk = MapChunkNear(nearAddr, range);
+        if (!pChunk)
+            return nullptr;
+
+        // The whole chunk is in range of near, later functions close by
+        // will fill the rest of it
+        m_chunks.push_back(Chunk{pChunk, size});
+        return pChunk;
+    }
+
+    void StubPool::Free(uint8_t* pSlot, size_t size)
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_freeSlots.push_back(FreeSlot{pSlot, size, now});
+    }
+
+    uint8_t* StubPool::MapChunkNear(uintptr_t near, size_t range)
+    {
+        static auto const s_pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+        // Find the spot in each gap closest to near, then try the closest
+        // spots first
+        std::vector<uintptr_t> candidates;
+        auto addGap = [&] (uintptr_t gapStart, uintptr_t gapEnd) {
+            if (gapEnd > gapStart && gapEnd - gapStart >= k_chunkSize)
+            {
+                auto candidate = std::min(std::max(near, gapStart), gapEnd - k_chunkSize) & ~(s_pageSize - 1);
+                if (candidate >= gapStart && InRange(candidate, k_chunkSize, near, range))
+                    candidates.push_back(candidate);
+            }
+        };
+
+        uintptr_t gapStart = k_minAddress;
+        for (auto const& mapping : ReadMappings())
+        {
+            addGap(gapStart, mapping.start);
+            gapStart = std::max(gapStart, mapping.end);
+        }
+
+        // Code mapped near the top of the address space may only have room
+        // after it
+        addGap(gapStart, k_maxAddress);
+
+        std::sort(candidates.begin(), candidates.end(), [&] (uintptr_t a, uintptr_t b) {
+            return (a > near ? a - near : near - a) < (b > near ? b - near : near - b);
+        });
+
+        if (candidates.size() > k_maxMapAttempts)
+            candidates.resize(k_maxMapAttempts);
+
+        for (auto candidate : candidates)
+        {
+            auto pChunk = mmap(reinterpret_cast<void*>(candidate), k_chunkSize, PROT_READ | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+            if (pChunk == MAP_FAILED)
+                continue;
+
+            if (reinterpret_cast<uintptr_t>(pChunk) != candidate)
+            {
+                munmap(pChunk, k_chunkSize);
+                continue;
+            }
+
+            return static_cast<uint8_t*>(pChunk);
+        }
+
+        return nullptr;
+    }
+} // namespace eforce
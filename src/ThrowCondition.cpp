@@ -0,0 +1,371 @@
+#include <eforce/ThrowCondition.h>
+
+#include <priv/Random.h>
+
+#include <sched.h>
+#include <time.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace eforce
+{
+namespace
+{
+    /**
+     * @brief Counts calls of a schedule on the calling thread. Every live
+     *  schedule has its own slot in a per thread table, so counting is a
+     *  TLS load and an increment. Slots go back to be reused once every
+     *  copy of the schedule is gone, so the tables only grow with the
+     *  number of schedules alive at once
+     */
+    class CallCounter
+    {
+    public:
+        CallCounter()
+            : m_pSlot(std::make_shared<Slot>())
+            , m_index(m_pSlot->index)
+            , m_generation(m_pSlot->generation)
+        {}
+
+        /**
+         * @return the number of calls on this thread so far, this one
+         *  included
+         */
+        uint64_t Next() const
+        {
+            // A thread may still have the count of a schedule that had the
+            // slot before us, which the generation tells apart
+            static thread_local std::vector<Count> s_counts;
+            if (m_index >= s_counts.size())
+                s_counts.resize(m_index + 1);
+
+            auto& count = s_counts[m_index];
+            if (count.generation != m_generation)
+                count = Count{m_generation, 0};
+
+            return ++count.calls;
+        }
+
+    private:
+        /// Resizing the table zeroes new counts, generation 0 is no schedule
+        struct Count
+        {
+            uint64_t generation;
+            uint64_t calls;
+        };
+
+        /**
+         * @brief Free slot indices. Leaked, schedules held by other
+         *  statics may be destroyed after it otherwise would be
+         */
+        struct FreeSlots
+        {
+            std::mutex mutex;
+            std::vector<size_t> indices;
+            size_t next = 0;
+            uint64_t generation = 0;
+
+            static FreeSlots& Get()
+            {
+                static auto* s_pFreeSlots = new FreeSlots;
+                return *s_pFreeSlots;
+            }
+        };
+
+        /// Shared by every copy of the schedule, frees the slot with the last
+        struct Slot
+        {
+            Slot()
+            {
+                auto& freeSlots = FreeSlots::Get();
+                std::lock_guard<std::mutex> lock(freeSlots.mutex);
+                if (freeSlots.indices.empty())
+                {
+                    index = freeSlots.next++;
+                }
+                else
+                {
+                    index = freeSlots.indices.back();
+                    freeSlots.indices.pop_back();
+                }
+
+                generation = ++freeSlots.generation;
+            }
+
+            ~Slot()
+            {
+                auto& freeSlots = FreeSlots::Get();
+                std::lock_guard<std::mutex> lock(freeSlots.mutex);
+                freeSlots.indices.push_back(index);
+            }
+
+            Slot(Slot const& other) = delete;
+            Slot& operator=(Slot const& other) = delete;
+
+            size_t index;
+            uint64_t generation;
+        };
+
+        std::shared_ptr<Slot> m_pSlot;
+        /// Copies of m_pSlot's fields, so counting doesn't follow the pointer
+        size_t m_index;
+        uint64_t m_generation;
+    };
+
+    /**
+     * @brief Reads CLOCK_MONOTONIC_COARSE, which the vDSO serves without a
+     *  syscall
+     */
+    int64_t CoarseNowNs()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    /**
+     * @brief Token bucket shared by every thread running a RateLimited
+     *  condition. Rather than a token count that would need refilling, we
+     *  keep the time the bucket would have its last token back (the
+     *  generic cell rate algorithm), so taking a token is one CAS
+     */
+    class TokenBucket
+    {
+    public:
+        /**
+         * @param[in] tokensPerSecond Must be positive, rates too small to
+         *  represent are treated as one token every k_maxInterval
+         */
+        TokenBucket(double tokensPerSecond, uint64_t capacity)
+            : m_interval(IntervalNs(tokensPerSecond))
+        {
+            // A coarse clock tick can pass between two reads, the bucket
+            // has to hold the tokens that arrive in it or they're lost
+            timespec res;
+            clock_getres(CLOCK_MONOTONIC_COARSE, &res);
+            auto tick = static_cast<int64_t>(res.tv_sec) * 1000000000 + res.tv_nsec;
+
+            // Every product and sum in TryTake stays well inside an int64_t
+            auto burst = std::min<uint64_t>(capacity - 1, k_maxInterval / m_interval);
+            m_tolerance = std::max<int64_t>(static_cast<int64_t>(burst) * m_interval, tick);
+        }
+
+        bool TryTake()
+        {
+            auto now = CoarseNowNs();
+            auto fullAt = m_fullAt.load(std::memory_order_relaxed);
+            int64_t next;
+            do
+            {
+                if (fullAt - m_tolerance > now)
+                    return false;
+
+                next = std::max(fullAt, now) + m_interval;
+            } while (!m_fullAt.compare_exchange_weak(fullAt, next, std::memory_order_relaxed));
+
+            return true;
+        }
+
+    private:
+        /// Longest interval and tolerance we keep, about 146 years
+        static constexpr int64_t k_maxInterval = std::numeric_limits<int64_t>::max() / 4;
+
+        static int64_t IntervalNs(double tokensPerSecond)
+        {
+            // Clamp in double, converting a value out of int64_t's range is
+            // undefined
+            auto interval = 1e9 / tokensPerSecond;
+            if (interval >= static_cast<double>(k_maxInterval))
+                return k_maxInterval;
+
+            return std::max<int64_t>(1, static_cast<int64_t>(interval));
+        }
+
+        /// Time a single token takes to come back, in ns
+        int64_t m_interval;
+        /// How far ahead of now m_fullAt may be for a token to be left
+        int64_t m_tolerance;
+        /// Starts at 0 so the bucket starts full
+        std::atomic<int64_t> m_fullAt{0};
+    };
+
+    /// Id of the token the calling thread is enabled for, 0 for none
+    thread_local uint64_t s_enabledToken = 0;
+
+    /// Starts after the process wide token's id
+    std::atomic<uint64_t> s_nextEnableToken{2};
+
+    /**
+     * @brief Gets the cpu the calling thread is running on, or -1 if we
+     *  can't tell
+     */
+    int CurrentCpu()
+    {
+    #if defined(RSEQ_SIG)
+        // glibc registers an rseq area for every thread unless it's turned
+        // off, and the kernel keeps its cpu_id up to date, so this is a
+        // plain load from thread local storage
+        if (__rseq_size)
+        {
+            auto pRseq = reinterpret_cast<struct rseq const volatile*>(
+                static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+            auto cpu = static_cast<int>(pRseq->cpu_id);
+            if (cpu >= 0)
+                return cpu;
+        }
+    #endif
+        return sched_getcpu();
+    }
+} // namespace
+
+    ThrowCondition WithProbability(double probability)
+    {
+        if (!(probability >= 0.0 && probability <= 1.0))
+            throw std::invalid_argument("Probability must be between 0 and 1");
+
+        if (probability == 0.0)
+            return [] { return false; };
+
+        if (probability == 1.0)
+            return [] { return true; };
+
+        // Compare against a precomputed threshold so a draw is an integer
+        // compare
+        auto threshold = ProbabilityThreshold(probability);
+        return [threshold] { return NextRandom() < threshold; };
+    }
+
+    ThrowCondition OnNthCall(uint64_t n)
+    {
+        CallCounter counter;
+        return [counter, n] { return counter.Next() == n; };
+    }
+
+    ThrowCondition EveryNthCall(uint64_t n)
+    {
+        if (n == 0)
+            throw std::invalid_argument("Call interval must be non zero");
+
+        CallCounter counter;
+        return [counter, n] { return counter.Next() % n == 0; };
+    }
+
+    ThrowCondition FirstCalls(uint64_t count)
+    {
+        CallCounter counter;
+        return [counter, count] { return counter.Next() <= count; };
+    }
+
+    ThrowCondition RateLimited(double throwsPerSecond, ThrowCondition condition, uint64_t burst)
+    {
+        if (!(throwsPerSecond > 0.0))
+            throw std::invalid_argument("Rate must be positive");
+
+        if (burst == 0)
+            throw std::invalid_argument("Burst must be non zero");
+
+        auto pBucket = std::make_shared<TokenBucket>(throwsPerSecond, burst);
+        return [pBucket, condition] {
+            if (condition && !condition())
+                return false;
+
+            return pBucket->TryTake();
+        };
+    }
+
+    EnableToken EnableToken::New()
+    {
+        return EnableToken(s_nextEnableToken.fetch_add(1, std::memory_order_relaxed));
+    }
+
+    void EnableForThisThread(EnableToken token)
+    {
+        s_enabledToken = token.m_id;
+    }
+
+    void DisableForThisThread()
+    {
+        s_enabledToken = 0;
+    }
+
+    ThrowCondition OnEnabledThreads(EnableToken token, ThrowCondition condition)
+    {
+        auto id = token.m_id;
+        return [id, condition] {
+            if (s_enabledToken != id)
+                return false;
+
+            return !condition || condition();
+        };
+    }
+
+    ThrowCondition OnEnabledThreads(ThrowCondition condition)
+    {
+        return OnEnabledThreads(EnableToken(), std::move(condition));
+    }
+
+    ThrowCondition OnCpus(std::vector<unsigned> const& cpus, ThrowCondition condition)
+    {
+        // A bitmap of the cpus, so checking one is a shift and a mask
+        std::vector<uint64_t> cpuMask;
+        for (auto cpu : cpus)
+        {
+            if (cpu / 64 >= cpuMask.size())
+                cpuMask.resize(cpu / 64 + 1);
+            cpuMask[cpu / 64] |= uint64_t(1) << (cpu % 64);
+        }
+
+        return [cpuMask, condition] {
+            auto cpu = CurrentCpu();
+            if (cpu < 0 || static_cast<size_t>(cpu) / 64 >= cpuMask.size()
+                || !(cpuMask[cpu / 64] & (uint64_t(1) << (cpu % 64))))
+                return false;
+
+            return !condition || condition();
+        };
+    }
+
+    ThrowCondition Until(std::chrono::steady_clock::time_point deadline, ThrowCondition condition)
+    {
+        // The steady clock is CLOCK_MONOTONIC on linux, which the coarse
+        // clock shares its epoch with
+        struct Expiry
+        {
+            int64_t deadline;
+            std::atomic<bool> expired{false};
+        };
+
+        auto pExpiry = std::make_shared<Expiry>();
+        pExpiry->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+
+        return [pExpiry, condition] {
+            // Once expired we stay that way without reading the clock
+            if (pExpiry->expired.load(std::memory_order_relaxed))
+                return false;
+
+            if (CoarseNowNs() >= pExpiry->deadline)
+            {
+                pExpiry->expired.store(true, std::memory_order_relaxed);
+                return false;
+            }
+
+            return !condition || condition();
+        };
+    }
+} // namespace eforce
@@ -1,16 +1,114 @@
 #include <eforce/Exception.h>
 #include <eforce/ExceptionForcer.h>
+#include <eforce/FaultContext.h>
+
+#include <priv/CodeWriter.h>
+#include <priv/Elf.h>
+#include <priv/ProgOffsetResolver.h>
+#include <priv/StubPool.h>
 
 #include <catch.hpp>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
 #include <exception>
+#include <functional>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+/**
+ * @brief Sets an environment variable, and puts back what it was before
+ */
+class ScopedEnv
+{
+public:
+    ScopedEnv(char const* name, char const* value)
+        : m_name(name)
+    {
+        if (char const* previous = getenv(name))
+        {
+            m_hadValue = true;
+            m_previous = previous;
+        }
+
+        Set(value);
+    }
+
+    ~ScopedEnv()
+    {
+        Set(m_hadValue ? m_previous.c_str() : nullptr);
+    }
+
+    ScopedEnv(ScopedEnv const& other) = delete;
+    ScopedEnv& operator=(ScopedEnv const& other) = delete;
+
+    /// Sets the variable, or unsets it if value is null
+    void Set(char const* value)
+    {
+        if (value)
+            setenv(m_name.c_str(), value, 1);
+        else
+            unsetenv(m_name.c_str());
+    }
+
+private:
+    std::string m_name;
+    bool m_hadValue = false;
+    std::string m_previous;
+};
+
+/**
+ * @brief Removes a directory and the files in it
+ */
+void RemoveDir(char const* path)
+{
+    if (DIR* dir = opendir(path))
+    {
+        while (dirent* entry = readdir(dir))
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+/**
+ * @brief Gives every ExceptionForcer in the tests an index cache of its own,
+ *  so running them leaves nothing behind in the user's cache
+ */
+struct TestIndexCache
+{
+    TestIndexCache()
+        : env("EFORCE_INDEX_CACHE_DIR", mkdtemp(dir) ? dir : "")
+    {}
+
+    ~TestIndexCache()
+    {
+        RemoveDir(dir);
+    }
+
+    char dir[32] = "/tmp/eforce_test_XXXXXX";
+    ScopedEnv env;
+};
+
+static TestIndexCache s_testIndexCache;
+
 struct BigStruct
 {
     std::array<int, 100> arr{};
@@ -84,6 +182,122 @@ void ThrowMyExceptionIfNonZero(int x)
         THROW_REGISTERED_EXCEPTION(MyException, "My exception");
 }
 
+EFORCE_PATCHABLE void ThrowIfNonZeroPadded(int x)
+{
+    if (x)
+        THROW_REGISTERED_EXCEPTION(std::runtime_error, "Padded");
+}
+
+EFORCE_PATCHABLE int DoubleIfPositivePadded(int x)
+{
+    if (x <= 0)
+        THROW_REGISTERED_EXCEPTION(std::invalid_argument, "Padded");
+    return 2 * x;
+}
+
+void ThrowIfOutOfRange(int x)
+{
+    if (x < 0)
+        THROW_REGISTERED_EXCEPTION(std::out_of_range, "Below");
+    if (x > 100)
+        THROW_REGISTERED_EXCEPTION(std::length_error, "Above");
+}
+
+void ThrowIfNegativeGuarded(int x)
+{
+    THROW_REGISTERED_EXCEPTION_IF(x < 0, std::runtime_error, std::to_string(x));
+}
+
+void ThrowIfNegativeFlagGuarded(int x)
+{
+    THROW_REGISTERED_EXCEPTION_IF_FLAGGED(x < 0, std::runtime_error, std::to_string(x));
+}
+
+double ScaleIfPositive(double x, int factor)
+{
+    if (factor <= 0)
+        THROW_REGISTERED_EXCEPTION(std::invalid_argument, "factor");
+    return x * factor;
+}
+
+double AddIfPositive(double x, int offset)
+{
+    if (offset <= 0)
+        THROW_REGISTERED_EXCEPTION(std::invalid_argument, "offset");
+    return x + offset;
+}
+
+// Callers of ScaleIfPositive for caller filters. They keep their frame
+// pointers so the outer caller can be found through them, and do something
+// after the call so it isn't a tail call
+__attribute__((noinline, optimize("no-omit-frame-pointer"))) double ScaleFromFirstCaller(double x)
+{
+    return ScaleIfPositive(x, 1) + 1;
+}
+
+__attribute__((noinline, optimize("no-omit-frame-pointer"))) double ScaleFromSecondCaller(double x)
+{
+    return ScaleIfPositive(x, 1) + 2;
+}
+
+__attribute__((noinline)) double ScaleThroughFirstCaller(double x)
+{
+    return ScaleFromFirstCaller(x) + 1;
+}
+
+struct WriteFailures
+{
+    /// Patches written before the next write fails
+    size_t patchesBeforeFailure = 0;
+    /// Writes left to fail
+    int failures = 0;
+    /// Where each patch that was written went
+    std::vector<uint8_t*> written;
+};
+
+// Writes one patch at a time through mprotect, and fails when told to
+class FailingCodeWriter
+    : public eforce::ICodeWriter
+{
+public:
+    explicit FailingCodeWriter(WriteFailures& failures)
+        : m_failures(failures)
+    {}
+
+    void Write(std::vector<eforce::CodePatch> const& patches) override
+    {
+        for (auto const& patch : patches)
+        {
+            if (m_failures.failures > 0 && m_failures.patchesBeforeFailure-- == 0)
+            {
+                --m_failures.failures;
+                m_failures.patchesBeforeFailure = 0;
+                throw std::runtime_error("Write failed");
+            }
+
+            m_writer.Write({patch});
+            m_failures.written.push_back(patch.dest);
+        }
+    }
+
+private:
+    WriteFailures& m_failures;
+    eforce::MprotectCodeWriter m_writer;
+};
+
+struct ScopedCodeWriterFactory
+{
+    explicit ScopedCodeWriterFactory(std::function<std::unique_ptr<eforce::ICodeWriter>()> factory)
+    {
+        eforce::SetCodeWriterFactory(std::move(factory));
+    }
+
+    ~ScopedCodeWriterFactory()
+    {
+        eforce::SetCodeWriterFactory(nullptr);
+    }
+};
+
 class ExceptionForcerFixture
 {
 protected:
@@ -189,3 +403,1022 @@ TEST_CASE_METHOD(ExceptionForcerFixture, "Can throw from in a template")
     REQUIRE_THROWS_AS(ThrowInATemplate<long>(0), std::runtime_error);
     exceptionForcer.UnforceException(exceptionToForce.addr);
 }
+
+TEST_CASE("Function index cache matches the symbol table")
+{
+    struct Function
+    {
+        std::string name;
+        void* start;
+        void* end;
+    };
+
+    ScopedEnv cacheDirEnv("EFORCE_INDEX_CACHE_DIR", "");
+    auto getFunctions = [&] (char const* cacheDir) {
+        cacheDirEnv.Set(cacheDir);
+        eforce::ExceptionForcer exceptionForcer;
+        std::vector<Function> ret;
+        for (auto const& info : exceptionForcer.GetExceptions())
+            ret.push_back(Function{info.parentFn.name, info.parentFn.start, info.parentFn.end});
+        return ret;
+    };
+
+    char cacheDir[] = "/tmp/eforce_test_XXXXXX";
+    REQUIRE(mkdtemp(cacheDir) != nullptr);
+
+    auto uncached = getFunctions("");
+    auto cacheMiss = getFunctions(cacheDir);
+    auto cacheHit = getFunctions(cacheDir);
+    RemoveDir(cacheDir);
+
+    REQUIRE(uncached.size() == cacheMiss.size());
+    REQUIRE(uncached.size() == cacheHit.size());
+    for (size_t i = 0; i < uncached.size(); ++i)
+    {
+        REQUIRE(uncached[i].name == cacheMiss[i].name);
+        REQUIRE(uncached[i].name == cacheHit[i].name);
+        REQUIRE(uncached[i].start == cacheHit[i].start);
+        REQUIRE(uncached[i].end == cacheHit[i].end);
+    }
+}
+
+TEST_CASE("Function index cache removes the least recently used indexes")
+{
+    char cacheDir[] = "/tmp/eforce_test_XXXXXX";
+    REQUIRE(mkdtemp(cacheDir) != nullptr);
+
+    // Sparse stand ins for indexes of other binaries, which together are
+    // over the cache's size limit
+    auto addIndex = [&] (char const* name, time_t age) {
+        auto path = std::string(cacheDir) + "/" + name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool created = fd >= 0 && ftruncate(fd, 100 << 20) == 0;
+        timespec times[2] = {{time(nullptr) - age, 0}, {time(nullptr) - age, 0}};
+        created = created && futimens(fd, times) == 0;
+        if (fd >= 0)
+            close(fd);
+        return created;
+    };
+    REQUIRE(addIndex("older.idx", 200));
+    REQUIRE(addIndex("old.idx", 100));
+
+    {
+        ScopedEnv cacheDirEnv("EFORCE_INDEX_CACHE_DIR", cacheDir);
+        eforce::ExceptionForcer exceptionForcer;
+        exceptionForcer.GetExceptions();
+    }
+
+    auto exists = [&] (char const* name) {
+        return access((std::string(cacheDir) + "/" + name).c_str(), F_OK) == 0;
+    };
+    bool olderKept = exists("older.idx");
+    bool oldKept = exists("old.idx");
+    RemoveDir(cacheDir);
+
+    REQUIRE_FALSE(olderKept);
+    REQUIRE(oldKept);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Functions are found for a batch of offsets on several threads")
+{
+    eforce::Elf elf("/proc/self/exe");
+    eforce::ProgOffsetResolver offsetResolver;
+
+    // The first and last bytes of a few functions, and the byte after them.
+    // Thirteen offsets over 4 threads put the chunk boundaries inside
+    // functions
+    std::vector<void*> offsets;
+    for (auto name : {"ThrowIfNonZero(int)", "ScaleIfPositive(double, int)", "AddIfPositive(double, int)"})
+    {
+        auto const& function = GetExceptionInfoByFnName(name).parentFn;
+        offsets.push_back(offsetResolver.ToOffset(function.start));
+        offsets.push_back(offsetResolver.ToOffset(static_cast<char*>(function.end) - 1));
+        offsets.push_back(offsetResolver.ToOffset(function.end));
+        offsets.push_back(offsetResolver.ToOffset(function.start));
+    }
+    offsets.push_back(offsets.front());
+    REQUIRE(offsets.size() == 13);
+
+    for (size_t threadCount : {1, 4, 64})
+    {
+        auto functions = elf.GetContainingFunctions(offsets, threadCount);
+        REQUIRE(functions.size() == offsets.size());
+        for (size_t i = 0; i < offsets.size(); ++i)
+        {
+            auto expected = elf.GetContainingFunction(offsets[i]);
+            REQUIRE(functions[i].startOffset == expected.startOffset);
+            REQUIRE(functions[i].endOffset == expected.endOffset);
+            REQUIRE(std::string(functions[i].name) == expected.name);
+        }
+    }
+
+    // An offset before every function fails the whole batch, whichever
+    // thread looks it up
+    offsets.push_back(nullptr);
+    REQUIRE_THROWS_AS(elf.GetContainingFunction(offsets.back()), std::runtime_error);
+    REQUIRE_THROWS_AS(elf.GetContainingFunctions(offsets, 4), std::runtime_error);
+    REQUIRE_THROWS_AS(elf.GetContainingFunctions(offsets, 1), std::runtime_error);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be queried without a full scan")
+{
+    auto collectVisited = [&] (std::function<void(eforce::ExceptionVisitor)> const& visit) {
+        std::vector<void*> visited;
+        visit([&] (eforce::ExceptionInfo const& info) { visited.push_back(info.addr); });
+        return visited;
+    };
+
+    auto all = collectVisited([&] (eforce::ExceptionVisitor visitor) { exceptionForcer.VisitExceptions(visitor); });
+    REQUIRE(all.size() == exceptions.size());
+
+    auto inThisFile = std::count_if(exceptions.begin(), exceptions.end(), [] (eforce::ExceptionInfo const& info) {
+        return std::string(info.file) == __FILE__;
+    });
+    auto inFile = collectVisited([&] (eforce::ExceptionVisitor visitor) { exceptionForcer.VisitExceptionsInFile(__FILE__, visitor); });
+    REQUIRE(inFile.size() == static_cast<size_t>(inThisFile));
+
+    auto const& throwIfNonZero = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+    auto inLine = collectVisited([&] (eforce::ExceptionVisitor visitor) {
+        exceptionForcer.VisitExceptionsInFile(__FILE__, throwIfNonZero.line, throwIfNonZero.line, visitor);
+    });
+    REQUIRE(inLine == std::vector<void*>{throwIfNonZero.addr});
+
+    auto inFunction = collectVisited([&] (eforce::ExceptionVisitor visitor) {
+        exceptionForcer.VisitExceptionsInFunction("ThrowIfNonZero(int)", visitor);
+    });
+    REQUIRE(inFunction == std::vector<void*>{throwIfNonZero.addr});
+
+    auto ofType = collectVisited([&] (eforce::ExceptionVisitor visitor) { exceptionForcer.VisitExceptionsOfType("MyException", visitor); });
+    REQUIRE(ofType == std::vector<void*>{GetExceptionInfoByFnName("ThrowMyExceptionIfNonZero(int)").addr});
+
+    auto ofMissingType = collectVisited([&] (eforce::ExceptionVisitor visitor) { exceptionForcer.VisitExceptionsOfType("MyExcept", visitor); });
+    REQUIRE(ofMissingType.empty());
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Forcing an already forced exception replaces it")
+{
+    auto exceptionToForce = GetExceptionInfoByFnName("ThrowWithNonConstexprInputIfNonZero(int)");
+    exceptionForcer.ForceException(exceptionToForce.addr, std::make_exception_ptr(std::runtime_error("First")));
+    exceptionForcer.ForceException(exceptionToForce.addr, std::make_exception_ptr(std::logic_error("Second")));
+    REQUIRE_THROWS_AS(ThrowWithNonConstexprInputIfNonZero(0), std::logic_error);
+
+    exceptionForcer.UnforceException(exceptionToForce.addr);
+    REQUIRE_NOTHROW(ThrowWithNonConstexprInputIfNonZero(0));
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Sites in the same function share its entry")
+{
+    std::vector<eforce::ExceptionInfo> sites;
+    exceptionForcer.VisitExceptionsInFunction("ThrowIfOutOfRange(int)", [&] (eforce::ExceptionInfo const& info) {
+        sites.push_back(info);
+    });
+    REQUIRE(sites.size() == 2);
+    std::sort(sites.begin(), sites.end(), [] (eforce::ExceptionInfo const& a, eforce::ExceptionInfo const& b) {
+        return a.line < b.line;
+    });
+    auto below = sites[0].addr;
+    auto above = sites[1].addr;
+
+    // The entry throws whatever was forced last, for as long as any site
+    // in the function is forced
+    exceptionForcer.ForceException(below);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::out_of_range);
+    exceptionForcer.ForceException(above);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::length_error);
+    exceptionForcer.UnforceException(below);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::length_error);
+    exceptionForcer.UnforceException(above);
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(-1), std::out_of_range);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(101), std::length_error);
+
+    exceptionForcer.ForceException(below);
+    exceptionForcer.ForceExceptionIf(above, eforce::EveryNthCall(2));
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::length_error);
+    exceptionForcer.UnforceException(above);
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::length_error);
+    exceptionForcer.UnforceException(below);
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+
+    eforce::ForceBatch forceBatch;
+    forceBatch.ForceException(above);
+    forceBatch.ForceException(below);
+    exceptionForcer.Apply(forceBatch);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::out_of_range);
+
+    eforce::ForceBatch unforceBatch;
+    unforceBatch.UnforceException(below);
+    unforceBatch.UnforceException(above);
+    exceptionForcer.Apply(unforceBatch);
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+
+    exceptionForcer.ForceException(below);
+    exceptionForcer.ForceException(above);
+    exceptionForcer.UnforceAll();
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+    exceptionForcer.ForceException(below);
+    REQUIRE_THROWS_AS(ThrowIfOutOfRange(0), std::out_of_range);
+    exceptionForcer.UnforceException(below);
+    REQUIRE_NOTHROW(ThrowIfOutOfRange(0));
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Batches are applied all at once")
+{
+    auto throwIfNonZero = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+    auto throwMyException = GetExceptionInfoByFnName("ThrowMyExceptionIfNonZero(int)");
+    auto nonConstexpr = GetExceptionInfoByFnName("ThrowWithNonConstexprInputIfNonZero(int)");
+
+    eforce::ForceBatch invalidBatch;
+    invalidBatch.ForceException(throwIfNonZero.addr);
+    invalidBatch.ForceException(nonConstexpr.addr);
+    REQUIRE_THROWS(exceptionForcer.Apply(invalidBatch));
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+
+    eforce::ForceBatch forceBatch;
+    forceBatch.ForceException(throwIfNonZero.addr);
+    forceBatch.ForceException(throwMyException.addr);
+    exceptionForcer.Apply(forceBatch);
+    REQUIRE_THROWS_AS(ThrowIfNonZero(0), std::runtime_error);
+    REQUIRE_THROWS_AS(ThrowMyExceptionIfNonZero(0), MyException);
+
+    eforce::ForceBatch unforceBatch;
+    unforceBatch.UnforceException(throwIfNonZero.addr);
+    unforceBatch.ForceException(throwMyException.addr);
+    unforceBatch.UnforceException(throwMyException.addr);
+    exceptionForcer.Apply(unforceBatch);
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE_NOTHROW(ThrowMyExceptionIfNonZero(0));
+}
+
+TEST_CASE("Batches that fail to write are undone")
+{
+    WriteFailures failures;
+    ScopedCodeWriterFactory factory([&] {
+        return std::unique_ptr<eforce::ICodeWriter>(new FailingCodeWriter(failures));
+    });
+    eforce::ExceptionForcer exceptionForcer;
+
+    void* throwIfNonZero = nullptr;
+    exceptionForcer.VisitExceptionsInFunction("ThrowIfNonZero(int)", [&] (eforce::ExceptionInfo const& info) {
+        throwIfNonZero = info.addr;
+    });
+    void* throwMyException = nullptr;
+    exceptionForcer.VisitExceptionsInFunction("ThrowMyExceptionIfNonZero(int)", [&] (eforce::ExceptionInfo const& info) {
+        throwMyException = info.addr;
+    });
+    REQUIRE(throwIfNonZero != nullptr);
+    REQUIRE(throwMyException != nullptr);
+
+    // Each function takes a stub and a branch to it, fail once the first
+    // function is forced
+    eforce::ForceBatch batch;
+    batch.ForceException(throwIfNonZero);
+    batch.ForceException(throwMyException);
+    failures.patchesBeforeFailure = 3;
+    failures.failures = 1;
+    REQUIRE_THROWS_WITH(exceptionForcer.Apply(batch), "Write failed");
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE_NOTHROW(ThrowMyExceptionIfNonZero(0));
+
+    exceptionForcer.Apply(batch);
+    REQUIRE_THROWS_AS(ThrowIfNonZero(0), std::runtime_error);
+    REQUIRE_THROWS_AS(ThrowMyExceptionIfNonZero(0), MyException);
+    exceptionForcer.UnforceAll();
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+
+    // If the code can't be put back either, a stub may still be branched
+    // to and is never handed out again
+    failures.written.clear();
+    failures.patchesBeforeFailure = 1;
+    failures.failures = 2;
+    REQUIRE_THROWS(exceptionForcer.ForceException(throwIfNonZero));
+    REQUIRE(failures.written.size() == 1);
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+
+    std::this_thread::sleep_for(eforce::StubPool::k_quiescentPeriod + std::chrono::milliseconds(10));
+    std::vector<uint8_t*> slots;
+    for (int i = 0; i < 1000; ++i)
+        slots.push_back(eforce::StubPool::Get().Allocate(reinterpret_cast<void*>(&ThrowIfNonZero), size_t(1) << 30));
+    REQUIRE(std::find(slots.begin(), slots.end(), failures.written.front()) == slots.end());
+
+    for (auto pSlot : slots)
+    {
+        if (pSlot)
+            eforce::StubPool::Get().Free(pSlot);
+    }
+}
+
+TEST_CASE("Exceptions can be forced with every code writer")
+{
+    for (auto codeWriter : {"mprotect", "procmem"})
+    {
+        ScopedEnv codeWriterEnv("EFORCE_CODE_WRITER", codeWriter);
+        eforce::ExceptionForcer exceptionForcer;
+
+        void* site = nullptr;
+        exceptionForcer.VisitExceptionsInFunction("ThrowIfNonZero(int)", [&] (eforce::ExceptionInfo const& info) {
+            site = info.addr;
+        });
+        REQUIRE(site != nullptr);
+
+        exceptionForcer.ForceException(site);
+        REQUIRE_THROWS_AS(ThrowIfNonZero(0), std::runtime_error);
+        exceptionForcer.UnforceException(site);
+        REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    }
+
+    ScopedEnv codeWriterEnv("EFORCE_CODE_WRITER", "bogus");
+    REQUIRE_THROWS(eforce::ExceptionForcer());
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be toggled while the function is running")
+{
+    // A padded function's entry is a single instruction, so any thread can
+    // be anywhere in it while we patch
+    auto padded = GetExceptionInfoByFnName("DoubleIfPositivePadded(int)");
+
+    // Every call has to either return the right value or throw the forced
+    // exception, anything else means it ran a half written patch
+    std::atomic<bool> running{true};
+    std::atomic<size_t> calls{0};
+    std::atomic<size_t> throws{0};
+    std::atomic<size_t> wrongResults{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 2; ++i)
+    {
+        callers.emplace_back([&] {
+            while (running)
+            {
+                try
+                {
+                    if (DoubleIfPositivePadded(21) != 42)
+                        ++wrongResults;
+                }
+                catch (std::invalid_argument const&)
+                {
+                    ++throws;
+                }
+                catch (...)
+                {
+                    ++wrongResults;
+                }
+                ++calls;
+            }
+        });
+    }
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        exceptionForcer.ForceException(padded.addr);
+        exceptionForcer.UnforceException(padded.addr);
+        exceptionForcer.ForceExceptionIf(padded.addr, eforce::EveryNthCall(2));
+        exceptionForcer.ForceException(padded.addr);
+        exceptionForcer.UnforceException(padded.addr);
+    }
+
+    running = false;
+    for (auto& caller : callers)
+        caller.join();
+
+    REQUIRE(calls > 0);
+    REQUIRE(wrongResults == 0);
+    REQUIRE(DoubleIfPositivePadded(21) == 42);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Padded functions are forced without touching their body")
+{
+    auto padded = GetExceptionInfoByFnName("ThrowIfNonZeroPadded(int)");
+
+    // Only the entry nop changes, the function's own code stays as it was
+    auto pBody = static_cast<uint8_t const*>(padded.parentFn.start) + 4;
+    std::vector<uint8_t> body(pBody, pBody + 16);
+
+    exceptionForcer.ForceException(padded.addr);
+    REQUIRE_THROWS_AS(ThrowIfNonZeroPadded(0), std::runtime_error);
+#if defined(EFORCE_PATCHABLE_ENTRY_NOPS)
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+#endif
+
+    exceptionForcer.ForceException(padded.addr, std::make_exception_ptr(MyException("Replaced")));
+    REQUIRE_THROWS_AS(ThrowIfNonZeroPadded(0), MyException);
+
+    exceptionForcer.ForceException(padded.addr);
+    REQUIRE_THROWS_AS(ThrowIfNonZeroPadded(0), std::runtime_error);
+
+    exceptionForcer.UnforceException(padded.addr);
+    REQUIRE_NOTHROW(ThrowIfNonZeroPadded(0));
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Forcing only writes a branch over the function entry")
+{
+    auto info = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+
+    // The throw stub lives elsewhere, the function only gets a branch to it
+    auto pBody = static_cast<uint8_t const*>(info.parentFn.start) + 5;
+    std::vector<uint8_t> body(pBody, static_cast<uint8_t const*>(info.parentFn.end));
+
+    exceptionForcer.ForceException(info.addr);
+    REQUIRE_THROWS_AS(ThrowIfNonZero(0), std::runtime_error);
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+
+    exceptionForcer.ForceException(info.addr, std::make_exception_ptr(MyException("Replaced")));
+    REQUIRE_THROWS_AS(ThrowIfNonZero(0), MyException);
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+
+    exceptionForcer.UnforceException(info.addr);
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+}
+
+TEST_CASE("Stub slots are only reused once they have been free for a while")
+{
+    eforce::StubPool pool;
+    auto near = reinterpret_cast<void*>(&ThrowIfNonZero);
+    size_t range = size_t(1) << 30;
+
+    auto pFirst = pool.Allocate(near, range);
+    REQUIRE(pFirst != nullptr);
+    pool.Free(pFirst);
+
+    // A thread may still be in the stub that was just freed
+    auto pSecond = pool.Allocate(near, range);
+    REQUIRE(pSecond != nullptr);
+    REQUIRE(pSecond != pFirst);
+    pool.Free(pSecond);
+
+    // Then the oldest goes first
+    std::this_thread::sleep_for(eforce::StubPool::k_quiescentPeriod + std::chrono::milliseconds(10));
+    REQUIRE(pool.Allocate(near, range) == pFirst);
+    REQUIRE(pool.Allocate(near, range) == pSecond);
+
+#if defined(__x86_64__)
+    // The gap after the last mapping is used too
+    auto pTop = reinterpret_cast<void*>((uintptr_t(1) << 47) - 0x100000);
+    REQUIRE(pool.Allocate(pTop, size_t(1) << 24) != nullptr);
+#endif
+}
+
+#if defined(__x86_64__)
+TEST_CASE("Staged and atomic patches are written in order")
+{
+    auto pPage = static_cast<uint8_t*>(mmap(nullptr, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    REQUIRE(pPage != MAP_FAILED);
+
+    // The staged patch goes over the atomic one, so it's what's left
+    uint8_t const atomic[8] = {0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90};
+    uint8_t const staged[3] = {0x0f, 0x1f, 0x00};
+    eforce::BreakpointCodeWriter writer(std::unique_ptr<eforce::ICodeWriter>(new eforce::MprotectCodeWriter));
+    writer.Write({
+        eforce::CodePatch{pPage, atomic, sizeof(atomic), true},
+        eforce::CodePatch{pPage, staged, sizeof(staged), false},
+    });
+
+    REQUIRE(std::equal(staged, staged + sizeof(staged), pPage));
+    REQUIRE(std::equal(atomic + sizeof(staged), atomic + sizeof(atomic), pPage + sizeof(staged)));
+
+    // And the other way around
+    writer.Write({
+        eforce::CodePatch{pPage, staged, sizeof(staged), false},
+        eforce::CodePatch{pPage, atomic, sizeof(atomic), true},
+    });
+
+    REQUIRE(std::equal(atomic, atomic + sizeof(atomic), pPage));
+    munmap(pPage, 4096);
+}
+#endif
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Guarded exceptions are forced through their guard")
+{
+    auto guarded = GetExceptionInfoByFnName("ThrowIfNegativeGuarded(int)");
+
+    REQUIRE_NOTHROW(ThrowIfNegativeGuarded(1));
+    REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(-1), "-1");
+
+    // The guard jumps to the function's own throw, so the exception is built
+    // from its non constexpr input
+    exceptionForcer.ForceException(guarded.addr);
+    REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(1), "1");
+    REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(2), "2");
+
+    exceptionForcer.ForceException(guarded.addr, std::make_exception_ptr(MyException("Custom")));
+    REQUIRE_THROWS_AS(ThrowIfNegativeGuarded(1), MyException);
+
+    exceptionForcer.ForceException(guarded.addr);
+    REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(3), "3");
+
+    exceptionForcer.UnforceException(guarded.addr);
+    REQUIRE_NOTHROW(ThrowIfNegativeGuarded(1));
+    REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(-1), "-1");
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Flag guarded exceptions are forced without writing code")
+{
+    auto guarded = GetExceptionInfoByFnName("ThrowIfNegativeFlagGuarded(int)");
+    auto pBody = static_cast<uint8_t const*>(guarded.parentFn.start);
+    std::vector<uint8_t> body(pBody, static_cast<uint8_t const*>(guarded.parentFn.end));
+
+    REQUIRE_NOTHROW(ThrowIfNegativeFlagGuarded(1));
+    REQUIRE_THROWS_WITH(ThrowIfNegativeFlagGuarded(-1), "-1");
+
+    exceptionForcer.ForceException(guarded.addr);
+    REQUIRE_THROWS_WITH(ThrowIfNegativeFlagGuarded(1), "1");
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+
+    exceptionForcer.ForceException(guarded.addr, std::make_exception_ptr(MyException("Custom")));
+    REQUIRE_THROWS_AS(ThrowIfNegativeFlagGuarded(1), MyException);
+
+    exceptionForcer.ForceException(guarded.addr);
+    REQUIRE_THROWS_WITH(ThrowIfNegativeFlagGuarded(2), "2");
+
+    exceptionForcer.UnforceException(guarded.addr);
+    REQUIRE_NOTHROW(ThrowIfNegativeFlagGuarded(1));
+    REQUIRE(std::equal(body.begin(), body.end(), pBody));
+
+    {
+        eforce::ExceptionForcer scoped;
+        scoped.ForceException(guarded.addr);
+        REQUIRE_THROWS_WITH(ThrowIfNegativeFlagGuarded(3), "3");
+    }
+
+    REQUIRE_NOTHROW(ThrowIfNegativeFlagGuarded(1));
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced on only some calls")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    // Calls let through run the whole function with their arguments intact
+    int calls = 0;
+    exceptionForcer.ForceExceptionIf(info.addr, [&] { return ++calls % 2 == 0; });
+    REQUIRE(ScaleIfPositive(1.5, 2) == 3.0);
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.5, 2), std::invalid_argument);
+    REQUIRE(ScaleIfPositive(2.5, 4) == 10.0);
+    REQUIRE_THROWS_AS(ScaleIfPositive(2.5, 4), std::invalid_argument);
+    REQUIRE_THROWS_AS(ScaleIfPositive(2.5, 0), std::invalid_argument);
+    REQUIRE(calls == 5);
+
+    exceptionForcer.ForceExceptionIf(info.addr, std::make_exception_ptr(MyException("Custom")), [] { return true; });
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), MyException);
+
+    exceptionForcer.ForceException(info.addr);
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+
+    // A condition that throws lets the call through
+    exceptionForcer.ForceExceptionIf(info.addr, [] () -> bool { throw std::runtime_error("Condition"); });
+    REQUIRE(ScaleIfPositive(1.0, 3) == 3.0);
+
+    exceptionForcer.UnforceException(info.addr);
+    REQUIRE(ScaleIfPositive(1.0, 3) == 3.0);
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 0), std::invalid_argument);
+
+    SECTION("Padded")
+    {
+        auto padded = GetExceptionInfoByFnName("ThrowIfNonZeroPadded(int)");
+        bool fail = false;
+        exceptionForcer.ForceExceptionIf(padded.addr, [&] { return fail; });
+        REQUIRE_NOTHROW(ThrowIfNonZeroPadded(0));
+        fail = true;
+        REQUIRE_THROWS_WITH(ThrowIfNonZeroPadded(0), "Padded");
+        fail = false;
+        REQUIRE_THROWS_WITH(ThrowIfNonZeroPadded(1), "Padded");
+    }
+
+    SECTION("Guarded")
+    {
+        // The condition is asked at the function entry, not the guard
+        auto guarded = GetExceptionInfoByFnName("ThrowIfNegativeGuarded(int)");
+        REQUIRE_THROWS(exceptionForcer.ForceExceptionIf(guarded.addr, [] { return true; }));
+
+        bool fail = false;
+        exceptionForcer.ForceExceptionIf(guarded.addr, std::make_exception_ptr(MyException("Custom")), [&] { return fail; });
+        REQUIRE_NOTHROW(ThrowIfNegativeGuarded(1));
+        REQUIRE_THROWS_WITH(ThrowIfNegativeGuarded(-1), "-1");
+        fail = true;
+        REQUIRE_THROWS_AS(ThrowIfNegativeGuarded(1), MyException);
+
+        exceptionForcer.UnforceException(guarded.addr);
+        REQUIRE_NOTHROW(ThrowIfNegativeGuarded(1));
+    }
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced on a random fraction of calls")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto countThrows = [] {
+        int thrown = 0;
+        for (int i = 0; i < 10000; ++i)
+        {
+            try
+            {
+                ScaleIfPositive(1.0, 1);
+            }
+            catch (std::invalid_argument const&)
+            {
+                ++thrown;
+            }
+        }
+        return thrown;
+    };
+
+    exceptionForcer.ForceException(info.addr, 0.0);
+    REQUIRE(countThrows() == 0);
+
+    exceptionForcer.ForceException(info.addr, 1.0);
+    REQUIRE(countThrows() == 10000);
+
+    exceptionForcer.ForceException(info.addr, 0.25);
+    auto thrown = countThrows();
+    REQUIRE(thrown > 2000);
+    REQUIRE(thrown < 3000);
+
+    REQUIRE_THROWS_AS(exceptionForcer.ForceException(info.addr, 1.5), std::invalid_argument);
+    REQUIRE_THROWS_AS(eforce::WithProbability(-0.1), std::invalid_argument);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced on a schedule of calls")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto calls = [] (int count) {
+        std::string thrown;
+        for (int i = 0; i < count; ++i)
+        {
+            try
+            {
+                ScaleIfPositive(1.0, 1);
+                thrown += '.';
+            }
+            catch (std::invalid_argument const&)
+            {
+                thrown += 'x';
+            }
+        }
+        return thrown;
+    };
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnNthCall(3));
+    REQUIRE(calls(6) == "..x...");
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::EveryNthCall(2));
+    REQUIRE(calls(6) == ".x.x.x");
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::FirstCalls(2));
+    REQUIRE(calls(4) == "xx..");
+
+    REQUIRE_THROWS_AS(eforce::EveryNthCall(0), std::invalid_argument);
+
+    // Every thread counts its own calls
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnNthCall(2));
+    std::string otherThread;
+    std::thread([&] { otherThread = calls(3); }).join();
+    REQUIRE(otherThread == ".x.");
+    REQUIRE(calls(3) == ".x.");
+
+    // A schedule's slot is reused once it's gone, and counts from scratch
+    // on a thread that counted with the schedule before it
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto schedule = eforce::OnNthCall(1);
+        REQUIRE(schedule());
+        REQUIRE_FALSE(schedule());
+    }
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Forced exceptions can be rate limited")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto countThrows = [] (int count) {
+        int thrown = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            try
+            {
+                ScaleIfPositive(1.0, 1);
+            }
+            catch (std::invalid_argument const&)
+            {
+                ++thrown;
+            }
+        }
+        return thrown;
+    };
+
+    // Far too slow a refill for the test to see, only the burst throws
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::RateLimited(0.001, eforce::ThrowCondition(), 3));
+    REQUIRE(countThrows(100) == 3);
+
+    // Calls the condition doesn't pick don't use up tokens
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::RateLimited(0.001, eforce::EveryNthCall(10), 2));
+    REQUIRE(countThrows(9) == 0);
+    REQUIRE(countThrows(100) == 2);
+
+    // Neither a huge burst nor a rate whose interval doesn't fit in an
+    // int64_t overflows the bucket
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::RateLimited(0.001, eforce::ThrowCondition(), UINT64_MAX));
+    REQUIRE(countThrows(100) == 100);
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::RateLimited(std::numeric_limits<double>::denorm_min()));
+    REQUIRE(countThrows(100) == 1);
+
+    REQUIRE_THROWS_AS(eforce::RateLimited(0.0), std::invalid_argument);
+    REQUIRE_THROWS_AS(eforce::RateLimited(-1.0), std::invalid_argument);
+    REQUIRE_THROWS_AS(eforce::RateLimited(std::nan("")), std::invalid_argument);
+    REQUIRE_THROWS_AS(eforce::RateLimited(1.0, eforce::ThrowCondition(), 0), std::invalid_argument);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced for only some callers")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    exceptionForcer.ForceExceptionIf(info.addr, exceptionForcer.CalledFrom({"ScaleFromFirstCaller(double)"}));
+    REQUIRE_THROWS_AS(ScaleFromFirstCaller(1.0), std::invalid_argument);
+    REQUIRE(ScaleFromSecondCaller(1.0) == 3.0);
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    // The outer caller is only found by looking further up the stack
+    auto throughFirst = exceptionForcer.CalledFrom({"ScaleThroughFirstCaller(double)"});
+    exceptionForcer.ForceExceptionIf(info.addr, throughFirst);
+    REQUIRE(ScaleThroughFirstCaller(1.0) == 3.0);
+
+    exceptionForcer.ForceExceptionIf(info.addr, exceptionForcer.CalledFrom({"ScaleThroughFirstCaller(double)"}, 2));
+    REQUIRE_THROWS_AS(ScaleThroughFirstCaller(1.0), std::invalid_argument);
+    REQUIRE(ScaleFromFirstCaller(1.0) == 2.0);
+
+    // Filters combine with other conditions
+    exceptionForcer.ForceExceptionIf(info.addr, exceptionForcer.CalledFrom(
+        {"ScaleFromFirstCaller(double)", "ScaleFromSecondCaller(double)"}, 1, eforce::EveryNthCall(2)));
+    REQUIRE(ScaleFromFirstCaller(1.0) == 2.0);
+    REQUIRE_THROWS_AS(ScaleFromSecondCaller(1.0), std::invalid_argument);
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    REQUIRE_THROWS_AS(exceptionForcer.CalledFrom({"NoSuchFunction()"}), std::runtime_error);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced for a single fault context")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto request = eforce::FaultContext::New();
+    REQUIRE(request);
+    REQUIRE(request != eforce::FaultContext::New());
+    REQUIRE_FALSE(eforce::FaultContext::Current());
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::InFaultContext(request));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    {
+        eforce::FaultContextScope scope(request);
+        REQUIRE(eforce::FaultContext::Current() == request);
+        REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+
+        {
+            eforce::FaultContextScope otherScope(eforce::FaultContext::New());
+            REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+        }
+
+        REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+    }
+
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    // The context follows a task to another thread, which otherwise has none
+    std::function<double()> task;
+    {
+        eforce::FaultContextScope scope(request);
+        task = eforce::BindFaultContext([] { return ScaleIfPositive(1.0, 1); });
+    }
+
+    bool taskThrew = false;
+    bool plainThrew = false;
+    std::thread([&] {
+        try { task(); } catch (std::invalid_argument const&) { taskThrew = true; }
+        try { ScaleIfPositive(1.0, 1); } catch (std::invalid_argument const&) { plainThrew = true; }
+    }).join();
+    REQUIRE(taskThrew);
+    REQUIRE_FALSE(plainThrew);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Exceptions can be forced on only some threads and cpus")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto throwsOnNewThread = [] (std::function<void()> setup) {
+        bool thrown = false;
+        std::thread([&] {
+            setup();
+            try { ScaleIfPositive(1.0, 1); } catch (std::invalid_argument const&) { thrown = true; }
+        }).join();
+        return thrown;
+    };
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnEnabledThreads());
+    REQUIRE(throwsOnNewThread([] { eforce::EnableForThisThread(); }));
+    REQUIRE_FALSE(throwsOnNewThread([] {}));
+    REQUIRE_FALSE(throwsOnNewThread([] { eforce::EnableForThisThread(); eforce::DisableForThisThread(); }));
+
+    // Threads enabled for one test's token don't fault another test's sites
+    auto token = eforce::EnableToken::New();
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnEnabledThreads(token));
+    REQUIRE(throwsOnNewThread([token] { eforce::EnableForThisThread(token); }));
+    REQUIRE_FALSE(throwsOnNewThread([] { eforce::EnableForThisThread(); }));
+    REQUIRE_FALSE(throwsOnNewThread([] { eforce::EnableForThisThread(eforce::EnableToken::New()); }));
+
+    cpu_set_t allowed;
+    REQUIRE(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    unsigned cpu = 0;
+    while (!CPU_ISSET(cpu, &allowed))
+        ++cpu;
+
+    // Catch can't be used off the test's thread
+    bool pinFailed = false;
+    auto pinToCpu = [cpu, &pinFailed] {
+        cpu_set_t pinned;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        pinFailed |= sched_setaffinity(0, sizeof(pinned), &pinned) != 0;
+    };
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnCpus({cpu}));
+    REQUIRE(throwsOnNewThread(pinToCpu));
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::OnCpus({cpu + 1, cpu + 100}));
+    REQUIRE_FALSE(throwsOnNewThread(pinToCpu));
+    REQUIRE_FALSE(pinFailed);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Latency can be injected instead of an exception")
+{
+    using std::chrono::microseconds;
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    auto timeCall = [] {
+        auto start = std::chrono::steady_clock::now();
+        REQUIRE(ScaleIfPositive(2.0, 2) == 4.0);
+        return std::chrono::steady_clock::now() - start;
+    };
+
+    exceptionForcer.InjectLatency(info.addr, eforce::Latency(microseconds(2000)));
+    REQUIRE(timeCall() >= microseconds(2000));
+
+    exceptionForcer.InjectLatency(info.addr, eforce::Latency(microseconds(2000), eforce::Latency::Wait::Sleep));
+    REQUIRE(timeCall() >= microseconds(2000));
+
+    // Whichever delay is drawn from the histogram, the call is held up by it
+    exceptionForcer.InjectLatency(info.addr, eforce::Latency({{microseconds(2000), 1.0}, {microseconds(3000), 1.0}}));
+    REQUIRE(timeCall() >= microseconds(2000));
+
+    // Only the calls the condition picks are held up
+    exceptionForcer.InjectLatency(info.addr, eforce::Latency(microseconds(50000)), eforce::EveryNthCall(2));
+    REQUIRE(timeCall() < microseconds(50000));
+    REQUIRE(timeCall() >= microseconds(50000));
+    REQUIRE(timeCall() < microseconds(50000));
+    REQUIRE(timeCall() >= microseconds(50000));
+
+    exceptionForcer.UnforceException(info.addr);
+    REQUIRE(timeCall() < microseconds(50000));
+    REQUIRE(timeCall() < microseconds(50000));
+
+    // No exception needs to be built to slow a function down
+    auto nonConstexpr = GetExceptionInfoByFnName("ThrowWithNonConstexprInputIfNonZero(int)");
+    exceptionForcer.InjectLatency(nonConstexpr.addr, eforce::Latency(microseconds(1000)));
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE_NOTHROW(ThrowWithNonConstexprInputIfNonZero(0));
+    REQUIRE(std::chrono::steady_clock::now() - start >= microseconds(1000));
+
+    REQUIRE_THROWS_AS(eforce::DelayCalls(eforce::Latency(eforce::Latency::Histogram())), std::invalid_argument);
+    REQUIRE_THROWS_AS(eforce::DelayCalls(eforce::Latency({{microseconds(1), 0.0}})), std::invalid_argument);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Forced exceptions can disarm themselves")
+{
+    auto info = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    exceptionForcer.ForceException(info.addr, std::chrono::steady_clock::now() + std::chrono::milliseconds(50));
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+
+    // Give the coarse clock a few ticks past the deadline
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    exceptionForcer.ForceExceptionIf(info.addr, eforce::Until(std::chrono::steady_clock::now() - std::chrono::seconds(1)));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "Every forced exception can be unforced at once")
+{
+    auto throwIfNonZero = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+    auto scale = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    exceptionForcer.ForceException(throwIfNonZero.addr);
+    exceptionForcer.ForceException(scale.addr, 1.0);
+    exceptionForcer.UnforceAll();
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    // Sites can be forced again afterwards
+    exceptionForcer.ForceException(throwIfNonZero.addr);
+    REQUIRE_THROWS(ThrowIfNonZero(0));
+
+    eforce::ExceptionForcer otherForcer;
+    otherForcer.ForceException(scale.addr);
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+
+    eforce::ExceptionForcer::UnforceAllInProcess();
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+
+    // Forcers can keep changing what they force while it runs
+    std::atomic<bool> running{true};
+    std::thread forcing([&] {
+        while (running)
+        {
+            otherForcer.ForceException(scale.addr, 0.5);
+            otherForcer.ForceException(throwIfNonZero.addr);
+            otherForcer.UnforceException(scale.addr);
+        }
+    });
+
+    for (int i = 0; i < 200; ++i)
+        eforce::ExceptionForcer::UnforceAllInProcess();
+
+    running = false;
+    forcing.join();
+    eforce::ExceptionForcer::UnforceAllInProcess();
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE(ScaleIfPositive(1.0, 1) == 1.0);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "A site forced by several forcers is unforced at once")
+{
+    auto throwIfNonZero = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+    auto scale = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+
+    // The newer forcer patched over the older one's jump, so it has to be
+    // put back first
+    eforce::ExceptionForcer otherForcer;
+    exceptionForcer.ForceException(throwIfNonZero.addr);
+    otherForcer.ForceException(throwIfNonZero.addr);
+    REQUIRE_THROWS(ThrowIfNonZero(0));
+
+    eforce::ExceptionForcer::UnforceAllInProcess();
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+
+    // Nothing jumps to the stubs once they're reused
+    std::this_thread::sleep_for(eforce::StubPool::k_quiescentPeriod + std::chrono::milliseconds(10));
+    eforce::ExceptionForcer thirdForcer;
+    thirdForcer.ForceException(scale.addr);
+    REQUIRE_NOTHROW(ThrowIfNonZero(0));
+    REQUIRE_THROWS_AS(ScaleIfPositive(1.0, 1), std::invalid_argument);
+}
+
+TEST_CASE_METHOD(ExceptionForcerFixture, "A detour can be unforced while a thread is inside it")
+{
+    using std::chrono::milliseconds;
+    auto scale = GetExceptionInfoByFnName("ScaleIfPositive(double, int)");
+    auto add = GetExceptionInfoByFnName("AddIfPositive(double, int)");
+
+    std::atomic<bool> entered{false};
+    exceptionForcer.InjectLatency(scale.addr, eforce::Latency(milliseconds(800), eforce::Latency::Wait::Sleep), [&] {
+        entered = true;
+        return true;
+    });
+
+    // Another thread going in and out of a detour the whole time doesn't
+    // end the caller's wait
+    auto throwIfNonZero = GetExceptionInfoByFnName("ThrowIfNonZero(int)");
+    exceptionForcer.ForceExceptionIf(throwIfNonZero.addr, [] { return false; });
+    std::atomic<bool> busy{true};
+    std::thread busyCaller([&] {
+        while (busy)
+            ThrowIfNonZero(0);
+    });
+
+    double result = 0.0;
+    std::thread caller([&] { result = ScaleIfPositive(1.0, 2); });
+    while (!entered)
+        std::this_thread::yield();
+
+    // Give the unforced detour every chance to be freed and its slot to be
+    // reusable, then detour another function. It mustn't get the stub the
+    // caller is still in
+    exceptionForcer.UnforceException(scale.addr);
+    for (int i = 0; i < 2; ++i)
+    {
+        std::this_thread::sleep_for(eforce::StubPool::k_quiescentPeriod + milliseconds(100));
+        exceptionForcer.UnforceException(add.addr);
+    }
+    exceptionForcer.ForceExceptionIf(add.addr, [] { return false; });
+
+    caller.join();
+    busy = false;
+    busyCaller.join();
+    REQUIRE(result == 2.0);
+    REQUIRE(ScaleIfPositive(1.0, 2) == 2.0);
+    REQUIRE(AddIfPositive(1.0, 2) == 3.0);
+    exceptionForcer.UnforceException(add.addr);
+    exceptionForcer.UnforceException(throwIfNonZero.addr);
+}
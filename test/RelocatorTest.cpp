@@ -0,0 +1,497 @@
+#include <priv/OpcodeGeneratorAarch64.h>
+#include <priv/OpcodeGeneratorThumb.h>
+#include <priv/OpcodeGeneratorX64.h>
+#include <priv/Relocator.h>
+#include <priv/StubPool.h>
+
+#include <catch.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+// Every architecture's relocator and detour generator is built on every
+// platform, so these check their encodings without running them. Functions
+// and stubs are at made up addresses, nothing here is ever executed
+namespace
+{
+    std::vector<uint8_t> Words(std::initializer_list<uint32_t> words)
+    {
+        std::vector<uint8_t> bytes;
+        for (auto word : words)
+        {
+            for (size_t i = 0; i < sizeof(word); ++i)
+                bytes.push_back(static_cast<uint8_t>(word >> (8 * i)));
+        }
+
+        return bytes;
+    }
+
+    std::vector<uint8_t> HalfWords(std::initializer_list<uint16_t> halfWords)
+    {
+        std::vector<uint8_t> bytes;
+        for (auto halfWord : halfWords)
+        {
+            bytes.push_back(static_cast<uint8_t>(halfWord));
+            bytes.push_back(static_cast<uint8_t>(halfWord >> 8));
+        }
+
+        return bytes;
+    }
+
+    uint16_t Read16(std::vector<uint8_t> const& code, size_t offset)
+    {
+        return static_cast<uint16_t>(code.at(offset) | (code.at(offset + 1) << 8));
+    }
+
+    uint32_t Read32(std::vector<uint8_t> const& code, size_t offset)
+    {
+        REQUIRE(offset + 4 <= code.size());
+        uint32_t value;
+        std::memcpy(&value, &code[offset], sizeof(value));
+        return value;
+    }
+
+    uint64_t Read64(std::vector<uint8_t> const& code, size_t offset)
+    {
+        return Read32(code, offset) | (static_cast<uint64_t>(Read32(code, offset + 4)) << 32);
+    }
+
+    int64_t SignExtend(uint64_t value, unsigned bits)
+    {
+        auto shift = 64 - bits;
+        return static_cast<int64_t>(value << shift) >> shift;
+    }
+
+    /**
+     * @brief Finds where needle starts in code, which must be exactly once
+     */
+    size_t FindOnce(std::vector<uint8_t> const& code, std::vector<uint8_t> const& needle)
+    {
+        auto found = std::search(code.begin(), code.end(), needle.begin(), needle.end());
+        REQUIRE(found != code.end());
+        REQUIRE(std::search(found + 1, code.end(), needle.begin(), needle.end()) == code.end());
+        return found - code.begin();
+    }
+
+    void* Address(uintptr_t address)
+    {
+        return reinterpret_cast<void*>(address);
+    }
+
+    /// Where the decision and throw functions of our detours would be
+    constexpr uintptr_t k_decideFn = 0x20001000;
+    constexpr uintptr_t k_decideArg = 0x20002000;
+    constexpr uintptr_t k_throwFn = 0x20003000;
+
+    eforce::DetourSpec_t Detour(uintptr_t stub, uintptr_t fnStart, size_t codeSize, size_t displace)
+    {
+        return eforce::DetourSpec_t{
+            Address(stub),
+            Address(fnStart),
+            Address(fnStart + codeSize),
+            displace,
+            Address(k_decideFn),
+            Address(k_decideArg),
+            Address(k_throwFn),
+        };
+    }
+} // namespace
+
+TEST_CASE("x86-64 prologues are relocated")
+{
+    constexpr uintptr_t k_fnStart = 0x10000000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+    constexpr uintptr_t k_farStub = k_fnStart + (uintptr_t(1) << 32);
+
+    size_t displaced = 0;
+    auto relocate = [&] (std::vector<uint8_t> const& code, uintptr_t dest) {
+        return eforce::RelocatePrologueX64(code.data(), code.size(), k_fnStart, 5, dest, displaced);
+    };
+
+    SECTION("Instruction lengths")
+    {
+        auto length = [] (std::vector<uint8_t> const& insn) {
+            return eforce::GetInstructionLengthX64(insn.data(), insn.data() + insn.size());
+        };
+
+        REQUIRE(length({0xc3}) == 1);                                                       // ret
+        REQUIRE(length({0x66, 0x90}) == 2);                                                 // xchg ax, ax
+        REQUIRE(length({0x0f, 0x1f, 0x44, 0x00, 0x00}) == 5);                               // nop [rax+rax]
+        REQUIRE(length({0x48, 0x8b, 0x05, 0x00, 0x01, 0x00, 0x00}) == 7);                   // mov rax, [rip+0x100]
+        REQUIRE(length({0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8}) == 10);                        // movabs rax, imm64
+        REQUIRE(length({0x66, 0x81, 0x7c, 0x24, 0x08, 0x34, 0x12}) == 7);                   // cmp word [rsp+8], 0x1234
+        REQUIRE(length({0xc5, 0xf8, 0x77}) == 3);                                           // vzeroupper
+        REQUIRE(length({0xc4, 0xe2, 0x79, 0x18, 0x05, 0x00, 0x01, 0x00, 0x00}) == 9);       // vbroadcastss xmm0, [rip+0x100]
+        REQUIRE(length({0x48, 0x8b, 0x05, 0x00, 0x01}) == 0);                               // cut short
+    }
+
+    SECTION("Position independent instructions are copied")
+    {
+        std::vector<uint8_t> code{
+            0x55,                                   // push rbp
+            0x48, 0x89, 0xe5,                       // mov rbp, rsp
+            0x48, 0x83, 0xec, 0x10,                 // sub rsp, 0x10
+            0xc3,                                   // ret
+        };
+
+        REQUIRE(relocate(code, k_stub) == std::vector<uint8_t>(code.begin(), code.begin() + 8));
+        REQUIRE(displaced == 8);
+    }
+
+    SECTION("RIP relative operands still reach their target")
+    {
+        std::vector<uint8_t> code{
+            0x48, 0x8b, 0x05, 0x00, 0x01, 0x00, 0x00,   // mov rax, [rip+0x100]
+            0xc3,                                       // ret
+        };
+
+        // fnStart + 7 + 0x100 from stub + 7
+        REQUIRE(relocate(code, k_stub) == std::vector<uint8_t>{0x48, 0x8b, 0x05, 0x00, 0xf1, 0xff, 0xff});
+        REQUIRE(displaced == 7);
+
+        REQUIRE_THROWS_AS(relocate(code, k_farStub), std::runtime_error);
+    }
+
+    SECTION("Short branches become long ones")
+    {
+        std::vector<uint8_t> code{
+            0x74, 0x10,                             // je +0x10
+            0x55,                                   // push rbp
+            0x48, 0x89, 0xe5,                       // mov rbp, rsp
+            0xc3,                                   // ret
+        };
+
+        // je rel32 to fnStart + 0x12, from stub + 6
+        REQUIRE(relocate(code, k_stub) == std::vector<uint8_t>{
+            0x0f, 0x84, 0x0c, 0xf0, 0xff, 0xff,
+            0x55,
+            0x48, 0x89, 0xe5,
+        });
+        REQUIRE(displaced == 6);
+
+        code[0] = 0xeb;                             // jmp +0x10
+        REQUIRE(relocate(code, k_stub) == std::vector<uint8_t>{
+            0xe9, 0x0d, 0xf0, 0xff, 0xff,
+            0x55,
+            0x48, 0x89, 0xe5,
+        });
+
+        REQUIRE_THROWS_AS(relocate(code, k_farStub), std::runtime_error);
+    }
+
+    SECTION("Calls keep their target")
+    {
+        std::vector<uint8_t> code{
+            0xe8, 0x00, 0x01, 0x00, 0x00,           // call +0x100
+            0xc3,                                   // ret
+        };
+
+        REQUIRE(relocate(code, k_stub) == std::vector<uint8_t>{0xe8, 0x00, 0xf1, 0xff, 0xff});
+        REQUIRE(displaced == 5);
+    }
+
+    SECTION("Prologues that can't be moved are refused")
+    {
+        // loop has no long form
+        REQUIRE_THROWS_AS(relocate({0xe2, 0xfe, 0x90, 0x90, 0x90, 0xc3}, k_stub), std::runtime_error);
+
+        // The rest of the function jumps back to the mov
+        std::vector<uint8_t> loop{
+            0x55,                                   // push rbp
+            0x48, 0x89, 0xe5,                       // mov rbp, rsp
+            0x48, 0x83, 0xec, 0x10,                 // sub rsp, 0x10
+            0xeb, 0xf7,                             // jmp fnStart + 1
+        };
+        REQUIRE_THROWS_AS(relocate(loop, k_stub), std::runtime_error);
+
+        // Undecodable
+        REQUIRE_THROWS_AS(relocate({0x0f, 0x0f, 0x00, 0x00, 0x00, 0xc3}, k_stub), std::runtime_error);
+    }
+}
+
+TEST_CASE("x86-64 detours run the relocated prologue and resume after it")
+{
+    constexpr uintptr_t k_fnStart = 0x10000000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+    std::vector<uint8_t> code{
+        0x55,                                       // push rbp
+        0x48, 0x89, 0xe5,                           // mov rbp, rsp
+        0x48, 0x83, 0xec, 0x10,                     // sub rsp, 0x10
+        0xc3,                                       // ret
+    };
+
+    eforce::OpcodeGeneratorX64 generator;
+    auto detour = generator.GetDetourOpcode(Detour(k_stub, k_fnStart, code.size(), 5), code.data());
+    size_t slotSize = eforce::StubPool::k_detourSlotSize;
+    REQUIRE(detour.size() <= slotSize);
+
+    // movabs rdi, decideArg then movabs rax, decideFn
+    auto decide = FindOnce(detour, {0x48, 0xbf});
+    REQUIRE(Read64(detour, decide + 2) == k_decideArg);
+    REQUIRE(detour[decide + 10] == 0x48);
+    REQUIRE(detour[decide + 11] == 0xb8);
+    REQUIRE(Read64(detour, decide + 12) == k_decideFn);
+
+    // The prologue, then a jmp to the instruction after it
+    auto prologue = FindOnce(detour, std::vector<uint8_t>(code.begin(), code.begin() + 8));
+    auto resume = prologue + 8;
+    REQUIRE(detour[resume] == 0xe9);
+    REQUIRE(k_stub + resume + 5 + static_cast<int32_t>(Read32(detour, resume + 1)) == k_fnStart + 8);
+
+    // test rax, rax then jnz past the jmp, where the throw is
+    auto test = FindOnce(detour, {0x48, 0x85, 0xc0, 0x0f, 0x85});
+    auto throwPath = test + 9 + static_cast<int32_t>(Read32(detour, test + 5));
+    REQUIRE(throwPath == resume + 5);
+    REQUIRE(detour[throwPath] == 0x48);
+    REQUIRE(Read64(detour, throwPath + 9) == k_throwFn);
+
+    SECTION("A padded entry only resumes")
+    {
+        auto padded = generator.GetDetourOpcode(Detour(k_stub, k_fnStart, code.size(), 0), code.data());
+        REQUIRE(padded.size() == detour.size() - 8);
+
+        auto paddedResume = resume - 8;
+        REQUIRE(padded[paddedResume] == 0xe9);
+        REQUIRE(k_stub + paddedResume + 5 + static_cast<int32_t>(Read32(padded, paddedResume + 1)) == k_fnStart);
+    }
+}
+
+TEST_CASE("AArch64 prologues are relocated")
+{
+    constexpr uintptr_t k_fnStart = 0x400000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+    constexpr uintptr_t k_farStub = k_fnStart + 0x10000000;
+
+    size_t displaced = 0;
+    auto relocate = [&] (uint32_t insn, uintptr_t dest) {
+        auto code = Words({insn, 0xd65f03c0});      // insn; ret
+        return eforce::RelocatePrologueAarch64(code.data(), code.size(), k_fnStart, 4, dest, displaced);
+    };
+
+    // Loads from a literal branched over, ldr xt, #8; b #12; .quad
+    auto loadAddress = [] (uint32_t rt, uint64_t address) {
+        return Words({0x58000040 | rt, 0x14000003, static_cast<uint32_t>(address), static_cast<uint32_t>(address >> 32)});
+    };
+
+    auto concat = [] (std::vector<uint8_t> a, std::vector<uint8_t> const& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    };
+
+    SECTION("Position independent instructions are copied")
+    {
+        REQUIRE(relocate(0xa9bf7bfd, k_stub) == Words({0xa9bf7bfd}));   // stp x29, x30, [sp, #-16]!
+        REQUIRE(displaced == 4);
+    }
+
+    SECTION("adr and adrp become loads of their address")
+    {
+        REQUIRE(relocate(0x10000200, k_stub) == loadAddress(0, k_fnStart + 0x40));     // adr x0, #0x40
+        REQUIRE(relocate(0xb0000001, k_stub) == loadAddress(1, k_fnStart + 0x1000));   // adrp x1, #0x1000
+        REQUIRE(relocate(0xb0000001, k_farStub) == loadAddress(1, k_fnStart + 0x1000));
+    }
+
+    SECTION("Literal loads load through the literal's address")
+    {
+        auto literal = k_fnStart + 0x20;
+        REQUIRE(relocate(0x58000102, k_stub) == concat(loadAddress(17, literal), Words({0xf9400222})));   // ldr x2
+        REQUIRE(relocate(0x18000103, k_stub) == concat(loadAddress(17, literal), Words({0xb9400223})));   // ldr w3
+        REQUIRE(relocate(0x98000104, k_stub) == concat(loadAddress(17, literal), Words({0xb9800224})));   // ldrsw x4
+        REQUIRE(relocate(0x9c000100, k_stub) == concat(loadAddress(17, literal), Words({0x3dc00220})));   // ldr q0
+        REQUIRE(relocate(0xd8000100, k_stub) == Words({0xd503201f}));                                     // prfm, dropped
+    }
+
+    SECTION("b and bl reach their target from anywhere")
+    {
+        // b #0x100, directly from close by and through x17 from far away
+        REQUIRE(relocate(0x14000040, k_stub) == Words({0x17fffc40}));
+        REQUIRE(relocate(0x14000040, k_farStub) == Words({0x58000051, 0xd61f0220, k_fnStart + 0x100, 0}));
+
+        // bl #0x100 returns past its literal
+        REQUIRE(relocate(0x94000040, k_stub) == Words({0x58000071, 0xd63f0220, 0x14000003, k_fnStart + 0x100, 0}));
+    }
+
+    SECTION("Conditional branches branch to a branch to their target")
+    {
+        // Taken goes two instructions on, otherwise we skip the branch
+        for (auto insn : {0x54000100u, 0xb4000100u, 0x36180100u})    // b.eq, cbz x0, tbz w0, #3, each to #0x20
+        {
+            auto retargeted = (insn & ~(insn == 0x36180100u ? (0x3fffu << 5) : (0x7ffffu << 5))) | (2u << 5);
+            REQUIRE(relocate(insn, k_stub) == Words({retargeted, 0x14000002, 0x17fffc06}));
+            REQUIRE(relocate(insn, k_farStub) == Words({retargeted, 0x14000005, 0x58000051, 0xd61f0220, k_fnStart + 0x20, 0}));
+        }
+    }
+
+    SECTION("Only a single instruction is relocated")
+    {
+        auto code = Words({0xa9bf7bfd, 0xd65f03c0});
+        REQUIRE_THROWS_AS(eforce::RelocatePrologueAarch64(code.data(), code.size(), k_fnStart, 8, k_stub, displaced),
+            std::runtime_error);
+    }
+}
+
+TEST_CASE("AArch64 detours run the relocated prologue and resume after it")
+{
+    constexpr uintptr_t k_fnStart = 0x400000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+    auto code = Words({0xa9bf7bfd, 0xd65f03c0});    // stp x29, x30, [sp, #-16]!; ret
+
+    eforce::OpcodeGeneratorAarch64 generator;
+    auto detour = generator.GetDetourOpcode(Detour(k_stub, k_fnStart, code.size(), 4), code.data());
+    size_t slotSize = eforce::StubPool::k_detourSlotSize;
+    REQUIRE(detour.size() <= slotSize);
+    REQUIRE(detour.size() % 8 == 0);
+
+    // The prologue, then a b to the instruction after it
+    auto prologue = FindOnce(detour, Words({0xa9bf7bfd}));
+    auto resume = prologue + 4;
+    auto b = Read32(detour, resume);
+    REQUIRE((b & 0xfc000000) == 0x14000000);
+    REQUIRE(k_stub + resume + SignExtend(b & 0x3ffffff, 26) * 4 == k_fnStart + 4);
+
+    // cbnz x0 goes past the b, to the throw
+    size_t throwPath = 0;
+    std::map<uint32_t, std::vector<uint64_t>> literals;
+    for (size_t offset = 0; offset < resume; offset += 4)
+    {
+        auto insn = Read32(detour, offset);
+        if ((insn & 0xff00001f) == 0xb5000000)
+            throwPath = offset + SignExtend((insn >> 5) & 0x7ffff, 19) * 4;
+    }
+
+    REQUIRE(throwPath == resume + 4);
+    REQUIRE(Read32(detour, throwPath) == 0xa8ce7bfd);   // ldp x29, x30, [sp], #224
+
+    // Every ldr xt, literal loads one of the spec's addresses
+    for (size_t offset = 0; offset < detour.size() - 24; offset += 4)
+    {
+        auto insn = Read32(detour, offset);
+        if ((insn & 0xff000000) == 0x58000000)
+            literals[insn & 0x1f].push_back(Read64(detour, offset + SignExtend((insn >> 5) & 0x7ffff, 19) * 4));
+    }
+
+    REQUIRE(literals[0] == std::vector<uint64_t>{k_decideArg});
+    REQUIRE(literals[16] == (std::vector<uint64_t>{k_decideFn, k_throwFn}));
+}
+
+TEST_CASE("Thumb-2 prologues are relocated")
+{
+    constexpr uintptr_t k_fnStart = 0x10000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+
+    size_t displaced = 0;
+    auto relocate = [&] (std::vector<uint8_t> const& code) {
+        return eforce::RelocatePrologueThumb(code.data(), code.size(), k_fnStart, 4, k_stub, displaced);
+    };
+
+    SECTION("Position independent instructions are copied")
+    {
+        auto code = HalfWords({0xb510, 0xb082, 0x4770});    // push {r4, lr}; sub sp, #8; bx lr
+        REQUIRE(relocate(code) == HalfWords({0xb510, 0xb082}));
+        REQUIRE(displaced == 4);
+
+        code = HalfWords({0xe92d, 0x4ff0, 0x4770});         // push.w {r4-r11, lr}; bx lr
+        REQUIRE(relocate(code) == HalfWords({0xe92d, 0x4ff0}));
+        REQUIRE(displaced == 4);
+    }
+
+    SECTION("Literal loads load through the literal's address")
+    {
+        // ldr r0, [pc, #8] from fnStart + 4 + 8, movw/movt r0 then ldr r0, [r0]
+        REQUIRE(relocate(HalfWords({0x4802, 0xb510, 0x4770})) == HalfWords({
+            0xf240, 0x000c, 0xf2c0, 0x0001, 0x6800,
+            0xb510,
+        }));
+
+        // ldr.w r2, [pc, #0x10] and [pc, #-0x10]
+        REQUIRE(relocate(HalfWords({0xf8df, 0x2010, 0x4770})) == HalfWords({
+            0xf240, 0x0214, 0xf2c0, 0x0201, 0xf8d2, 0x2000,
+        }));
+        REQUIRE(relocate(HalfWords({0xf85f, 0x2010, 0x4770})) == HalfWords({
+            0xf64f, 0x72f4, 0xf2c0, 0x0200, 0xf8d2, 0x2000,
+        }));
+    }
+
+    SECTION("adr becomes a load of its address")
+    {
+        // adr r1, #4
+        REQUIRE(relocate(HalfWords({0xa101, 0xb510, 0x4770})) == HalfWords({
+            0xf240, 0x0108, 0xf2c0, 0x0101,
+            0xb510,
+        }));
+    }
+
+    SECTION("Prologues that can't be moved are refused")
+    {
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xe7fe, 0xb510, 0x4770})), std::runtime_error);       // b.n
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xb118, 0xb510, 0x4770})), std::runtime_error);       // cbz r0
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xd001, 0xb510, 0x4770})), std::runtime_error);       // beq
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xf000, 0xf800, 0x4770})), std::runtime_error);       // bl
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xbf08, 0xb510, 0x4770})), std::runtime_error);       // it eq
+        REQUIRE_THROWS_AS(relocate(HalfWords({0x4478, 0xb510, 0x4770})), std::runtime_error);       // add r0, pc
+
+        // The rest of the function branches back to the sub
+        REQUIRE_THROWS_AS(relocate(HalfWords({0xb510, 0xb082, 0xe7fd})), std::runtime_error);
+    }
+}
+
+TEST_CASE("Thumb-2 detours run the relocated prologue and resume after it")
+{
+    constexpr uintptr_t k_fnStart = 0x10000;
+    constexpr uintptr_t k_stub = k_fnStart + 0x1000;
+    auto code = HalfWords({0xb510, 0xb082, 0x4770});    // push {r4, lr}; sub sp, #8; bx lr
+
+    eforce::OpcodeGeneratorThumb generator;
+    auto detour = generator.GetDetourOpcode(Detour(k_stub, k_fnStart, code.size(), 4), code.data());
+    size_t slotSize = eforce::StubPool::k_detourSlotSize;
+    REQUIRE(detour.size() <= slotSize);
+
+    // The prologue, then a b.w to the instruction after it
+    auto prologue = FindOnce(detour, HalfWords({0xb510, 0xb082}));
+    auto resume = prologue + 4;
+    auto first = Read16(detour, resume);
+    auto second = Read16(detour, resume + 2);
+    REQUIRE((first & 0xf800) == 0xf000);
+    REQUIRE((second & 0xd000) == 0x9000);
+    int64_t s = (first >> 10) & 1;
+    int64_t i1 = !(((second >> 13) & 1) ^ s);
+    int64_t i2 = !(((second >> 11) & 1) ^ s);
+    auto offset = SignExtend((s << 24) | (i1 << 23) | (i2 << 22) | ((first & 0x3ff) << 12) | ((second & 0x7ff) << 1), 25);
+    REQUIRE(k_stub + resume + 4 + offset == k_fnStart + 4);
+
+    // cbz r0 skips the throw, to where the arguments are restored before
+    // the prologue
+    size_t continuePath = 0;
+    for (size_t pos = 0; pos < prologue; pos += 2)
+    {
+        auto halfWord = Read16(detour, pos);
+        if ((halfWord & 0xfd07) == 0xb100)
+            continuePath = pos + 4 + ((((halfWord >> 9) & 1) << 6) | (((halfWord >> 3) & 0x1f) << 1));
+    }
+
+    REQUIRE(continuePath != 0);
+    REQUIRE(continuePath < prologue);
+    REQUIRE((Read16(detour, continuePath) == 0xe8bd || Read16(detour, continuePath) == 0xecbd));
+
+    // Every ldr.w rt, [pc, #imm] loads one of the spec's addresses
+    std::map<uint32_t, uint32_t> literals;
+    for (size_t pos = 0; pos + 4 <= prologue; pos += 2)
+    {
+        if (Read16(detour, pos) != 0xf8df)
+            continue;
+
+        auto load = Read16(detour, pos + 2);
+        auto base = (k_stub + pos + 4) & ~uintptr_t(3);
+        literals[load >> 12] = Read32(detour, base + (load & 0xfff) - k_stub);
+    }
+
+    REQUIRE(literals[0] == k_decideArg);
+    REQUIRE(literals[12] == k_decideFn);
+    REQUIRE(literals[15] == k_throwFn);
+}
@@ -1,2 +1,5 @@
 #define CATCH_CONFIG_MAIN
+// Newer glibc no longer has a constant MINSIGSTKSZ which this catch version
+// relies on for its alternate signal stack
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 #include <catch.hpp>